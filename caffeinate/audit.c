@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "caffeinate.h"
+
+/*
+ * The audit ring is a fixed-size file of 64-byte records shared by every
+ * caffeinate on the host. Appending is a fetch-and-add on the head index
+ * followed by a store into the mapped slot: no syscalls, no locks. A record
+ * is valid once its sequence equals its ring index + 1; the sequence is
+ * cleared first and published last, so a reader never trusts a record that
+ * is being overwritten.
+ */
+
+#define kAuditPath              "/var/log/caffeinate.audit"
+#define kAuditMagic             0x54445541      /* "AUDT" */
+#define kAuditVersion           2
+#define kAuditCapacity          16384           /* 1 MB of records */
+
+typedef struct {
+    uint64_t    sequence;
+    int64_t     start;          /* CLOCK_REALTIME ns the assertion was taken */
+    int64_t     duration;       /* ns held; 0 for kAuditCreate */
+    int64_t     latency;        /* ns spent in the backend call; -1 if none was made */
+    int32_t     pid;
+    int32_t     result;         /* IOReturn or errno from the backend */
+    uint16_t    event;          /* AuditEvent */
+    uint16_t    type;           /* AssertionFlag */
+    char        command[20];
+} AuditRecord;
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    capacity;
+    uint32_t    recordSize;
+    uint64_t    head;
+    uint8_t     reserved[40];
+    AuditRecord records[];
+} AuditRing;
+
+static AuditRing        *auditRing = NULL;
+static const AuditRing  *auditReadRing = NULL;
+static int              auditUnavailable = 0;
+
+static const char *
+auditPath(void)
+{
+    const char *path = getenv("CAFFEINATE_AUDIT");
+
+    return (path && *path) ? path : kAuditPath;
+}
+
+static size_t
+auditRingSize(uint32_t capacity)
+{
+    return sizeof(AuditRing) + (size_t)capacity * sizeof(AuditRecord);
+}
+
+static AuditRing *
+auditMap(int writable)
+{
+    size_t size = auditRingSize(kAuditCapacity);
+    AuditRing *ring;
+    struct stat sb;
+    int fd;
+
+    fd = open(auditPath(), writable ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &sb) < 0
+        || (sb.st_size < (off_t)size && (!writable || ftruncate(fd, (off_t)size) < 0))) {
+        close(fd);
+        return NULL;
+    }
+    ring = mmap(NULL, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    /* First writer stamps the header, under the same lock as the status page. */
+    if (writable && __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != kAuditMagic
+        && flock(fd, LOCK_EX) == 0) {
+        if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != kAuditMagic && !ring->version) {
+            ring->version = kAuditVersion;
+            ring->capacity = kAuditCapacity;
+            ring->recordSize = sizeof(AuditRecord);
+            __atomic_store_n(&ring->magic, kAuditMagic, __ATOMIC_RELEASE);
+        }
+        (void)flock(fd, LOCK_UN);
+    }
+    close(fd);
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != kAuditMagic
+        || ring->version != kAuditVersion || ring->capacity != kAuditCapacity
+        || ring->recordSize != sizeof(AuditRecord)) {
+        munmap(ring, size);
+        return NULL;
+    }
+    return ring;
+}
+
+int64_t
+auditNow(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+auditRecord(AuditEvent event, AssertionFlag type, pid_t pid, const char *command,
+            int64_t start, int64_t duration, int64_t latency, int result)
+{
+    AuditRecord *record;
+    uint64_t index;
+
+    if (!auditRing) {
+        if (auditUnavailable || !(auditRing = auditMap(1))) {
+            auditUnavailable = 1;
+            return;
+        }
+    }
+
+    index = __atomic_fetch_add(&auditRing->head, 1, __ATOMIC_RELAXED);
+    record = &auditRing->records[index % auditRing->capacity];
+
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->start = start;
+    record->duration = duration;
+    record->latency = latency;
+    record->pid = pid;
+    record->result = result;
+    record->event = (uint16_t)event;
+    record->type = (uint16_t)type;
+    memset(record->command, 0, sizeof(record->command));
+    if (command) {
+        const char *base = strrchr(command, '/');
+        strncpy(record->command, base ? base + 1 : command, sizeof(record->command) - 1);
+    }
+    __atomic_store_n(&record->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Visit every committed record from cursor->next up to the current head,
+ * and advance the cursor past them. A record still being written stops the
+ * scan, and the next one resumes there; if it is still unpublished by then,
+ * its writer died and it is skipped. Returns the number of records that
+ * were overwritten or abandoned before they could be read.
+ */
+uint64_t
+auditScan(AuditCursor *cursor, AuditVisitor visitor, void *context)
+{
+    const AuditRing *ring;
+    uint64_t head, index, sequence, lost = 0;
+
+    if (!auditReadRing && !(auditReadRing = auditMap(0))) {
+        return 0;
+    }
+    ring = auditReadRing;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head - cursor->next > ring->capacity) {
+        lost = head - ring->capacity - cursor->next;
+        cursor->next = head - ring->capacity;
+    }
+    for (; cursor->next < head; cursor->next++) {
+        const AuditRecord *slot;
+        AuditRecord record;
+        AuditEntry entry;
+
+        index = cursor->next;
+        slot = &ring->records[index % ring->capacity];
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence == index + 1) {
+            memcpy(&record, (const void *)slot, sizeof(record));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+        }
+        if (sequence != index + 1) {
+            if (sequence <= index && cursor->stalled != index + 1) {
+                cursor->stalled = index + 1;
+                return lost;
+            }
+            /* Overwritten by a later lap, or abandoned mid-write. */
+            lost++;
+            continue;
+        }
+
+        entry.event = (AuditEvent)record.event;
+        entry.type = (AssertionFlag)record.type;
+        entry.pid = record.pid;
+        entry.result = record.result;
+        entry.start = record.start;
+        entry.duration = record.duration;
+        entry.latency = record.latency;
+        memcpy(entry.command, record.command, sizeof(record.command));
+        entry.command[sizeof(record.command)] = '\0';
+        visitor(&entry, context);
+    }
+    cursor->stalled = 0;
+    return lost;
+}
+
+/**************************************************
+ * caffeinate --audit
+ **************************************************/
+
+typedef struct {
+    char        command[32];
+    AssertionFlag type;
+    uint64_t    holds;
+    uint64_t    failures;
+    int64_t     held;
+} AuditTotal;
+
+typedef struct {
+    AuditTotal  *totals;
+    size_t      count;
+    size_t      records;
+    int64_t     oldest;
+} AuditSummary;
+
+static int
+auditCompareHeld(const void *a, const void *b)
+{
+    const AuditTotal *left = a, *right = b;
+
+    return (left->held < right->held) - (left->held > right->held);
+}
+
+static void
+auditFormatDuration(char *buffer, size_t size, int64_t ns)
+{
+    int64_t seconds = ns / 1000000000;
+
+    if (seconds >= 3600) {
+        (void)snprintf(buffer, size, "%lldh %02lldm %02llds", (long long)(seconds / 3600),
+                       (long long)(seconds / 60 % 60), (long long)(seconds % 60));
+    } else if (seconds >= 60) {
+        (void)snprintf(buffer, size, "%lldm %02llds", (long long)(seconds / 60),
+                       (long long)(seconds % 60));
+    } else {
+        (void)snprintf(buffer, size, "%.3fs", (double)ns / 1e9);
+    }
+}
+
+static void
+auditSummarize(const AuditEntry *entry, void *context)
+{
+    AuditSummary *summary = context;
+    size_t j;
+
+    if (entry->event != kAuditCreate && entry->event != kAuditRelease) {
+        return;
+    }
+    summary->records++;
+    if (!summary->oldest || entry->start < summary->oldest) summary->oldest = entry->start;
+    for (j = 0; j < summary->count; j++) {
+        if (summary->totals[j].type == entry->type
+            && !strcmp(summary->totals[j].command, entry->command)) break;
+    }
+    if (j == summary->count) {
+        memcpy(summary->totals[j].command, entry->command, sizeof(entry->command));
+        summary->totals[j].type = entry->type;
+        summary->count++;
+    }
+    if (entry->event == kAuditCreate && entry->result != 0) {
+        summary->totals[j].failures++;
+    } else if (entry->event == kAuditRelease) {
+        summary->totals[j].holds++;
+        summary->totals[j].held += entry->duration;
+    }
+}
+
+/*
+ * Aggregate hold time by command and assertion type over whatever the ring
+ * still holds.
+ */
+int
+auditShow(void)
+{
+    AuditSummary summary;
+    AuditCursor cursor = { 0, 0 };
+    size_t i;
+
+    if (!auditReadRing && !(auditReadRing = auditMap(0))) {
+        fprintf(stderr, "No caffeinate audit ring at %s\n", auditPath());
+        return 1;
+    }
+    memset(&summary, 0, sizeof(summary));
+    summary.totals = calloc(kAuditCapacity, sizeof(*summary.totals));
+    if (!summary.totals) {
+        perror("");
+        return 1;
+    }
+    do {
+        /* Give a record being written a moment before skipping it. */
+        if (cursor.stalled) (void)usleep(10000);
+        (void)auditScan(&cursor, auditSummarize, &summary);
+    } while (cursor.stalled);
+
+    qsort(summary.totals, summary.count, sizeof(*summary.totals), auditCompareHeld);
+    printf("%-20s %-8s %8s %8s %16s\n", "COMMAND", "TYPE", "HOLDS", "FAILED", "HELD");
+    for (i = 0; i < summary.count; i++) {
+        AuditTotal *total = &summary.totals[i];
+        char held[32];
+
+        auditFormatDuration(held, sizeof(held), total->held);
+        printf("%-20s %-8s %8llu %8llu %16s\n", total->command[0] ? total->command : "(forever)",
+               assertionTypeName(total->type), (unsigned long long)total->holds,
+               (unsigned long long)total->failures, held);
+    }
+    if (summary.oldest) {
+        time_t when = (time_t)(summary.oldest / 1000000000);
+        char since[32];
+
+        (void)strftime(since, sizeof(since), "%Y-%m-%d %H:%M:%S", localtime(&when));
+        printf("(%zu records since %s)\n", summary.records, since);
+    }
+
+    free(summary.totals);
+    return 0;
+}
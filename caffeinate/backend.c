@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "caffeinate.h"
+
+/*
+ * Each assertion type is routed to one backend. The table below is all that
+ * is looked at to pick them; a backend's init() runs only when the first
+ * assertion is actually created through it, so a backend that is never
+ * asked for costs nothing, and one that is costs nothing until it is
+ * needed (after the fork, concurrently with the child's setup).
+ */
+
+static int
+noneCreate(AssertionFlag type, const char *details)
+{
+    (void)type;
+    (void)details;
+    return 0;
+}
+
+static int
+noneRelease(AssertionFlag type)
+{
+    (void)type;
+    return 0;
+}
+
+static int
+noneQuery(AssertionFlag type)
+{
+    (void)type;
+    return kBackendNotHeld;
+}
+
+/* Asserts nothing, successfully: for dry runs and hosts without a power manager. */
+static const AssertionBackend noneBackend = {
+    .name           = "none",
+    .types          = kIdleAssertionFlag | kDisplayAssertionFlag | kSystemAssertionFlag,
+    .inheritable    = 1,
+    .create         = noneCreate,
+    .release        = noneRelease,
+    .query          = noneQuery,
+};
+
+static const AssertionBackend *const backends[] = {
+#if defined(__APPLE__)
+    &iokitBackend,
+#else
+    &logindBackend,
+    &screenSaverBackend,
+    &wakeLockBackend,
+#endif
+    &noneBackend,
+};
+
+#define kBackendCount           (sizeof(backends)/sizeof(backends[0]))
+#define kBackendTypes           3
+
+/* Per assertion type (idle, display, system); the platform's own by default. */
+static const AssertionBackend   *backendRoute[kBackendTypes] = { NULL, NULL, NULL };
+static int                      backendLoaded[kBackendCount];
+
+static int
+backendTypeIndex(AssertionFlag type)
+{
+    switch (type) {
+        case kIdleAssertionFlag:    return 0;
+        case kDisplayAssertionFlag: return 1;
+        case kSystemAssertionFlag:  return 2;
+        default:                    return -1;
+    }
+}
+
+static size_t
+backendIndex(const AssertionBackend *backend)
+{
+    size_t i;
+
+    for (i = 0; i < kBackendCount && backends[i] != backend; i++)
+        ;
+    return i;
+}
+
+/*
+ * caffeinate --backend: send every assertion type through the named
+ * backend instead of the platform's own.
+ */
+int
+backendSelect(const char *name)
+{
+    size_t i;
+    int type;
+
+    for (i = 0; i < kBackendCount; i++) {
+        if (strcmp(backends[i]->name, name)) continue;
+        for (type = 0; type < kBackendTypes; type++) {
+            backendRoute[type] = backends[i];
+        }
+        return 0;
+    }
+    fprintf(stderr, "caffeinate: unknown backend %s; available:", name);
+    for (i = 0; i < kBackendCount; i++) {
+        fprintf(stderr, " %s", backends[i]->name);
+    }
+    fprintf(stderr, "\n");
+    return -1;
+}
+
+/*
+ * logind has no display lock of its own, only the session-wide "idle"
+ * inhibitor; in a desktop session -d goes to the screen saver instead,
+ * which is what actually blanks the display.
+ */
+static const AssertionBackend *
+backendDefault(AssertionFlag type)
+{
+#if defined(__linux__)
+    const char *session = getenv("DBUS_SESSION_BUS_ADDRESS");
+
+    if (type == kDisplayAssertionFlag && session && *session) {
+        return &screenSaverBackend;
+    }
+#else
+    (void)type;
+#endif
+    return backends[0];
+}
+
+static const AssertionBackend *
+backendRouted(AssertionFlag type)
+{
+    int index = backendTypeIndex(type);
+
+    if (index < 0) {
+        return NULL;
+    }
+    if (!backendRoute[index]) {
+        backendRoute[index] = backendDefault(type);
+    }
+    return backendRoute[index];
+}
+
+/*
+ * The backend that creates type, initialized. NULL, with a message, if it
+ * cannot create that type or failed to start.
+ */
+const AssertionBackend *
+backendFor(AssertionFlag type)
+{
+    const AssertionBackend *backend = backendRouted(type);
+    size_t index;
+
+    if (!backend || !(backend->types & type)) {
+        fprintf(stderr, "caffeinate: the %s backend cannot create %s assertions\n",
+                backend ? backend->name : "selected", assertionTypeName(type));
+        return NULL;
+    }
+    index = backendIndex(backend);
+    if (!backendLoaded[index]) {
+        if (backend->init && backend->init()) {
+            return NULL;
+        }
+        backendLoaded[index] = 1;
+    }
+    return backend;
+}
+
+/*
+ * Done creating for now: let backends drop what only creating needed,
+ * such as a bus connection. They are initialized again on next use.
+ */
+void
+backendsSettle(void)
+{
+    size_t i;
+
+    for (i = 0; i < kBackendCount; i++) {
+        if (!backendLoaded[i] || !backends[i]->settle) continue;
+        backends[i]->settle();
+        backendLoaded[i] = 0;
+    }
+}
+
+/* The backend that created type, if it was. Never initializes one. */
+const AssertionBackend *
+backendHolding(AssertionFlag type)
+{
+    const AssertionBackend *backend = backendRouted(type);
+
+    return (backend && backend->query(type) != kBackendNotHeld) ? backend : NULL;
+}
+
+/*
+ * Route type to the backend called name and, if fd is the descriptor that
+ * another caffeinate held it in, take it over. Without fd the caller still
+ * has to create type.
+ */
+int
+backendAdopt(AssertionFlag type, const char *name, int fd)
+{
+    int index = backendTypeIndex(type);
+    size_t i;
+
+    for (i = 0; i < kBackendCount && strcmp(backends[i]->name, name); i++)
+        ;
+    if (index < 0 || i == kBackendCount || !(backends[i]->types & type)) {
+        errno = EINVAL;
+        return -1;
+    }
+    backendRoute[index] = backends[i];
+    if (fd < 0) {
+        return 0;
+    }
+    if (!backends[i]->adopt) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return backends[i]->adopt(type, fd);
+}
+
+/* Whether every one of flags would be held in descriptors that survive exec. */
+int
+backendsInheritable(AssertionFlag flags)
+{
+    int flag;
+
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        const AssertionBackend *backend;
+
+        if (!(flags & flag)) continue;
+        backend = backendRouted((AssertionFlag)flag);
+        if (!backend || !backend->inheritable) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Whether any of flags is held through a backend that wants an explicit
+ * release (a kernel wake lock outlives caffeinate; a screen saver cookie
+ * should be uninhibited, not dropped): then caffeinate must not die from a
+ * signal without running its exit handlers.
+ */
+int
+backendsOutlive(AssertionFlag flags)
+{
+    int flag;
+
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        const AssertionBackend *backend;
+
+        if (!(flags & flag)) continue;
+        backend = backendRouted((AssertionFlag)flag);
+        if (backend && backend->outlives) return 1;
+    }
+    return 0;
+}
@@ -22,64 +22,138 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
-#include <dispatch/dispatch.h>
-#include <CoreFoundation/CFNumber.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
 
-#include <IOKit/pwr_mgt/IOPMLib.h>
-#include <IOKit/pwr_mgt/IOPMLibPrivate.h>
+#include "caffeinate.h"
 
-typedef enum {
-    kDefaultAssertionFlag   = 0,
-    kIdleAssertionFlag      = (1 << 0),
-    kDisplayAssertionFlag   = (1 << 1),
-    kSystemAssertionFlag    = (1 << 2)
-} AssertionFlag;
+/* Stop at the utility's name; glibc would otherwise permute its arguments. */
+#if defined(__linux__)
+#define kOptionPrefix           "+"
+#else
+#define kOptionPrefix           ""
+#endif
 
-typedef enum {
-    kDefaultPropertyFlag     = 0,
-    kAssertionOnBattFlag     = (1 << 0)
-} PropertyFlag;
-typedef struct {
-    AssertionFlag assertionFlag;
-    CFStringRef assertionType;
-} AssertionMapEntry;
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL            0       /* SO_NOSIGPIPE is set on the socket instead */
+#endif
 
+/* "<pid>:<flags>" of the caffeinate already asserting for this process tree. */
+#define kHeldEnvironment        "CAFFEINATE_HELD"
 
-AssertionMapEntry assertionMap[] = {
-    { kIdleAssertionFlag,       kIOPMAssertionTypePreventUserIdleSystemSleep },
-    { kDisplayAssertionFlag,    kIOPMAssertionTypePreventUserIdleDisplaySleep },
-    { kSystemAssertionFlag,     kIOPMAssertionTypePreventSystemSleep}};
+/* Long options without a single-letter equivalent. */
+enum {
+    kStatusOption = 0x100,
+    kAuditOption,
+    kMetricsOption,
+    kMetricsIntervalOption,
+    kEnergyOption,
+    kCPUsOption,
+    kSchedOption,
+    kNiceOption,
+    kIOPrioOption,
+    kLogOption,
+    kOnSleepOption,
+    kLeaseServerOption,
+    kLeaseTTLOption,
+    kLeaseOption,
+    kLingerOption,
+    kLeanOption,
+    kBackendOption,
+    kPerfOption,
+    kDevicesOption,
+    kControlOption,
+    kLingerTakeOverOption,
+    kWhilePressureOption,
+    kWhileWritingOption,
+    kQuietPeriodOption
+};
 
+static struct option longOptions[] = {
+    { "status",         no_argument,        NULL,   kStatusOption },
+    { "audit",          no_argument,        NULL,   kAuditOption },
+    { "metrics",        required_argument,  NULL,   kMetricsOption },
+    { "metrics-interval", required_argument, NULL,  kMetricsIntervalOption },
+    { "energy",         no_argument,        NULL,   kEnergyOption },
+    { "cpus",           required_argument,  NULL,   kCPUsOption },
+    { "sched",          required_argument,  NULL,   kSchedOption },
+    { "nice",           required_argument,  NULL,   kNiceOption },
+    { "ioprio",         required_argument,  NULL,   kIOPrioOption },
+    { "log",            required_argument,  NULL,   kLogOption },
+    { "on-sleep",       required_argument,  NULL,   kOnSleepOption },
+    { "lease-server",   required_argument,  NULL,   kLeaseServerOption },
+    { "lease-ttl",      required_argument,  NULL,   kLeaseTTLOption },
+    { "lease",          required_argument,  NULL,   kLeaseOption },
+    { "linger",         required_argument,  NULL,   kLingerOption },
+    { "lean",           no_argument,        NULL,   kLeanOption },
+    { "backend",        required_argument,  NULL,   kBackendOption },
+    { "perf",           no_argument,        NULL,   kPerfOption },
+    { "devices",        required_argument,  NULL,   kDevicesOption },
+    { "control",        no_argument,        NULL,   kControlOption },
+    { "linger-takeover", required_argument, NULL,   kLingerTakeOverOption },
+    { "while-pressure", required_argument,  NULL,   kWhilePressureOption },
+    { "while-writing",  required_argument,  NULL,   kWhileWritingOption },
+    { "quiet-period",   required_argument,  NULL,   kQuietPeriodOption },
+    { NULL,             0,                  NULL,   0 }
+};
 
-typedef struct {
-    PropertyFlag  propertyFlag;
-    CFStringRef   propertyType;
-    CFTypeRef     propertyVal;
-} PropertyMapEntry;
-
-static CFStringRef        kHumanReadableReason = CFSTR("THE CAFFEINATE TOOL IS PREVENTING SLEEP.");
-static CFStringRef        kLocalizationBundlePath = CFSTR("/System/Library/CoreServices/powerd.bundle");
-
-#define kAssertionNameString    "caffeinate command-line tool"
-
-int createAssertions(const char *progname, AssertionFlag flags, PropertyFlag  propertyFlags);
-void forkChild(char *argv[], AssertionFlag flag, PropertyFlag  propertyFlags);
+void forkChild(char *argv[], AssertionFlag flag, PropertyFlag  propertyFlags, const ChildPlacement *placement);
 void usage(void);
+static void terminate(void *context);
+static void assertionsHeld(AssertionFlag flags, pid_t pid, const char *command, int64_t since);
+static AssertionFlag assertionsDefer(AssertionFlag flags, PropertyFlag propFlags);
+static void assertionsWhile(int valid, void *context);
+static void assertionsControlled(AssertionFlag flags, void *context);
+static int assertionsInherited(AssertionFlag flags, PropertyFlag propFlags);
+static void execAsserted(char *argv[], AssertionFlag flags, PropertyFlag propFlags,
+                         const ChildPlacement *placement) __attribute__((noreturn));
+
+static int reportUsage = 0;
+static const char *logPath = NULL;
+static int controlled = 0;
+static int whilePressure = 0;
+static const char *matchPattern = NULL;
+static const char *writeTree = NULL;
 
 int
 main(int argc, char *argv[])
 {
     AssertionFlag flags = kDefaultAssertionFlag;
     PropertyFlag  propFlags = kDefaultPropertyFlag;
-    char ch;
+    const char *metricsPath = NULL;
+    unsigned metricsInterval = kMetricsDefaultInterval;
+    int measureEnergy = 0;
+    int watchSleep = 0;
+    const char *leaseServer = NULL, *lease = NULL;
+    unsigned leaseTTL = kLeaseDefaultTTL;
+    unsigned linger = 0;
+    unsigned quietPeriod = 0;
+    int lean = 0, resident;
+    int holdLatency = 0, perf = 0;
+    unsigned latency = 0;
+    const char *devices = NULL;
+    char *end;
+    ChildPlacement placement;
+    int ch;
+    
+    placementInit(&placement);
     
-    while ((ch = getopt(argc, argv, "dhisb")) != -1) {
-        switch((char)ch) {
+    while ((ch = getopt_long(argc, argv, kOptionPrefix "dhisbvl:p:", longOptions, NULL)) != -1) {
+        switch(ch) {
             case 'd':
                 flags |= kDisplayAssertionFlag;
                 break;
@@ -95,6 +169,110 @@ main(int argc, char *argv[])
             case 'b':
                 propFlags |= kAssertionOnBattFlag;
                 break;
+            case 'v':
+                reportUsage = 1;
+                break;
+            case 'p':
+                matchPattern = optarg;
+                break;
+            case 'l':
+                latency = (unsigned)strtoul(optarg, &end, 10);
+                if (end == optarg || *end) {
+                    usage();
+                    exit(1);
+                }
+                holdLatency = 1;
+                break;
+            case kStatusOption:
+                exit(statusPageShow());
+            case kAuditOption:
+                exit(auditShow());
+            case kMetricsOption:
+                metricsPath = optarg;
+                break;
+            case kMetricsIntervalOption:
+                metricsInterval = (unsigned)strtoul(optarg, NULL, 10);
+                if (!metricsInterval) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case kEnergyOption:
+                measureEnergy = 1;
+                break;
+            case kCPUsOption:
+                if (placementParseCPUs(&placement, optarg)) exit(1);
+                break;
+            case kSchedOption:
+                if (placementParseSched(&placement, optarg)) exit(1);
+                break;
+            case kNiceOption:
+                if (placementParseNice(&placement, optarg)) exit(1);
+                break;
+            case kIOPrioOption:
+                if (placementParseIOPrio(&placement, optarg)) exit(1);
+                break;
+            case kLogOption:
+                logPath = optarg;
+                break;
+            case kOnSleepOption:
+                if (sleepWatchParse(optarg)) exit(1);
+                watchSleep = 1;
+                break;
+            case kLeaseServerOption:
+                leaseServer = optarg;
+                break;
+            case kLeaseTTLOption:
+                leaseTTL = (unsigned)strtoul(optarg, NULL, 10);
+                if (!leaseTTL) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case kLeaseOption:
+                lease = optarg;
+                break;
+            case kLeanOption:
+                lean = 1;
+                break;
+            case kPerfOption:
+                perf = 1;
+                break;
+            case kDevicesOption:
+                devices = optarg;
+                break;
+            case kControlOption:
+                controlled = 1;
+                break;
+            case kWhilePressureOption:
+                if (pressureParse(optarg)) exit(1);
+                whilePressure = 1;
+                break;
+            case kWhileWritingOption:
+                writeTree = optarg;
+                break;
+            case kQuietPeriodOption:
+                quietPeriod = (unsigned)strtoul(optarg, NULL, 10);
+                if (!quietPeriod) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case kLingerTakeOverOption:
+                /* Started by a --linger holder being upgraded; not for users. */
+                lingerTakeOver((int)strtol(optarg, NULL, 10));
+            case kBackendOption:
+                if (backendSelect(optarg)) {
+                    exit(1);
+                }
+                break;
+            case kLingerOption:
+                linger = (unsigned)strtoul(optarg, NULL, 10);
+                if (!linger) {
+                    usage();
+                    exit(1);
+                }
+                break;
             case '?':
             default:
                 usage();
@@ -102,34 +280,185 @@ main(int argc, char *argv[])
         }
     }
     
+    if (metricsPath) {
+        metricsExport(metricsPath, metricsInterval);
+    }
+    if (leaseServer) {
+        leaseServe(leaseServer, leaseTTL);
+    }
+    
     if (flags == kDefaultAssertionFlag) {
-        flags = kIdleAssertionFlag;
+        /* Pressure is about work in progress, not about a user at the keyboard. */
+        flags = whilePressure ? kSystemAssertionFlag : kIdleAssertionFlag;
+    }
+    
+    if (watchSleep && !(argc - optind)) {
+        /* There is nothing to freeze when asserting forever. */
+        usage();
+        exit(1);
+    }
+    if (controlled && (!(argc - optind) || lease || linger)) {
+        /* Only a utility can write to it, and only while the assertions are this process's own. */
+        usage();
+        exit(1);
+    }
+    if ((whilePressure || matchPattern || writeTree) && (lease || linger || controlled)) {
+        usage();
+        exit(1);
+    }
+    if ((!!whilePressure + !!matchPattern + !!writeTree) > 1 || (quietPeriod && !writeTree)) {
+        usage();
+        exit(1);
+    }
+    
+    /* Whether anything needs caffeinate to stay around while the utility runs. */
+    resident = reportUsage || logPath || watchSleep || measureEnergy || lease || controlled
+               || whilePressure || matchPattern || writeTree || (holdLatency && latencyResident(&placement))
+               || perf || devices;
+    
+    if ((argc - optind) && !resident && assertionsInherited(flags, propFlags)) {
+        /* Nested under a caffeinate that already asserts as much: just run it. */
+        argv += optind;
+        if ((holdLatency && latencyHold(latency, &placement)) || placementApply(&placement)) {
+            exit(1);
+        }
+        execvp(*argv, argv);
+        ch = errno;
+        perror(*argv);
+        exit((ch == ENOENT) ? 127 : 126);
+    }
+    
+    if (linger && !lease && lingerJoin(flags, propFlags, linger) == 0) {
+        /* The holder has them; nothing to create or release here. */
+        flags = kDefaultAssertionFlag;
+    }
+    
+    if (holdLatency && latencyHold(latency, &placement)) {
+        exit(1);
+    }
+    if (perf && perfStart(&placement)) {
+        exit(1);
+    }
+    if (devices && devicesStart(devices)) {
+        exit(1);
+    }
+    if ((holdLatency && latencyResident(&placement)) || perf || devices || backendsOutlive(flags)) {
+        /* Leave through exit() so that sysfs values are written back and held locks released. */
+        (void)reactorAddSignal(SIGHUP, terminate, (void *)(intptr_t)SIGHUP);
+        (void)reactorAddSignal(SIGTERM, terminate, (void *)(intptr_t)SIGTERM);
+    }
+    
+    if (lean && (argc - optind) && !resident && !linger && backendsInheritable(flags)) {
+        execAsserted(argv + optind, flags, propFlags, &placement);
+    }
+    
+    if (measureEnergy) {
+        /* Best effort: keep the host awake even where there is nothing to read. */
+        (void)energyStart((argc - optind) ? argv[optind] : NULL,
+                          !(lease || whilePressure || matchPattern || writeTree));
+    }
+    
+    if (lease) {
+        /* Nothing is asserted until the coordinator grants a lease. */
+        if (leaseJoin(lease, assertionsWhile, (void *)(intptr_t)(flags | (propFlags << 8)))) {
+            exit(1);
+        }
+        flags = kDefaultAssertionFlag;
+    } else if (whilePressure) {
+        /* Nothing is asserted until a threshold is crossed. */
+        if (pressureWatch(assertionsWhile, (void *)(intptr_t)(flags | (propFlags << 8)))) {
+            exit(1);
+        }
+        flags = kDefaultAssertionFlag;
+    } else if (matchPattern) {
+        /* Nothing is asserted until a matching process runs; maybe one already does. */
+        if (procWatchStart(matchPattern, assertionsWhile, (void *)(intptr_t)(flags | (propFlags << 8)))) {
+            exit(1);
+        }
+        flags = kDefaultAssertionFlag;
+    } else if (writeTree) {
+        /* Nothing is asserted until something is written. */
+        if (writeWatchStart(writeTree, quietPeriod ? quietPeriod : kWriteWatchDefaultQuiet, assertionsWhile,
+                            (void *)(intptr_t)(flags | (propFlags << 8)))) {
+            exit(1);
+        }
+        flags = kDefaultAssertionFlag;
+    } else if (controlled) {
+        /* Taken once the utility is forked, by this process, so that they can be dropped. */
+        if (controlStart(flags, assertionsControlled, (void *)(intptr_t)propFlags)) {
+            exit(1);
+        }
+    } else {
+        flags = assertionsDefer(flags, propFlags);
     }
     
     if (argc - optind) {
         argv += optind;
-        (void) forkChild(argv, flags, propFlags);
+        (void) forkChild(argv, flags, propFlags, &placement);
     } else {
-        if (createAssertions(NULL, flags, propFlags)) {
+        if (flags && createAssertions(NULL, flags, propFlags)) {
             exit(1);
         }
+        assertionsHeld(flags, getpid(), NULL, auditNow());
+        (void)statusPagePublish(flags, propFlags, NULL);
+        (void)reactorAddSignal(SIGHUP, terminate, (void *)(intptr_t)SIGHUP);
+        (void)reactorAddSignal(SIGINT, terminate, (void *)(intptr_t)SIGINT);
+        (void)reactorAddSignal(SIGTERM, terminate, (void *)(intptr_t)SIGTERM);
     }
     
-    dispatch_main();
+    reactorRun();
+}
+
+const char *
+assertionTypeName(AssertionFlag flag)
+{
+    switch (flag) {
+        case kIdleAssertionFlag:    return "idle";
+        case kDisplayAssertionFlag: return "display";
+        case kSystemAssertionFlag:  return "system";
+        default:                    return "unknown";
+    }
+}
+
+/* Where sysfs is mounted; CAFFEINATE_SYSFS_ROOT points it at a fixture. */
+const char *
+sysfsRoot(void)
+{
+    const char *root = getenv("CAFFEINATE_SYSFS_ROOT");
+
+    return (root && *root) ? root : "/sys";
+}
+
+int64_t
+monotonicNow(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Asserting forever ends with a signal; turn it into an orderly exit so
+ * that atexit handlers (status page, ...) get to clean up.
+ */
+static void
+terminate(void *context)
+{
+    exit(128 + (int)(intptr_t)context);
 }
 
+/*
+ * Create flags through the backend each type is routed to, recording
+ * every attempt in the audit ring. Stops at the first failure.
+ */
 int
 createAssertions(const char *progname, AssertionFlag flags, PropertyFlag propFlags)
 {
-    IOReturn result = 1;
+    int result = 0;
     char assertionDetails[128];
-    CFStringRef assertionDetailsString = NULL;
-    IOPMAssertionID assertionID = 0;
-    u_int i = 0, j = 0;
-    PropertyMapEntry propertiesMap[] = {
-        {kAssertionOnBattFlag, kIOPMAssertionAppliesToLimitedPowerKey, (CFBooleanRef)kCFBooleanTrue}
-    };
-    
+    int64_t began;
+    int flag, property;
     
     if (progname) {
         (void)snprintf(assertionDetails, sizeof(assertionDetails),
@@ -139,61 +468,546 @@ createAssertions(const char *progname, AssertionFlag flags, PropertyFlag propFla
                        "caffeinate asserting forever");
     }
     
-    assertionDetailsString = CFStringCreateWithCString(kCFAllocatorDefault,
-                                                       assertionDetails, kCFStringEncodingMacRoman);
-    if (!assertionDetailsString) {
-        fprintf(stderr, "Failed to create assertion name %s\n", progname);
-        goto finish;
-    }
-    
-    for (i = 0; i < sizeof(assertionMap)/sizeof(AssertionMapEntry); ++i) 
-    {
-        AssertionMapEntry *entry = assertionMap + i;
-        
-        if (!(flags & entry->assertionFlag)) continue;
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        const AssertionBackend *backend;
         
-        result = IOPMAssertionCreateWithDescription(entry->assertionType, 
-                                                    CFSTR(kAssertionNameString), assertionDetailsString, 
-                                                    kHumanReadableReason, kLocalizationBundlePath, 0.0, NULL, &assertionID);
+        if (!(flags & flag)) continue;
         
-        if (result != kIOReturnSuccess) 
-        {
-            fprintf(stderr, "Failed to create %s assertion\n",
-                    CFStringGetCStringPtr(entry->assertionType, kCFStringEncodingMacRoman));
-            goto finish;
+        began = monotonicNow();
+        backend = backendFor((AssertionFlag)flag);
+        result = backend ? backend->create((AssertionFlag)flag, assertionDetails) : ENOTSUP;
+        auditRecord(kAuditCreate, (AssertionFlag)flag, getpid(), progname, auditNow(), 0,
+                    monotonicNow() - began, result);
+        if (result) {
+            break;
         }
         
-        for (j = 0; j < sizeof(propertiesMap)/sizeof(PropertyMapEntry); j++) 
-        {
-            if ( !(propFlags & propertiesMap[j].propertyFlag) ) continue;
-            
-            result = IOPMAssertionSetProperty(assertionID, 
-                                              propertiesMap[j].propertyType,
-                                              propertiesMap[j].propertyVal);
-            if (result != kIOReturnSuccess)
-            {
-                fprintf(stderr, "Failed to set property %s on assertion %s\n",
-                        CFStringGetCStringPtr(propertiesMap[j].propertyType, kCFStringEncodingMacRoman), 
-                        CFStringGetCStringPtr(entry->assertionType, kCFStringEncodingMacRoman));
-                continue;
-            }
-            
+        for (property = kAssertionOnBattFlag; property <= kAssertionOnBattFlag; property <<= 1) {
+            if (!(propFlags & property) || !backend->setProperty) continue;
+            /* Failing to set a property is reported, not fatal. */
+            (void)backend->setProperty((AssertionFlag)flag, (PropertyFlag)property);
         }
-        
     }
-    
-    result = kIOReturnSuccess;
-finish:
-    if (assertionDetailsString) CFRelease(assertionDetailsString);
+    backendsSettle();
     
     return result;
 }
 
+int
+releaseAssertion(AssertionFlag flag)
+{
+    const AssertionBackend *backend = backendHolding(flag);
+
+    return backend ? backend->release(flag) : 0;
+}
+
+/*
+ * Let the child waiting on gate exec the utility. Assertions held in
+ * descriptors (logind inhibitors) go along with the go-ahead, so that, as
+ * when the child created them itself, they last exactly as long as the
+ * utility does. Those that belong to this process (IOKit assertions,
+ * ScreenSaver cookies) stay here and are released once the utility has
+ * exited. Returns the process responsible for releasing them.
+ */
+static pid_t
+assertionsHandOff(int gate, AssertionFlag flags, pid_t pid)
+{
+    union {
+        struct cmsghdr  header;
+        char            space[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int fds[3];
+    u_int count = 0;
+    pid_t holder = pid;
+    int flag;
+
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        const AssertionBackend *backend;
+        int held;
+
+        if (!(flags & flag) || !(backend = backendHolding((AssertionFlag)flag))) continue;
+        held = backend->query((AssertionFlag)flag);
+        if (held >= 0) {
+            fds[count++] = held;
+        } else if (held == kBackendProcessHeld) {
+            holder = getpid();
+        }
+    }
+
+    memset(&message, 0, sizeof(message));
+    iov.iov_base = "g";
+    iov.iov_len = 1;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (count) {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.space;
+        message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    }
+    while (sendmsg(gate, &message, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) return -1;
+    }
+
+    /* The child's copies are the ones that count now. */
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        const AssertionBackend *backend;
+
+        if (!(flags & flag) || !(backend = backendHolding((AssertionFlag)flag))) continue;
+        if (backend->query((AssertionFlag)flag) >= 0) {
+            (void)backend->release((AssertionFlag)flag);
+        }
+    }
+    return holder;
+}
+
+/*
+ * Assertions this process is responsible for releasing, or reporting
+ * released to the audit ring, when it exits: its own when asserting forever
+ * or, on Darwin, on behalf of the utility; the utility's once it has
+ * exec'd. The utility's are dropped by the system when it exits, so there
+ * is no release latency to report for them.
+ */
+static AssertionFlag    heldFlags = kDefaultAssertionFlag;
+static pid_t            heldPid = 0;
+static const char       *heldCommand = NULL;
+static int64_t          heldSince = 0;
+
+/*
+ * Assertions the active power management preferences made redundant when
+ * caffeinate started (a sleep timer of "Never"). They are not created
+ * unless the preferences or the power source change, in which case this
+ * process takes them itself, for as long as it runs.
+ */
+static AssertionFlag    deferredFlags = kDefaultAssertionFlag;
+static PropertyFlag     deferredPropFlags = kDefaultPropertyFlag;
+static AssertionFlag    lateFlags = kDefaultAssertionFlag;
+static int64_t          lateSince[3];  /* by type bit */
+
+static void assertionsDrop(AssertionFlag flags);
+
+static void
+releaseHeldAssertions(void)
+{
+    int64_t now = auditNow();
+    int flag;
+
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        int64_t began, latency = -1;
+        int result = 0;
+
+        if (!(heldFlags & flag)) continue;
+        if (heldPid == getpid()) {
+            began = monotonicNow();
+            result = releaseAssertion((AssertionFlag)flag);
+            latency = monotonicNow() - began;
+        }
+        auditRecord(kAuditRelease, (AssertionFlag)flag, heldPid, heldCommand,
+                    heldSince, now - heldSince, latency, result);
+    }
+    heldFlags = kDefaultAssertionFlag;
+    assertionsDrop(lateFlags);
+}
+
+/* Release those of flags that assertionsTake() created. */
+static void
+assertionsDrop(AssertionFlag flags)
+{
+    int64_t now = auditNow();
+    int flag;
+
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        int64_t began;
+        int result;
+
+        if (!(lateFlags & flags & flag)) continue;
+        began = monotonicNow();
+        result = releaseAssertion((AssertionFlag)flag);
+        auditRecord(kAuditRelease, (AssertionFlag)flag, getpid(), heldCommand,
+                    lateSince[__builtin_ctz(flag)], now - lateSince[__builtin_ctz(flag)],
+                    monotonicNow() - began, result);
+    }
+    lateFlags &= ~flags;
+    if (!(heldFlags | lateFlags)) {
+        energyHolding(0);
+    }
+}
+
+/* Create flags in this process on top of whatever is already held. */
+static int
+assertionsTake(AssertionFlag flags, PropertyFlag propFlags)
+{
+    int64_t now = auditNow();
+    int flag;
+
+    flags &= ~lateFlags;
+    if (!flags) {
+        return 0;
+    }
+    if (createAssertions(heldCommand, flags, propFlags)) {
+        return -1;
+    }
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        if (flags & flag) lateSince[__builtin_ctz(flag)] = now;
+    }
+    lateFlags |= flags;
+    energyHolding(1);
+    (void)statusPagePublish(heldFlags | lateFlags, propFlags, heldCommand);
+    return 0;
+}
+
+static void
+assertionsHeld(AssertionFlag flags, pid_t pid, const char *command, int64_t since)
+{
+    heldFlags = flags;
+    heldPid = pid;
+    heldCommand = command;
+    heldSince = since;
+    (void)atexit(releaseHeldAssertions);
+}
+
+static void
+assertionsRefresh(void *context)
+{
+    AssertionFlag needed = deferredFlags & ~prefsRedundantAssertions();
+
+    (void)context;
+    if (needed && assertionsTake(needed, deferredPropFlags) == 0) {
+        deferredFlags &= ~needed;
+    }
+}
+
+/*
+ * caffeinate --lease, --while-pressure, -p and --while-writing: hold the
+ * assertions exactly while the lease is, the pressure lasts, a matching
+ * process runs or files are being written. The requested flags travel in
+ * the context, property flags above bit 8.
+ */
+static void
+assertionsWhile(int valid, void *context)
+{
+    AssertionFlag flags = (AssertionFlag)((intptr_t)context & 0xff);
+    PropertyFlag propFlags = (PropertyFlag)((intptr_t)context >> 8);
+
+    if (valid) {
+        (void)assertionsTake(flags, propFlags);
+    } else {
+        assertionsDrop(lateFlags);
+        (void)statusPagePublish(heldFlags, propFlags, heldCommand);
+    }
+}
+
+/*
+ * caffeinate --control: hold what the utility last asked for. Property
+ * flags travel in the context.
+ */
+static void
+assertionsControlled(AssertionFlag flags, void *context)
+{
+    PropertyFlag propFlags = (PropertyFlag)(intptr_t)context;
+    AssertionFlag dropped = lateFlags & ~flags, raised = flags & ~lateFlags;
+
+    if (dropped) {
+        assertionsDrop(dropped);
+    }
+    if (!raised || assertionsTake(raised, propFlags)) {
+        (void)statusPagePublish(heldFlags | lateFlags, propFlags, heldCommand);
+    }
+}
+
+/* Returns the assertions worth creating now. */
+static AssertionFlag
+assertionsDefer(AssertionFlag flags, PropertyFlag propFlags)
+{
+    AssertionFlag redundant = flags & prefsRedundantAssertions();
+
+    if (!redundant || prefsWatch(assertionsRefresh, NULL)) {
+        return flags;
+    }
+    deferredFlags = redundant;
+    deferredPropFlags = propFlags;
+    return flags & ~redundant;
+}
+
+/* The parent of pid, or -1 if it is gone. */
+static pid_t
+parentOf(pid_t pid)
+{
+#if defined(__APPLE__)
+    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, (int)pid };
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+
+    if (sysctl(mib, 4, &info, &size, NULL, 0) < 0 || size == 0) {
+        return -1;
+    }
+    return info.kp_eproc.e_ppid;
+#else
+    char path[32], buffer[512], *end;
+    ssize_t count;
+    int fd, ppid;
+
+    (void)snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    count = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (count <= 0) {
+        return -1;
+    }
+    buffer[count] = '\0';
+    /* The command name may itself contain ") ". */
+    end = strrchr(buffer, ')');
+    if (!end || sscanf(end + 1, " %*c %d", &ppid) != 1) {
+        return -1;
+    }
+    return (pid_t)ppid;
+#endif
+}
+
+/*
+ * Tell caffeinates run by the utility what is already asserted on their
+ * behalf. Nothing is exported when nothing was created here; an outer
+ * caffeinate's token, if any, still holds.
+ */
+static void
+assertionsExport(AssertionFlag flags, PropertyFlag propFlags)
+{
+    char token[32];
+
+    if (!flags) {
+        return;
+    }
+    (void)snprintf(token, sizeof(token), "%d:%x", (int)getpid(), (unsigned)(flags | (propFlags << 8)));
+    (void)setenv(kHeldEnvironment, token, 1);
+}
+
+/*
+ * Whether an enclosing caffeinate already holds flags for us. The token
+ * only counts if the caffeinate it names is one of our ancestors: an
+ * environment copied elsewhere, or a utility that outlived its caffeinate,
+ * gets its own assertions.
+ */
+static int
+assertionsInherited(AssertionFlag flags, PropertyFlag propFlags)
+{
+    const char *token = getenv(kHeldEnvironment);
+    unsigned long held;
+    pid_t holder, ancestor;
+    char *end;
+
+    if (!token || !*token) {
+        return 0;
+    }
+    holder = (pid_t)strtol(token, &end, 10);
+    if (holder <= 1 || *end != ':') {
+        return 0;
+    }
+    held = strtoul(end + 1, &end, 16);
+    if (*end || ((unsigned long)(flags | (propFlags << 8)) & ~held)) {
+        return 0;
+    }
+    for (ancestor = getppid(); ancestor > 1; ancestor = parentOf(ancestor)) {
+        if (ancestor == holder) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Time the host spent suspended: CLOCK_BOOTTIME keeps counting across
+ * sleep and CLOCK_MONOTONIC does not. On Darwin it is the other way
+ * around, CLOCK_MONOTONIC counts sleep and CLOCK_UPTIME_RAW does not.
+ */
+static int64_t
+suspendedNow(void)
+{
+    struct timespec awake, total;
+
+#if defined(__APPLE__)
+    (void)clock_gettime(CLOCK_UPTIME_RAW, &awake);
+    (void)clock_gettime(CLOCK_MONOTONIC, &total);
+#else
+    (void)clock_gettime(CLOCK_MONOTONIC, &awake);
+    (void)clock_gettime(CLOCK_BOOTTIME, &total);
+#endif
+    return ((int64_t)total.tv_sec - awake.tv_sec) * 1000000000 + (total.tv_nsec - awake.tv_nsec);
+}
+
+static const char *childCommand = NULL;
+static int64_t  childStarted = 0;
+static int64_t  childSuspended = 0;
+
+/*
+ * caffeinate -v: a time -v style account of the utility, and how much of
+ * its wall time the host could have spent idle asleep, i.e. time the
+ * utility was not on a CPU.
+ */
+static void
+printUsage(const char *command, int status, const struct rusage *ru)
+{
+    double wall = (double)(monotonicNow() - childStarted) / 1e9;
+    double suspended = (double)(suspendedNow() - childSuspended) / 1e9;
+    double user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    double system = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    double idle = wall - user - system;
+#if defined(__APPLE__)
+    long maxRSS = ru->ru_maxrss / 1024;     /* bytes */
+#else
+    long maxRSS = ru->ru_maxrss;            /* kilobytes */
+#endif
+
+    if (idle < 0) idle = 0;     /* several threads busy at once */
+
+    fprintf(stderr, "\tCommand being timed: \"%s\"\n", command);
+    fprintf(stderr, "\tUser time (seconds): %.2f\n", user);
+    fprintf(stderr, "\tSystem time (seconds): %.2f\n", system);
+    fprintf(stderr, "\tPercent of CPU this job got: %.0f%%\n",
+            wall > 0 ? 100 * (user + system) / wall : 0);
+    fprintf(stderr, "\tElapsed (wall clock) time (seconds): %.2f\n", wall);
+    fprintf(stderr, "\tIdle-sleep eligible time (seconds): %.2f (%.0f%%)\n", idle,
+            wall > 0 ? 100 * idle / wall : 0);
+    fprintf(stderr, "\tTime suspended anyway (seconds): %.2f\n", suspended);
+    fprintf(stderr, "\tMaximum resident set size (kbytes): %ld\n", maxRSS);
+    fprintf(stderr, "\tMajor (requiring I/O) page faults: %ld\n", ru->ru_majflt);
+    fprintf(stderr, "\tMinor (reclaiming a frame) page faults: %ld\n", ru->ru_minflt);
+    fprintf(stderr, "\tVoluntary context switches: %ld\n", ru->ru_nvcsw);
+    fprintf(stderr, "\tInvoluntary context switches: %ld\n", ru->ru_nivcsw);
+    fprintf(stderr, "\tFile system inputs: %ld\n", ru->ru_inblock);
+    fprintf(stderr, "\tFile system outputs: %ld\n", ru->ru_oublock);
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "\tCommand terminated by signal %d\n", WTERMSIG(status));
+    }
+    fprintf(stderr, "\tExit status: %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
+
+static void
+childExited(void *context)
+{
+    pid_t pid = (pid_t)(intptr_t)context;
+    struct rusage ru;
+    int status;
+
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno == EINTR) continue;
+        perror("");
+        exit(1);
+    }
+
+    captureDrain();
+    if (reportUsage) {
+        printUsage(childCommand, status, &ru);
+    }
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
+
+/*
+ * caffeinate --lean: take the inhibitors and become the utility. They stay
+ * open across execvp() and close when it exits, so nothing needs to wait
+ * for it, and thousands of wrapped jobs cost no resident caffeinates at
+ * all. Only for backends whose assertions are such descriptors. The status
+ * page slot passes to the utility along with the pid; the release goes
+ * unrecorded in the audit ring.
+ */
+static void
+execAsserted(char *argv[], AssertionFlag flags, PropertyFlag propFlags, const ChildPlacement *placement)
+{
+    int error;
+
+    if (flags && createAssertions(*argv, flags, propFlags)) {
+        exit(1);
+    }
+    assertionsExport(flags, propFlags);
+    (void)statusPagePublish(flags, propFlags, *argv);
+    if (placementApply(placement)) {
+        exit(1);
+    }
+    execvp(*argv, argv);
+    error = errno;
+    perror(*argv);
+    exit((error == ENOENT) ? 127 : 126);
+}
+
+/*
+ * Wait for the parent to have created the assertions. Descriptors that
+ * come with the go-ahead (logind inhibitors) are kept across execvp().
+ */
+static int
+childAwaitAssertions(int gate)
+{
+    char space[CMSG_SPACE(4 * sizeof(int))];
+    struct msghdr message;
+    struct iovec iov;
+    char go = 0;
+    ssize_t count;
+
+    memset(&message, 0, sizeof(message));
+    iov.iov_base = &go;
+    iov.iov_len = 1;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = space;
+    message.msg_controllen = sizeof(space);
+    while ((count = recvmsg(gate, &message, 0)) < 0 && errno == EINTR)
+        ;
+    close(gate);
+    return (count == 1 && go == 'g') ? 0 : -1;
+}
+
+/*
+ * The assertions are created by the parent while the child sets itself up
+ * (placement, cgroup, output redirection), and the child execs only once
+ * they exist: the utility never runs a single instruction unasserted, but
+ * the round trips to powerd or logind are no longer paid for in series
+ * with starting it.
+ */
 void
-forkChild(char *argv[], AssertionFlag flags, PropertyFlag propFlags)
+forkChild(char *argv[], AssertionFlag flags, PropertyFlag propFlags, const ChildPlacement *placement)
 {
-    pid_t pid;
-    dispatch_source_t source;
+    pid_t pid, holder;
+    int execPipe[2];
+    int gate[2];
+    int outputFDs[2];
+    int64_t since = auditNow();
+    char failed;
+    
+    childCommand = *argv;
+    childStarted = monotonicNow();
+    childSuspended = suspendedNow();
+    
+    /*
+     * The child holds the write end across execvp(); it closes without a
+     * byte being written only if the utility actually started.
+     */
+    if (pipe(execPipe) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, gate) < 0) {
+        perror("");
+        exit(1);
+    }
+    (void)fcntl(execPipe[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(execPipe[1], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(gate[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(gate[1], F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+    {
+        int on = 1;
+        (void)setsockopt(gate[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+    if ((logPath && captureOpen(logPath, outputFDs)) || sleepWatchPrepare()) {
+        exit(1);
+    }
+    if (!controlled) {
+        /* Under --control the utility can drop them, so nothing may rely on them. */
+        assertionsExport(flags, propFlags);
+    }
     
     switch(pid = fork()) {
         case -1:    /* error */
@@ -201,11 +1015,29 @@ forkChild(char *argv[], AssertionFlag flags, PropertyFlag propFlags)
             exit(1);
             /* NOTREACHED */
         case 0:     /* child */
-            if (createAssertions(*argv, flags, propFlags)) {
+            reactorPrepareChild();
+            close(execPipe[0]);
+            close(gate[0]);
+            if (placementApply(placement)) {
+                (void)write(execPipe[1], "p", 1);
+                _exit(1);
+            }
+            if (logPath && (dup2(outputFDs[0], STDOUT_FILENO) < 0
+                            || dup2(outputFDs[1], STDERR_FILENO) < 0)) {
+                (void)write(execPipe[1], "l", 1);
+                _exit(1);
+            }
+            if (sleepWatchChild()) {
+                (void)write(execPipe[1], "s", 1);
+                _exit(1);
+            }
+            if (flags && childAwaitAssertions(gate[1])) {
+                (void)write(execPipe[1], "a", 1);
                 _exit(1);
             }
             execvp(*argv, argv);
             perror(*argv);
+            (void)write(execPipe[1], "e", 1);
             _exit((errno == ENOENT) ? 127 : 126);
             /* NOTREACHED */
     }
@@ -215,19 +1047,44 @@ forkChild(char *argv[], AssertionFlag flags, PropertyFlag propFlags)
     (void)signal(SIGINT, SIG_IGN);
     (void)signal(SIGQUIT, SIG_IGN);
     
-    source = dispatch_source_create(DISPATCH_SOURCE_TYPE_PROC, pid,
-                                    DISPATCH_PROC_EXIT, dispatch_get_main_queue());
-    dispatch_source_set_event_handler(source, ^{
-        int status;
-        
-        if (waitpid(pid, &status, 0) < 0) {
-            perror("");
-            exit(1);
+    close(execPipe[1]);
+    close(gate[1]);
+    latencyForked();
+    holder = pid;
+    if (controlled) {
+        /* Kept here, where the utility's commands can drop and raise them. */
+        controlForked();
+        heldCommand = *argv;
+        if (assertionsTake(flags, propFlags) || assertionsHandOff(gate[0], kDefaultAssertionFlag, pid) < 0) {
+            holder = -1;
         }
-        
-        exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
-    });
-    dispatch_resume(source);
+        flags = kDefaultAssertionFlag;
+    } else if (flags && (createAssertions(*argv, flags, propFlags)
+                  || (holder = assertionsHandOff(gate[0], flags, pid)) < 0)) {
+        /* The child sees the gate close and gives up. */
+        holder = -1;
+    }
+    close(gate[0]);
+    failed = 0;
+    while (read(execPipe[0], &failed, 1) < 0 && errno == EINTR)
+        ;
+    close(execPipe[0]);
+    if (!failed) {
+        assertionsHeld(flags, holder, *argv, since);
+        (void)sleepWatchStart(pid, *argv);
+    } else if (holder == getpid()) {
+        /* Created here, but the utility never ran. */
+        assertionsHeld(flags, holder, *argv, since);
+    }
+    (void)statusPagePublish(flags | lateFlags, propFlags, *argv);
+    if (logPath && captureStart(outputFDs)) {
+        exit(1);
+    }
+    
+    if (!reactorAddProcess(pid, childExited, (void *)(intptr_t)pid)) {
+        /* Cannot watch it; fall back to a blocking wait. */
+        childExited((void *)(intptr_t)pid);
+    }
     
     return;
 }
@@ -235,6 +1092,15 @@ forkChild(char *argv[], AssertionFlag flags, PropertyFlag propFlags)
 void
 usage(void)
 {
-    fprintf(stderr, "usage: caffeinate [-dis] [command] [arguments]\n");
+    fprintf(stderr, "usage: caffeinate [-disbv] [-l usec] [-p pattern] [--energy] [--cpus list]\n"
+                    "                  [--sched policy[:priority]] [--nice value] [--ioprio class[:level]]\n"
+                    "                  [--log file] [--on-sleep freeze|signal] [--lease host:port/job]\n"
+                    "                  [--linger seconds] [--lean] [--backend name] [--perf]\n"
+                    "                  [--devices list] [--control] [--while-pressure cpu|io|memory:percent]\n"
+                    "                  [--while-writing dir [--quiet-period seconds]]\n"
+                    "                  [command] [arguments]\n"
+                    "       caffeinate --status | --audit\n"
+                    "       caffeinate --metrics file [--metrics-interval seconds]\n"
+                    "       caffeinate --lease-server [host:]port [--lease-ttl seconds]\n");
     return;
 }
@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _CAFFEINATE_H_
+#define _CAFFEINATE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <CoreFoundation/CFRunLoop.h>
+#endif
+
+typedef enum {
+    kDefaultAssertionFlag   = 0,
+    kIdleAssertionFlag      = (1 << 0),
+    kDisplayAssertionFlag   = (1 << 1),
+    kSystemAssertionFlag    = (1 << 2)
+} AssertionFlag;
+
+typedef enum {
+    kDefaultPropertyFlag     = 0,
+    kAssertionOnBattFlag     = (1 << 0)
+} PropertyFlag;
+
+#define kAssertionNameString    "caffeinate command-line tool"
+
+/**************************************************
+ *
+ * caffeinate.c
+ *
+ **************************************************/
+
+int             createAssertions(const char *progname, AssertionFlag flags, PropertyFlag propFlags);
+int             releaseAssertion(AssertionFlag flag);
+int64_t         monotonicNow(void);
+const char      *assertionTypeName(AssertionFlag flag);
+const char      *sysfsRoot(void);
+
+/**************************************************
+ *
+ * backend.c
+ *
+ * What actually keeps the host awake. Each assertion type is routed to a
+ * backend (IOKit on Darwin; logind on Linux, and the screen saver for -d
+ * in a desktop session; unless --backend says otherwise), which is
+ * initialized the first time it is used.
+ *
+ **************************************************/
+
+#define kBackendNotHeld         (-1)
+#define kBackendProcessHeld     (-2)    /* lasts as long as this process; cannot be passed on */
+
+typedef struct {
+    const char      *name;
+    AssertionFlag   types;              /* what it can create */
+    int             inheritable;        /* assertions are descriptors that survive exec */
+    int             outlives;           /* release explicitly, even on SIGTERM */
+    int             (*init)(void);      /* before the first create; optional */
+    void            (*settle)(void);    /* after a batch of creates; optional */
+    int             (*create)(AssertionFlag type, const char *details);
+    int             (*setProperty)(AssertionFlag type, PropertyFlag property);  /* optional */
+    int             (*release)(AssertionFlag type);
+    int             (*query)(AssertionFlag type);   /* descriptor holding type, or kBackend*Held */
+    int             (*adopt)(AssertionFlag type, int fd);  /* take over another process's query(); optional */
+    void            (*reclaim)(AssertionFlag type, pid_t pid);  /* release what a dead caffeinate left held; optional */
+} AssertionBackend;
+
+#if defined(__APPLE__)
+extern const AssertionBackend   iokitBackend;
+#else
+extern const AssertionBackend   logindBackend;
+extern const AssertionBackend   screenSaverBackend;
+extern const AssertionBackend   wakeLockBackend;
+#endif
+
+int                         backendSelect(const char *name);
+const AssertionBackend      *backendFor(AssertionFlag type);
+const AssertionBackend      *backendHolding(AssertionFlag type);
+void                        backendsSettle(void);
+int                         backendsInheritable(AssertionFlag flags);
+int                         backendsOutlive(AssertionFlag flags);
+int                         backendAdopt(AssertionFlag type, const char *name, int fd);
+
+/**************************************************
+ *
+ * reactor.c
+ *
+ * Single-threaded event loop multiplexing descriptors, child exit, signals
+ * and timers. Backed by epoll(7) on Linux and kqueue(2) elsewhere. Nothing
+ * polls: with no timer armed the loop blocks until an event arrives.
+ *
+ **************************************************/
+
+typedef void (*ReactorCallback)(void *context);
+typedef struct ReactorSource *ReactorSourceRef;
+
+int                 reactorInit(void);
+ReactorSourceRef    reactorAddDescriptor(int fd, ReactorCallback callback, void *context);
+ReactorSourceRef    reactorAddProcess(pid_t pid, ReactorCallback callback, void *context);
+ReactorSourceRef    reactorAddSignal(int signo, ReactorCallback callback, void *context);
+ReactorSourceRef    reactorAddTimer(uint64_t intervalMS, int repeats, ReactorCallback callback, void *context);
+int                 reactorSetTimer(ReactorSourceRef source, uint64_t intervalMS);
+void                reactorRemove(ReactorSourceRef source);
+void                reactorPrepareChild(void);
+void                reactorRun(void) __attribute__((noreturn));
+#if defined(__linux__)
+ReactorSourceRef    reactorAddPriority(int fd, ReactorCallback callback, void *context);
+#endif
+#if defined(__APPLE__)
+ReactorSourceRef    reactorAddMachPort(mach_port_t portSet, ReactorCallback callback, void *context);
+ReactorSourceRef    reactorAddRunLoopSource(CFRunLoopSourceRef source);
+#endif
+
+/**************************************************
+ *
+ * status.c
+ *
+ * Publishes the assertions held by this process into the shared status
+ * page described in status.h, and implements caffeinate --status.
+ *
+ **************************************************/
+
+int     statusPagePublish(AssertionFlag flags, PropertyFlag propFlags, const char *command);
+void    statusPageWithdraw(void);
+int     statusPageShow(void);
+
+/**************************************************
+ *
+ * audit.c
+ *
+ * Fixed-size memory-mapped ring of assertion creates and releases shared by
+ * every caffeinate on the host, and the caffeinate --audit query.
+ *
+ **************************************************/
+
+typedef enum {
+    kAuditCreate            = 1,
+    kAuditRelease           = 2,
+    kAuditSleep             = 3     /* utility readied for sleep; latency is the ack */
+} AuditEvent;
+
+typedef struct {
+    AuditEvent      event;
+    AssertionFlag   type;
+    pid_t           pid;
+    int             result;
+    int64_t         start;
+    int64_t         duration;
+    int64_t         latency;
+    char            command[21];
+} AuditEntry;
+
+typedef void (*AuditVisitor)(const AuditEntry *entry, void *context);
+
+typedef struct {
+    uint64_t        next;       /* first record not yet visited */
+    uint64_t        stalled;    /* record the last scan stopped at, plus one; 0 if none */
+} AuditCursor;
+
+int64_t     auditNow(void);
+void        auditRecord(AuditEvent event, AssertionFlag type, pid_t pid, const char *command,
+                        int64_t start, int64_t duration, int64_t latency, int result);
+uint64_t    auditScan(AuditCursor *cursor, AuditVisitor visitor, void *context);
+int         auditShow(void);
+
+/**************************************************
+ *
+ * metrics.c
+ *
+ * caffeinate --metrics: node_exporter textfile exporter fed by the audit ring.
+ *
+ **************************************************/
+
+#define kMetricsDefaultInterval 15      /* seconds */
+
+void    metricsExport(const char *path, unsigned interval) __attribute__((noreturn));
+
+/**************************************************
+ *
+ * energy.c
+ *
+ * caffeinate --energy: joules used while the assertions were held, from
+ * the powercap (RAPL) counters, reported on exit.
+ *
+ **************************************************/
+
+int     energyStart(const char *command, int counting);
+void    energyHolding(int holding);
+
+/**************************************************
+ *
+ * placement.c
+ *
+ * CPU affinity, scheduling policy, nice value and I/O priority for the
+ * utility, applied by the child before execvp().
+ *
+ **************************************************/
+
+#define kPlacementMaxCPUs       1024
+
+typedef struct {
+    uint64_t    cpus[kPlacementMaxCPUs / 64];
+    int         hasCPUs;
+    int         policy;         /* SCHED_*, or -1 to leave it alone */
+    int         priority;
+    int         nice;
+    int         hasNice;
+    int         ioprio;         /* class << 13 | level, or 0 to leave it alone */
+} ChildPlacement;
+
+void    placementInit(ChildPlacement *placement);
+int     placementParseCPUs(ChildPlacement *placement, const char *list);
+int     placementParseSched(ChildPlacement *placement, const char *spec);
+int     placementParseNice(ChildPlacement *placement, const char *value);
+int     placementParseIOPrio(ChildPlacement *placement, const char *spec);
+int     placementApply(const ChildPlacement *placement);
+
+/**************************************************
+ *
+ * latency.c
+ *
+ * caffeinate -l: a CPU wakeup latency (PM QoS) request held for the
+ * utility's lifetime, on all CPUs or on those given to --cpus.
+ *
+ **************************************************/
+
+int     latencyHold(unsigned usec, const ChildPlacement *placement);
+void    latencyForked(void);
+int     latencyResident(const ChildPlacement *placement);
+
+/**************************************************
+ *
+ * perf.c
+ *
+ * caffeinate --perf: the utility's CPUs at the performance governor until
+ * it exits.
+ *
+ **************************************************/
+
+int     perfStart(const ChildPlacement *placement);
+
+/**************************************************
+ *
+ * devices.c
+ *
+ * caffeinate --devices: disks and network interfaces kept out of runtime
+ * suspend and link power saving while the utility runs.
+ *
+ **************************************************/
+
+int     devicesStart(const char *list);
+
+/**************************************************
+ *
+ * pressure.c
+ *
+ * caffeinate --while-pressure: assertions held only while PSI triggers on
+ * /proc/pressure say the host is under load.
+ *
+ **************************************************/
+
+typedef void (*PressureCallback)(int pressured, void *context);
+
+int     pressureParse(const char *list);
+int     pressureWatch(PressureCallback callback, void *context);
+
+/**************************************************
+ *
+ * procwatch.c
+ *
+ * caffeinate -p: assertions held while a process matching a pattern runs,
+ * followed through the netlink process connector.
+ *
+ **************************************************/
+
+typedef void (*ProcWatchCallback)(int running, void *context);
+
+int     procWatchStart(const char *pattern, ProcWatchCallback callback, void *context);
+
+/**************************************************
+ *
+ * writewatch.c
+ *
+ * caffeinate --while-writing: assertions held while files under a
+ * directory are being written, through inotify.
+ *
+ **************************************************/
+
+#define kWriteWatchDefaultQuiet 30      /* seconds */
+
+typedef void (*WriteWatchCallback)(int writing, void *context);
+
+int     writeWatchStart(const char *path, unsigned quiet, WriteWatchCallback callback, void *context);
+
+/**************************************************
+ *
+ * capture.c
+ *
+ * caffeinate --log: pass the utility's stdout and stderr through while
+ * appending them, with per-line timestamps, to a log file.
+ *
+ **************************************************/
+
+int     captureOpen(const char *path, int childFDs[2]);
+int     captureStart(int childFDs[2]);
+void    captureDrain(void);
+
+/**************************************************
+ *
+ * sleepwatch.c
+ *
+ * caffeinate --on-sleep: freeze or signal the utility when the system goes
+ * to sleep regardless of the assertions, and resume it on wake.
+ *
+ **************************************************/
+
+int     sleepWatchParse(const char *action);
+int     sleepWatchPrepare(void);
+int     sleepWatchChild(void);
+int     sleepWatchStart(pid_t pid, const char *command);
+
+/**************************************************
+ *
+ * prefs.c
+ *
+ * Assertions made redundant by the active power management preferences,
+ * e.g. idle sleep when the system sleep timer is already 0 ("Never").
+ *
+ **************************************************/
+
+AssertionFlag   prefsRedundantAssertions(void);
+int             prefsWatch(ReactorCallback callback, void *context);
+
+/**************************************************
+ *
+ * lease.c
+ *
+ * Keep-awake leases across hosts: the caffeinate --lease-server
+ * coordinator, and the node side of caffeinate --lease.
+ *
+ **************************************************/
+
+#define kLeaseDefaultTTL        30      /* seconds */
+
+typedef void (*LeaseCallback)(int valid, void *context);
+
+void    leaseServe(const char *address, unsigned ttl) __attribute__((noreturn));
+int     leaseJoin(const char *spec, LeaseCallback callback, void *context);
+
+/**************************************************
+ *
+ * linger.c
+ *
+ * caffeinate --linger: share assertions through a detached holder that
+ * keeps them a while after its last client exits, and hands them to a
+ * newly installed binary on SIGUSR2.
+ *
+ **************************************************/
+
+int     lingerJoin(AssertionFlag flags, PropertyFlag propFlags, unsigned seconds);
+void    lingerTakeOver(int channel) __attribute__((noreturn));
+
+/**************************************************
+ *
+ * control.c
+ *
+ * caffeinate --control: the utility raises and drops assertion types by
+ * writing to the descriptor in $CAFFEINATE_FD, coalesced here.
+ *
+ **************************************************/
+
+typedef void (*ControlCallback)(AssertionFlag flags, void *context);
+
+int     controlStart(AssertionFlag flags, ControlCallback callback, void *context);
+void    controlForked(void);
+
+#if defined(__linux__)
+
+/**************************************************
+ *
+ * journal.c
+ *
+ * sysfs settings changed for the utility's lifetime, recorded on disk
+ * first and restored by the last caffeinate holding them, or by the next
+ * one if that was killed. journalSave() and the changes themselves go
+ * between journalOpen() and journalClose(), after journalCommit().
+ *
+ **************************************************/
+
+int     journalOpen(void);
+int     journalSave(const char *path);
+int     journalCommit(void);
+void    journalClose(void);
+int     sysfsReadValue(const char *path, char *value, size_t size);
+int     sysfsWriteValue(const char *path, const char *value);
+
+/**************************************************
+ *
+ * dbus.c
+ *
+ * Minimal blocking D-Bus client: enough of the wire protocol to call a
+ * method with string and uint32 arguments and collect the first uint32
+ * or unix fd of the reply, and to receive signals carrying a boolean or
+ * uint32.
+ *
+ **************************************************/
+
+typedef enum {
+    kDBusSystemBus,
+    kDBusSessionBus
+} DBusBusType;
+
+typedef struct {
+    uint32_t    value;          /* first 'u' or 'h' index in the reply body */
+    int         fd;             /* descriptor passed with the reply, or -1 */
+    char        error[128];     /* error name, if the call failed */
+} DBusReply;
+
+typedef struct {
+    char        interface[64];
+    char        member[64];
+    uint32_t    value;          /* first 'b' or 'u' argument */
+} DBusSignal;
+
+int     dbusOpen(DBusBusType bus);
+int     dbusCall(int conn, const char *destination, const char *path,
+                 const char *interface, const char *member, DBusReply *reply,
+                 const char *signature, ...);
+int     dbusReadSignal(int conn, DBusSignal *event);
+int     dbusPendingSignal(void);
+
+#endif /* __linux__ */
+
+#endif /* _CAFFEINATE_H_ */
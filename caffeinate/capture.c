@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate --log <file>: the utility's stdout and stderr go through a
+ * pipe each. What arrives is passed on to caffeinate's own stdout and
+ * stderr and also appended to the log, each line prefixed with the
+ * CLOCK_MONOTONIC time since the utility started and the stream it came
+ * from.
+ *
+ * On Linux the passthrough never touches user space: tee(2) duplicates the
+ * pipe's contents into a second pipe without consuming them, and splice(2)
+ * moves the originals to the destination. Only the duplicate is read, once,
+ * because finding line boundaries to timestamp means looking at the bytes.
+ * Where splice cannot write to the destination (some terminals and older
+ * kernels) the stream falls back to read(2) and write(2).
+ */
+
+#define kCaptureChunk           65536
+#define kCapturePipeSize        (1 << 20)
+
+typedef struct {
+    const char  *tag;           /* "out" or "err" */
+    int         source;         /* read end of the utility's pipe */
+    int         destination;    /* caffeinate's own stdout or stderr */
+#if defined(__linux__)
+    int         duplicate[2];   /* tee(2) copy for the log */
+    int         canSplice;
+#endif
+    int         atLineStart;
+    ReactorSourceRef reactor;
+} CaptureStream;
+
+static CaptureStream    captureStreams[2];
+static int              captureLog = -1;
+static CaptureStream    *captureLastStream = NULL;
+static int64_t          captureStarted = 0;
+
+static int
+captureWriteAll(int fd, const char *buffer, size_t length)
+{
+    while (length) {
+        ssize_t count = write(fd, buffer, length);
+
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += count;
+        length -= (size_t)count;
+    }
+    return 0;
+}
+
+/* Append a chunk to the log, stamping each line that starts in it. */
+static void
+captureAppend(CaptureStream *stream, const char *buffer, size_t length)
+{
+    char stamp[32];
+    struct iovec iov[2];
+    int64_t now = monotonicNow() - captureStarted;
+    int stampLength;
+
+    if (captureLastStream && captureLastStream != stream && !captureLastStream->atLineStart) {
+        /* The other stream stopped mid-line; don't splice this one into it. */
+        (void)captureWriteAll(captureLog, "\n", 1);
+        captureLastStream->atLineStart = 1;
+    }
+    captureLastStream = stream;
+
+    stampLength = snprintf(stamp, sizeof(stamp), "%5lld.%06lld %s ", (long long)(now / 1000000000),
+                           (long long)(now % 1000000000 / 1000), stream->tag);
+    while (length) {
+        const char *newline = memchr(buffer, '\n', length);
+        size_t line = newline ? (size_t)(newline - buffer) + 1 : length;
+        int count = 0;
+
+        if (stream->atLineStart) {
+            iov[count].iov_base = stamp;
+            iov[count++].iov_len = (size_t)stampLength;
+        }
+        iov[count].iov_base = (void *)buffer;
+        iov[count++].iov_len = line;
+        while (writev(captureLog, iov, count) < 0 && errno == EINTR)
+            ;
+        stream->atLineStart = (newline != NULL);
+        buffer += line;
+        length -= line;
+    }
+}
+
+/*
+ * Move what is in the pipe right now. Returns 0 at end of file, -1 when
+ * there is nothing more to read (EAGAIN) or on error, 1 otherwise.
+ */
+static int
+capturePump(CaptureStream *stream)
+{
+    char buffer[kCaptureChunk];
+    ssize_t count;
+
+#if defined(__linux__)
+    if (stream->canSplice) {
+        ssize_t moved, copied = 0;
+
+        count = tee(stream->source, stream->duplicate[1], kCaptureChunk, SPLICE_F_NONBLOCK);
+        if (count <= 0) {
+            if (count < 0 && errno == EINVAL) {
+                stream->canSplice = 0;
+                return capturePump(stream);
+            }
+            return count == 0 ? 0 : -1;
+        }
+        for (moved = 0; moved < count; ) {
+            ssize_t n = splice(stream->source, NULL, stream->destination, NULL,
+                               (size_t)(count - moved), SPLICE_F_MOVE);
+
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            moved += n;
+        }
+        while (copied < count) {
+            ssize_t n = read(stream->duplicate[0], buffer, (size_t)(count - copied));
+
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            captureAppend(stream, buffer, (size_t)n);
+            copied += n;
+        }
+        if (moved < count) {
+            /* Destination refused the splice; the rest is still in the pipe. */
+            stream->canSplice = 0;
+            count = read(stream->source, buffer, (size_t)(count - moved));
+            if (count > 0) (void)captureWriteAll(stream->destination, buffer, (size_t)count);
+        }
+        return 1;
+    }
+#endif
+
+    do {
+        count = read(stream->source, buffer, sizeof(buffer));
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+        return count == 0 ? 0 : -1;
+    }
+    (void)captureWriteAll(stream->destination, buffer, (size_t)count);
+    captureAppend(stream, buffer, (size_t)count);
+    return 1;
+}
+
+static void
+captureClose(CaptureStream *stream)
+{
+    if (stream->reactor) {
+        reactorRemove(stream->reactor);
+        stream->reactor = NULL;
+    }
+    if (stream->source >= 0) {
+        close(stream->source);
+        stream->source = -1;
+    }
+}
+
+static void
+captureReadable(void *context)
+{
+    CaptureStream *stream = context;
+
+    if (capturePump(stream) == 0) {
+        captureClose(stream);
+    }
+}
+
+/*
+ * Open the log and create the utility's pipes. childFDs receives the write
+ * ends, which the child installs as its stdout and stderr.
+ */
+int
+captureOpen(const char *path, int childFDs[2])
+{
+    int i;
+
+    captureLog = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (captureLog < 0) {
+        perror(path);
+        return -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        CaptureStream *stream = &captureStreams[i];
+        int fds[2];
+
+        if (pipe(fds) < 0) {
+            perror("pipe");
+            return -1;
+        }
+        (void)fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        (void)fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        stream->tag = i ? "err" : "out";
+        stream->source = fds[0];
+        stream->destination = i ? STDERR_FILENO : STDOUT_FILENO;
+        stream->atLineStart = 1;
+        childFDs[i] = fds[1];
+#if defined(__linux__)
+        (void)fcntl(fds[0], F_SETPIPE_SZ, kCapturePipeSize);
+        stream->canSplice = (pipe2(stream->duplicate, O_CLOEXEC) == 0);
+        if (stream->canSplice) {
+            (void)fcntl(stream->duplicate[0], F_SETPIPE_SZ, kCapturePipeSize);
+        }
+#endif
+    }
+    captureStarted = monotonicNow();
+    return 0;
+}
+
+/* Parent side, after fork(): start moving output. */
+int
+captureStart(int childFDs[2])
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        close(childFDs[i]);
+        captureStreams[i].reactor = reactorAddDescriptor(captureStreams[i].source, captureReadable,
+                                                         &captureStreams[i]);
+        if (!captureStreams[i].reactor) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The utility has exited: move whatever it left in the pipes. Anything it
+ * handed its output to may still be writing; that is not waited for.
+ */
+void
+captureDrain(void)
+{
+    int i;
+
+    if (captureLog < 0) {
+        return;
+    }
+    for (i = 0; i < 2; i++) {
+        CaptureStream *stream = &captureStreams[i];
+
+        if (stream->source < 0) continue;
+        (void)fcntl(stream->source, F_SETFL, fcntl(stream->source, F_GETFL) | O_NONBLOCK);
+        while (capturePump(stream) > 0)
+            ;
+        captureClose(stream);
+    }
+    if (captureLastStream && !captureLastStream->atLineStart) {
+        (void)captureWriteAll(captureLog, "\n", 1);
+    }
+    close(captureLog);
+    captureLog = -1;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate --control: the utility gets the write end of a pipe, its
+ * number in $CAFFEINATE_FD, and raises and drops assertions by writing to
+ * it: "+" or "-" followed by the types, i, d and s, as in "+d" before an
+ * upload and "-d" after. Whitespace is ignored, so "echo +s >&$CAFFEINATE_FD"
+ * works from a shell.
+ *
+ * What the utility asks for is coalesced: the backend is called at most
+ * once per kControlInterval, with whatever the utility last asked for, so
+ * a utility that toggles in a tight loop costs a few calls a second and a
+ * drop followed by a raise within the interval costs none.
+ */
+
+#define kControlEnvironment     "CAFFEINATE_FD"
+#define kControlInterval        250     /* ms */
+
+static int              controlFDs[2] = { -1, -1 };
+static ReactorSourceRef controlSource = NULL;
+static ReactorSourceRef controlTimer = NULL;
+static ControlCallback  controlCallback = NULL;
+static void             *controlContext = NULL;
+static AssertionFlag    controlWanted = kDefaultAssertionFlag;
+static AssertionFlag    controlApplied = kDefaultAssertionFlag;
+static int64_t          controlLast = 0;
+static int              controlRaise = 1;
+static int              controlPending = 0;
+static int              controlWarned = 0;
+
+static void
+controlApply(void)
+{
+    controlPending = 0;
+    controlLast = monotonicNow();
+    if (controlWanted != controlApplied) {
+        controlApplied = controlWanted;
+        controlCallback(controlApplied, controlContext);
+    }
+}
+
+static void
+controlFire(void *context)
+{
+    (void)context;
+    controlApply();
+}
+
+/* Apply now if the last change is old enough, else once it is. */
+static void
+controlSchedule(void)
+{
+    int64_t elapsed = (monotonicNow() - controlLast) / 1000000;
+
+    if (controlPending) {
+        return;
+    }
+    if (elapsed >= kControlInterval) {
+        controlApply();
+    } else if (controlWanted != controlApplied) {
+        controlPending = 1;
+        if (reactorSetTimer(controlTimer, (uint64_t)(kControlInterval - elapsed))) {
+            controlApply();
+        }
+    }
+}
+
+static void
+controlParse(const char *buffer, ssize_t count)
+{
+    ssize_t i;
+
+    for (i = 0; i < count; i++) {
+        AssertionFlag flag = kDefaultAssertionFlag;
+
+        switch (buffer[i]) {
+            case '+':   controlRaise = 1; continue;
+            case '-':   controlRaise = 0; continue;
+            case 'i':   flag = kIdleAssertionFlag; break;
+            case 'd':   flag = kDisplayAssertionFlag; break;
+            case 's':   flag = kSystemAssertionFlag; break;
+            case ' ': case '\t': case '\n': case '\r':
+                continue;
+            default:
+                if (!controlWarned) {
+                    fprintf(stderr, "caffeinate: %s: ignoring unknown command '%c'\n",
+                            kControlEnvironment, buffer[i]);
+                    controlWarned = 1;
+                }
+                continue;
+        }
+        if (controlRaise) {
+            controlWanted |= flag;
+        } else {
+            controlWanted &= ~flag;
+        }
+    }
+}
+
+static void
+controlReadable(void *context)
+{
+    char buffer[256];
+    ssize_t count;
+
+    (void)context;
+    while ((count = read(controlFDs[0], buffer, sizeof(buffer))) > 0) {
+        controlParse(buffer, count);
+    }
+    if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+        /* Every writer is gone; what was last asked for stands. */
+        reactorRemove(controlSource);
+        controlSource = NULL;
+        close(controlFDs[0]);
+        controlFDs[0] = -1;
+    }
+    controlSchedule();
+}
+
+/*
+ * Open the pipe and export its write end for the utility, starting out
+ * with flags wanted. callback gets each change, flags held so far already
+ * taken into account. Must come before forking the utility.
+ */
+int
+controlStart(AssertionFlag flags, ControlCallback callback, void *context)
+{
+    char number[16];
+
+    if (pipe(controlFDs) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    (void)fcntl(controlFDs[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(controlFDs[0], F_SETFL, O_NONBLOCK);
+    controlSource = reactorAddDescriptor(controlFDs[0], controlReadable, NULL);
+    controlTimer = reactorAddTimer(0, 0, controlFire, NULL);
+    if (!controlSource || !controlTimer) {
+        return -1;
+    }
+    (void)snprintf(number, sizeof(number), "%d", controlFDs[1]);
+    (void)setenv(kControlEnvironment, number, 1);
+
+    controlCallback = callback;
+    controlContext = context;
+    controlWanted = controlApplied = flags;
+    controlLast = monotonicNow();
+    return 0;
+}
+
+/* In the parent: only the utility writes. */
+void
+controlForked(void)
+{
+    if (controlFDs[1] >= 0) {
+        close(controlFDs[1]);
+        controlFDs[1] = -1;
+    }
+}
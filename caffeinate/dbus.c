@@ -0,0 +1,626 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "caffeinate.h"
+
+#define kDBusSystemBusAddress   "unix:path=/var/run/dbus/system_bus_socket"
+#define kDBusMaxMessage         (64 * 1024)
+#define kDBusMaxFDs             8
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define kDBusNativeEndian       'l'
+#else
+#define kDBusNativeEndian       'B'
+#endif
+
+enum {
+    kDBusMethodCall         = 1,
+    kDBusMethodReturn       = 2,
+    kDBusError              = 3,
+    kDBusSignal             = 4
+};
+
+enum {
+    kDBusFieldPath          = 1,
+    kDBusFieldInterface     = 2,
+    kDBusFieldMember        = 3,
+    kDBusFieldErrorName     = 4,
+    kDBusFieldReplySerial   = 5,
+    kDBusFieldDestination   = 6,
+    kDBusFieldSender        = 7,
+    kDBusFieldSignature     = 8,
+    kDBusFieldUnixFDs       = 9
+};
+
+typedef struct {
+    uint8_t     data[4096];
+    size_t      length;
+    int         overflow;
+} DBusBuffer;
+
+typedef struct {
+    uint8_t     type;
+    uint32_t    replySerial;
+    uint32_t    unixFDs;
+    const char  *errorName;
+    const char  *interface;
+    const char  *member;
+    const char  *signature;
+    uint8_t     *body;
+    uint32_t    bodyLength;
+} DBusHeader;
+
+static uint32_t dbusSerial = 0;
+
+/* Signals that arrived while dbusCall() was waiting for its reply. */
+#define kDBusMaxPendingSignals  4
+
+static DBusSignal   dbusPendingSignals[kDBusMaxPendingSignals];
+static int          dbusPendingCount = 0;
+
+/**************************************************
+ * Marshalling
+ **************************************************/
+
+static void
+dbusPutByte(DBusBuffer *buffer, uint8_t value)
+{
+    if (buffer->length >= sizeof(buffer->data)) {
+        buffer->overflow = 1;
+        return;
+    }
+    buffer->data[buffer->length++] = value;
+}
+
+static void
+dbusAlign(DBusBuffer *buffer, size_t alignment)
+{
+    while (buffer->length % alignment) {
+        dbusPutByte(buffer, 0);
+    }
+}
+
+static void
+dbusPutBytes(DBusBuffer *buffer, const void *bytes, size_t length)
+{
+    if (buffer->length + length > sizeof(buffer->data)) {
+        buffer->overflow = 1;
+        return;
+    }
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+static void
+dbusPutUint32(DBusBuffer *buffer, uint32_t value)
+{
+    dbusAlign(buffer, 4);
+    dbusPutBytes(buffer, &value, sizeof(value));
+}
+
+static void
+dbusPutString(DBusBuffer *buffer, const char *string)
+{
+    size_t length = strlen(string);
+
+    dbusPutUint32(buffer, (uint32_t)length);
+    dbusPutBytes(buffer, string, length + 1);
+}
+
+static void
+dbusPutSignature(DBusBuffer *buffer, const char *signature)
+{
+    size_t length = strlen(signature);
+
+    dbusPutByte(buffer, (uint8_t)length);
+    dbusPutBytes(buffer, signature, length + 1);
+}
+
+static void
+dbusPutField(DBusBuffer *buffer, uint8_t code, char type, const char *value)
+{
+    char signature[2] = { type, '\0' };
+
+    dbusAlign(buffer, 8);
+    dbusPutByte(buffer, code);
+    dbusPutSignature(buffer, signature);
+    if (type == 'g') {
+        dbusPutSignature(buffer, value);
+    } else {
+        dbusPutString(buffer, value);
+    }
+}
+
+/**************************************************
+ * Transport
+ **************************************************/
+
+static int
+dbusSend(int conn, const void *bytes, size_t length)
+{
+    const uint8_t *cursor = bytes;
+    ssize_t written;
+
+    while (length) {
+        written = send(conn, cursor, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        cursor += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+static int
+dbusReceive(int conn, void *bytes, size_t length, int *fds, int *fdCount)
+{
+    uint8_t *cursor = bytes;
+    union {
+        struct cmsghdr  align;
+        char            space[CMSG_SPACE(sizeof(int) * kDBusMaxFDs)];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t count;
+
+    while (length) {
+        iov.iov_base = cursor;
+        iov.iov_len = length;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof(control.space);
+
+        count = recvmsg(conn, &msg, 0);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (count == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            int *passed = (int *)CMSG_DATA(cmsg);
+            size_t n, i;
+
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (i = 0; i < n; i++) {
+                if (*fdCount < kDBusMaxFDs) {
+                    fds[(*fdCount)++] = passed[i];
+                } else {
+                    close(passed[i]);
+                }
+            }
+        }
+        cursor += count;
+        length -= (size_t)count;
+    }
+    return 0;
+}
+
+static int
+dbusReadLine(int conn, char *line, size_t size)
+{
+    size_t length = 0;
+    char c;
+
+    while (length + 1 < size) {
+        ssize_t count = read(conn, &c, 1);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return -1;
+        if (c == '\n') break;
+        if (c != '\r') line[length++] = c;
+    }
+    line[length] = '\0';
+    return 0;
+}
+
+static int
+dbusAuthenticate(int conn)
+{
+    char uid[16], request[64], line[256];
+    size_t i, length;
+
+    (void)snprintf(uid, sizeof(uid), "%u", (unsigned)getuid());
+    length = (size_t)snprintf(request, sizeof(request), "%cAUTH EXTERNAL ", '\0');
+    for (i = 0; uid[i]; i++) {
+        length += (size_t)snprintf(request + length, sizeof(request) - length, "%02x", uid[i]);
+    }
+    length += (size_t)snprintf(request + length, sizeof(request) - length, "\r\n");
+
+    if (dbusSend(conn, request, length) || dbusReadLine(conn, line, sizeof(line))
+        || strncmp(line, "OK ", 3)) {
+        return -1;
+    }
+    if (dbusSend(conn, "NEGOTIATE_UNIX_FD\r\n", 19) || dbusReadLine(conn, line, sizeof(line))
+        || strcmp(line, "AGREE_UNIX_FD")) {
+        return -1;
+    }
+    return dbusSend(conn, "BEGIN\r\n", 7);
+}
+
+static int
+dbusUnescape(char *out, size_t size, const char *in, size_t length)
+{
+    size_t o = 0, i;
+
+    for (i = 0; i < length && o + 1 < size; i++) {
+        if (in[i] == '%' && i + 2 < length) {
+            char hex[3] = { in[i + 1], in[i + 2], '\0' };
+            out[o++] = (char)strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            out[o++] = in[i];
+        }
+    }
+    out[o] = '\0';
+    return (i == length) ? 0 : -1;
+}
+
+static int
+dbusConnectAddress(const char *address)
+{
+    const char *entry = address;
+
+    while (entry && *entry) {
+        const char *end = strchr(entry, ';');
+        size_t entryLength = end ? (size_t)(end - entry) : strlen(entry);
+
+        if (!strncmp(entry, "unix:", 5)) {
+            struct sockaddr_un sun;
+            socklen_t sunLength = 0;
+            const char *pair = entry + 5;
+            const char *entryEnd = entry + entryLength;
+            int conn;
+
+            memset(&sun, 0, sizeof(sun));
+            sun.sun_family = AF_UNIX;
+            while (pair < entryEnd) {
+                const char *comma = memchr(pair, ',', (size_t)(entryEnd - pair));
+                const char *pairEnd = comma ? comma : entryEnd;
+
+                if (!strncmp(pair, "path=", 5)) {
+                    if (dbusUnescape(sun.sun_path, sizeof(sun.sun_path), pair + 5,
+                                     (size_t)(pairEnd - pair - 5)) == 0) {
+                        sunLength = (socklen_t)(offsetof(struct sockaddr_un, sun_path)
+                                                + strlen(sun.sun_path) + 1);
+                    }
+                } else if (!strncmp(pair, "abstract=", 9)) {
+                    if (dbusUnescape(sun.sun_path + 1, sizeof(sun.sun_path) - 1, pair + 9,
+                                     (size_t)(pairEnd - pair - 9)) == 0) {
+                        sunLength = (socklen_t)(offsetof(struct sockaddr_un, sun_path)
+                                                + 1 + strlen(sun.sun_path + 1));
+                    }
+                }
+                pair = pairEnd + 1;
+            }
+
+            if (sunLength) {
+                conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (conn >= 0 && connect(conn, (struct sockaddr *)&sun, sunLength) == 0) {
+                    return conn;
+                }
+                if (conn >= 0) close(conn);
+            }
+        }
+        entry = end ? end + 1 : NULL;
+    }
+    return -1;
+}
+
+/**************************************************
+ * Messages
+ **************************************************/
+
+static int
+dbusParseHeader(uint8_t *message, size_t length, DBusHeader *header)
+{
+    uint32_t fieldsLength;
+    size_t offset = 16, end;
+
+    memset(header, 0, sizeof(*header));
+    header->type = message[1];
+    memcpy(&header->bodyLength, message + 4, sizeof(uint32_t));
+    memcpy(&fieldsLength, message + 12, sizeof(uint32_t));
+    end = offset + fieldsLength;
+
+    while (offset < end) {
+        uint8_t code, signatureLength;
+        char type;
+        uint32_t value;
+
+        offset = (offset + 7) & ~(size_t)7;
+        if (offset + 3 > end) return -1;
+        code = message[offset++];
+        signatureLength = message[offset++];
+        type = (char)message[offset];
+        offset += signatureLength + 1;
+
+        switch (type) {
+            case 'u':
+                offset = (offset + 3) & ~(size_t)3;
+                if (offset + 4 > end) return -1;
+                memcpy(&value, message + offset, sizeof(value));
+                offset += 4;
+                if (code == kDBusFieldReplySerial) header->replySerial = value;
+                if (code == kDBusFieldUnixFDs) header->unixFDs = value;
+                break;
+            case 's':
+            case 'o':
+                offset = (offset + 3) & ~(size_t)3;
+                if (offset + 4 > end) return -1;
+                memcpy(&value, message + offset, sizeof(value));
+                offset += 4;
+                if (offset + value + 1 > end) return -1;
+                if (code == kDBusFieldErrorName) header->errorName = (const char *)message + offset;
+                if (code == kDBusFieldInterface) header->interface = (const char *)message + offset;
+                if (code == kDBusFieldMember) header->member = (const char *)message + offset;
+                offset += value + 1;
+                break;
+            case 'g':
+                value = message[offset++];
+                if (offset + value + 1 > end) return -1;
+                if (code == kDBusFieldSignature) header->signature = (const char *)message + offset;
+                offset += value + 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    offset = (end + 7) & ~(size_t)7;
+    if (offset + header->bodyLength != length) return -1;
+    header->body = message + offset;
+    return 0;
+}
+
+static int
+dbusReadMessage(int conn, uint8_t *message, size_t size, size_t *length, int *fds, int *fdCount)
+{
+    uint32_t bodyLength, fieldsLength;
+    size_t total;
+
+    *fdCount = 0;
+    if (dbusReceive(conn, message, 16, fds, fdCount)) return -1;
+    if (message[0] != kDBusNativeEndian) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(&bodyLength, message + 4, sizeof(uint32_t));
+    memcpy(&fieldsLength, message + 12, sizeof(uint32_t));
+    total = ((16 + (size_t)fieldsLength + 7) & ~(size_t)7) + bodyLength;
+    if (total > size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (dbusReceive(conn, message + 16, total - 16, fds, fdCount)) return -1;
+    *length = total;
+    return 0;
+}
+
+static void
+dbusSignalFromMessage(const DBusHeader *parsed, DBusSignal *event)
+{
+    memset(event, 0, sizeof(*event));
+    (void)snprintf(event->interface, sizeof(event->interface), "%s",
+                   parsed->interface ? parsed->interface : "");
+    (void)snprintf(event->member, sizeof(event->member), "%s",
+                   parsed->member ? parsed->member : "");
+    if (parsed->signature && (parsed->signature[0] == 'b' || parsed->signature[0] == 'u')
+        && parsed->bodyLength >= 4) {
+        memcpy(&event->value, parsed->body, sizeof(event->value));
+    }
+}
+
+int
+dbusCall(int conn, const char *destination, const char *path,
+         const char *interface, const char *member, DBusReply *reply,
+         const char *signature, ...)
+{
+    static uint8_t message[kDBusMaxMessage];
+    DBusBuffer body, header;
+    uint32_t serial = ++dbusSerial;
+    uint32_t fieldsStart, fieldsLength;
+    const char *cursor;
+    va_list args;
+
+    memset(reply, 0, sizeof(*reply));
+    reply->fd = -1;
+
+    /* Body first: the header records its length and signature. */
+    memset(&body, 0, sizeof(body));
+    va_start(args, signature);
+    for (cursor = signature; cursor && *cursor; cursor++) {
+        switch (*cursor) {
+            case 's':
+                dbusPutString(&body, va_arg(args, const char *));
+                break;
+            case 'u':
+                dbusPutUint32(&body, va_arg(args, unsigned int));
+                break;
+            default:
+                va_end(args);
+                errno = EINVAL;
+                return -1;
+        }
+    }
+    va_end(args);
+
+    memset(&header, 0, sizeof(header));
+    dbusPutByte(&header, kDBusNativeEndian);
+    dbusPutByte(&header, kDBusMethodCall);
+    dbusPutByte(&header, 0);
+    dbusPutByte(&header, 1);
+    dbusPutUint32(&header, (uint32_t)body.length);
+    dbusPutUint32(&header, serial);
+    dbusPutUint32(&header, 0);
+    fieldsStart = (uint32_t)header.length;
+    dbusPutField(&header, kDBusFieldPath, 'o', path);
+    if (interface) dbusPutField(&header, kDBusFieldInterface, 's', interface);
+    dbusPutField(&header, kDBusFieldMember, 's', member);
+    if (destination) dbusPutField(&header, kDBusFieldDestination, 's', destination);
+    if (signature && *signature) dbusPutField(&header, kDBusFieldSignature, 'g', signature);
+    fieldsLength = (uint32_t)header.length - fieldsStart;
+    memcpy(header.data + 12, &fieldsLength, sizeof(fieldsLength));
+    dbusAlign(&header, 8);
+    dbusPutBytes(&header, body.data, body.length);
+
+    if (header.overflow || body.overflow) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (dbusSend(conn, header.data, header.length)) {
+        return -1;
+    }
+
+    for (;;) {
+        DBusHeader parsed;
+        int fds[kDBusMaxFDs];
+        int fdCount, i;
+        size_t length;
+
+        if (dbusReadMessage(conn, message, sizeof(message), &length, fds, &fdCount)
+            || dbusParseHeader(message, length, &parsed)) {
+            for (i = 0; i < fdCount; i++) close(fds[i]);
+            return -1;
+        }
+
+        if (parsed.type == kDBusSignal && dbusPendingCount < kDBusMaxPendingSignals) {
+            dbusSignalFromMessage(&parsed, &dbusPendingSignals[dbusPendingCount++]);
+        }
+        if ((parsed.type != kDBusMethodReturn && parsed.type != kDBusError)
+            || parsed.replySerial != serial) {
+            for (i = 0; i < fdCount; i++) close(fds[i]);
+            continue;
+        }
+
+        if (parsed.type == kDBusError) {
+            (void)snprintf(reply->error, sizeof(reply->error), "%s",
+                           parsed.errorName ? parsed.errorName : "unknown error");
+            for (i = 0; i < fdCount; i++) close(fds[i]);
+            errno = EACCES;
+            return -1;
+        }
+
+        if (parsed.signature && (parsed.signature[0] == 'u' || parsed.signature[0] == 'h')
+            && parsed.bodyLength >= 4) {
+            memcpy(&reply->value, parsed.body, sizeof(reply->value));
+        }
+        for (i = 0; i < fdCount; i++) {
+            if (parsed.signature && parsed.signature[0] == 'h' && (uint32_t)i == reply->value) {
+                reply->fd = fds[i];
+            } else {
+                close(fds[i]);
+            }
+        }
+        return 0;
+    }
+}
+
+/*
+ * Next signal on conn: one queued during an earlier dbusCall(), otherwise
+ * one read from the socket, which should be readable. Returns 1 with
+ * *event filled in, 0 if the message read was not a signal, -1 on error.
+ */
+int
+dbusReadSignal(int conn, DBusSignal *event)
+{
+    static uint8_t message[kDBusMaxMessage];
+    DBusHeader parsed;
+    int fds[kDBusMaxFDs];
+    int fdCount, i, result;
+    size_t length;
+
+    if (dbusPendingCount) {
+        *event = dbusPendingSignals[0];
+        memmove(&dbusPendingSignals[0], &dbusPendingSignals[1],
+                --dbusPendingCount * sizeof(dbusPendingSignals[0]));
+        return 1;
+    }
+
+    result = -1;
+    if (dbusReadMessage(conn, message, sizeof(message), &length, fds, &fdCount) == 0
+        && dbusParseHeader(message, length, &parsed) == 0) {
+        result = (parsed.type == kDBusSignal);
+        if (result) dbusSignalFromMessage(&parsed, event);
+    }
+    for (i = 0; i < fdCount; i++) close(fds[i]);
+    return result;
+}
+
+int
+dbusPendingSignal(void)
+{
+    return dbusPendingCount > 0;
+}
+
+int
+dbusOpen(DBusBusType bus)
+{
+    const char *address;
+    DBusReply reply;
+    int conn;
+
+    if (bus == kDBusSystemBus) {
+        address = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+        if (!address) address = kDBusSystemBusAddress;
+    } else {
+        address = getenv("DBUS_SESSION_BUS_ADDRESS");
+        if (!address) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    conn = dbusConnectAddress(address);
+    if (conn < 0) {
+        return -1;
+    }
+    if (dbusAuthenticate(conn)
+        || dbusCall(conn, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                    "org.freedesktop.DBus", "Hello", &reply, "")) {
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+#endif /* __linux__ */
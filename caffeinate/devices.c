@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate --devices: keep the listed disks and network interfaces out
+ * of their low-power states while the utility runs, so that an access
+ * after an idle gap does not wait for a disk to spin up or a link to wake.
+ *
+ * Starting from the device behind the block device or interface and going
+ * up to its bus, every runtime PM power/control is set to "on" (which also
+ * stops autosuspend, and a disk's runtime suspend is what spins it down),
+ * PCIe ASPM is turned off on the links, and a SATA host's link power
+ * management policy is set to max_performance. The previous values go
+ * through the settings journal in journal.c and are restored on exit.
+ */
+
+#define kDevicesMax             32
+#define kDevicesMaxFiles        8       /* per directory */
+
+#if defined(__linux__)
+
+typedef struct {
+    const char  *relative;      /* under the device directory */
+    const char  *value;
+} DeviceSetting;
+
+static const DeviceSetting kDeviceSettings[] = {
+    { "power/control",          "on" },
+    { "link/l0s_aspm",          "0" },
+    { "link/l1_aspm",           "0" },
+    { "link/l1_1_aspm",         "0" },
+    { "link/l1_2_aspm",         "0" },
+    { "link/l1_1_pcipm",        "0" },
+    { "link/l1_2_pcipm",        "0" },
+};
+
+/*
+ * The device directory behind name: a block device (a partition counts as
+ * its disk) or a network interface.
+ */
+static int
+devicesResolve(const char *name, char *device)
+{
+    char path[PATH_MAX];
+
+    if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+        errno = EINVAL;
+        return -1;
+    }
+    (void)snprintf(path, sizeof(path), "%s/class/block/%s/partition", sysfsRoot(), name);
+    if (access(path, F_OK) == 0) {
+        (void)snprintf(path, sizeof(path), "%s/class/block/%s/../device", sysfsRoot(), name);
+    } else {
+        (void)snprintf(path, sizeof(path), "%s/class/block/%s/device", sysfsRoot(), name);
+        if (access(path, F_OK) < 0) {
+            (void)snprintf(path, sizeof(path), "%s/class/net/%s/device", sysfsRoot(), name);
+        }
+    }
+    return realpath(path, device) ? 0 : -1;
+}
+
+/* The files to set for one directory on the way up, into paths/values. */
+static int
+devicesFiles(const char *directory, char paths[kDevicesMaxFiles][PATH_MAX], const char *values[kDevicesMaxFiles])
+{
+    const char *base = strrchr(directory, '/');
+    size_t i;
+    int count = 0;
+
+    for (i = 0; i < sizeof(kDeviceSettings)/sizeof(kDeviceSettings[0]); i++) {
+        (void)snprintf(paths[count], PATH_MAX, "%s/%s", directory, kDeviceSettings[i].relative);
+        if (access(paths[count], W_OK) == 0) values[count++] = kDeviceSettings[i].value;
+    }
+    if (base && !strncmp(base + 1, "host", 4)) {
+        (void)snprintf(paths[count], PATH_MAX, "%s/scsi_host/%s/link_power_management_policy",
+                       directory, base + 1);
+        if (access(paths[count], W_OK) == 0) values[count++] = "max_performance";
+    }
+    return count;
+}
+
+/*
+ * Visit device and its parents up to (not including) /sys/devices; apply
+ * writes the values, otherwise they are only saved to the journal.
+ */
+static int
+devicesWalk(const char *device, const char *top, int apply, int *changed)
+{
+    char directory[PATH_MAX], paths[kDevicesMaxFiles][PATH_MAX];
+    const char *values[kDevicesMaxFiles];
+    size_t length = strlen(top);
+    char *slash;
+    int i, count;
+
+    (void)snprintf(directory, sizeof(directory), "%s", device);
+    while (strlen(directory) > length && !strncmp(directory, top, length) && directory[length] == '/') {
+        count = devicesFiles(directory, paths, values);
+        for (i = 0; i < count; i++) {
+            if (apply ? sysfsWriteValue(paths[i], values[i]) : journalSave(paths[i])) {
+                fprintf(stderr, "caffeinate: %s: %s\n", paths[i], strerror(errno));
+                return -1;
+            }
+        }
+        *changed += count;
+        slash = strrchr(directory, '/');
+        *slash = '\0';
+    }
+    return 0;
+}
+
+/*
+ * Pin every device in list (comma separated). Must come before forking the
+ * utility; an unknown device aborts the launch before anything is changed.
+ */
+int
+devicesStart(const char *list)
+{
+    char devices[kDevicesMax][PATH_MAX], top[PATH_MAX], path[PATH_MAX];
+    char *copy, *name, *state = NULL;
+    int i, count = 0, changed = 0, result = -1;
+
+    (void)snprintf(path, sizeof(path), "%s/devices", sysfsRoot());
+    if (!realpath(path, top)) {
+        fprintf(stderr, "caffeinate: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    copy = strdup(list);
+    if (!copy) {
+        perror("");
+        return -1;
+    }
+    for (name = strtok_r(copy, ",", &state); name; name = strtok_r(NULL, ",", &state)) {
+        if (count == kDevicesMax) {
+            fprintf(stderr, "caffeinate: too many devices\n");
+            free(copy);
+            return -1;
+        }
+        if (devicesResolve(name, devices[count]) < 0) {
+            fprintf(stderr, "caffeinate: %s: no such block device or network interface\n", name);
+            free(copy);
+            return -1;
+        }
+        count++;
+    }
+    free(copy);
+
+    if (journalOpen() < 0) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (devicesWalk(devices[i], top, 0, &changed) < 0) goto finish;
+    }
+    if (!changed) {
+        fprintf(stderr, "caffeinate: no power management controls for %s\n", list);
+        result = 0;
+        goto finish;
+    }
+    if (journalCommit() < 0) {
+        goto finish;
+    }
+    for (i = 0; i < count; i++) {
+        if (devicesWalk(devices[i], top, 1, &changed) < 0) goto finish;
+    }
+    result = 0;
+finish:
+    journalClose();
+    return result;
+}
+
+#else
+
+int
+devicesStart(const char *list)
+{
+    (void)list;
+    fprintf(stderr, "caffeinate: --devices is not supported on this platform\n");
+    return -1;
+}
+
+#endif
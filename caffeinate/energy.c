@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "caffeinate.h"
+
+/*
+ * Energy used while assertions are held, from the powercap (RAPL) zones
+ * under /sys/class/powercap. Top-level zones ("intel-rapl:0") already
+ * include their core and uncore subzones, but not dram, which RAPL meters
+ * as a domain of its own; so the top-level zones and their dram subzones
+ * are read. Newer Intel parts also expose the package counter through MMIO
+ * ("intel-rapl-mmio:0", again named package-0), so a zone whose name was
+ * already counted is skipped.
+ *
+ * energy_uj wraps at max_energy_range_uj, which on current parts is a few
+ * minutes of full package power. A single wrap between two samples is
+ * unambiguous, so the counters are re-sampled often enough that even a
+ * package drawing kEnergyMaxWatts cannot wrap twice in between.
+ */
+
+#define kEnergyMaxZones         16
+#define kEnergyMaxWatts         1000
+#define kEnergyMaxInterval      3600    /* seconds */
+
+typedef struct {
+    char        name[48];
+    char        path[PATH_MAX];
+    uint64_t    range;          /* max_energy_range_uj */
+    uint64_t    last;           /* last energy_uj read */
+    uint64_t    consumed;       /* uJ accumulated while counting */
+} EnergyZone;
+
+static EnergyZone       energyZones[kEnergyMaxZones];
+static int              energyZoneCount = 0;
+static const char       *energyCommand = NULL;
+static int              energyCounting = 0;
+static int64_t          energySince = 0;        /* when counting last resumed */
+static int64_t          energyElapsed = 0;      /* ns counted before that */
+
+static int
+energyReadValue(const char *path, uint64_t *value)
+{
+    char buffer[32];
+    ssize_t count;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    count = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (count <= 0) {
+        return -1;
+    }
+    buffer[count] = '\0';
+    *value = strtoull(buffer, NULL, 10);
+    return 0;
+}
+
+static void
+energySample(void *context)
+{
+    int i;
+
+    (void)context;
+    for (i = 0; i < energyZoneCount; i++) {
+        EnergyZone *zone = &energyZones[i];
+        uint64_t now;
+
+        if (energyReadValue(zone->path, &now)) continue;
+        /* Sampled while not counting too, so that a wrap is never missed. */
+        if (energyCounting && now >= zone->last) {
+            zone->consumed += now - zone->last;
+        } else if (energyCounting) {
+            zone->consumed += (zone->range - zone->last) + now;
+        }
+        zone->last = now;
+    }
+}
+
+/* Count while assertions are held, and not while they are not. */
+void
+energyHolding(int holding)
+{
+    if (!energyZoneCount || holding == energyCounting) {
+        return;
+    }
+    energySample(NULL);
+    if (holding) {
+        energySince = monotonicNow();
+    } else {
+        energyElapsed += monotonicNow() - energySince;
+    }
+    energyCounting = holding;
+}
+
+static void
+energyReport(void)
+{
+    double total = 0;
+    int i;
+
+    if (!energyZoneCount) {
+        return;
+    }
+    energyHolding(0);
+
+    fprintf(stderr, "caffeinate: %s: ", energyCommand ? energyCommand : "asserting");
+    for (i = 0; i < energyZoneCount; i++) {
+        fprintf(stderr, "%s%s %.3f J", i ? ", " : "", energyZones[i].name,
+                (double)energyZones[i].consumed / 1e6);
+        if (strcmp(energyZones[i].name, "psys")) {
+            total += (double)energyZones[i].consumed / 1e6;
+        }
+    }
+    fprintf(stderr, "; %.3f J over %.1f s held\n", total, (double)energyElapsed / 1e9);
+    energyZoneCount = 0;
+}
+
+/* The zone's name ("package-0", "dram"), or its directory if it has none. */
+static void
+energyZoneLabel(const char *directory, const char *zone, char *label, size_t size)
+{
+    char path[PATH_MAX];
+    FILE *file;
+
+    (void)snprintf(label, size, "%s", zone);
+    (void)snprintf(path, sizeof(path), "%s/%s/name", directory, zone);
+    if ((file = fopen(path, "r"))) {
+        if (fgets(label, (int)size, file)) {
+            label[strcspn(label, "\n")] = '\0';
+        }
+        fclose(file);
+    }
+}
+
+/*
+ * Add the zone in directory/zone, named name, unless it is unreadable or
+ * a zone of that name is counted already.
+ */
+static void
+energyAddZone(const char *directory, const char *zone, const char *name, uint64_t *interval)
+{
+    EnergyZone *entry = &energyZones[energyZoneCount];
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < energyZoneCount; i++) {
+        if (!strcmp(energyZones[i].name, name)) return;
+    }
+    (void)snprintf(entry->name, sizeof(entry->name), "%s", name);
+    (void)snprintf(entry->path, sizeof(entry->path), "%s/%s/energy_uj", directory, zone);
+    (void)snprintf(path, sizeof(path), "%s/%s/max_energy_range_uj", directory, zone);
+    if (energyReadValue(entry->path, &entry->last) || energyReadValue(path, &entry->range)) {
+        if (errno == EACCES) {
+            fprintf(stderr, "caffeinate: %s: %s\n", entry->path, strerror(errno));
+        }
+        return;
+    }
+    entry->consumed = 0;
+    if (entry->range / 1000000 / kEnergyMaxWatts < *interval) {
+        *interval = entry->range / 1000000 / kEnergyMaxWatts;
+    }
+    energyZoneCount++;
+}
+
+/*
+ * Find the counters and report what was used when the process exits.
+ * Counting starts now if counting is set, and otherwise at the first
+ * energyHolding(1).
+ */
+int
+energyStart(const char *command, int counting)
+{
+    char directory[1024], parent[256], package[32], label[48];
+    uint64_t interval = kEnergyMaxInterval;
+    struct dirent *entry;
+    DIR *dir;
+
+    (void)snprintf(directory, sizeof(directory), "%s/class/powercap", sysfsRoot());
+    dir = opendir(directory);
+    if (!dir) {
+        fprintf(stderr, "caffeinate: no energy counters: %s: %s\n", directory, strerror(errno));
+        return -1;
+    }
+
+    /* Top-level zones first, so that "package-0 dram" is named after its package. */
+    while ((entry = readdir(dir)) && energyZoneCount < kEnergyMaxZones) {
+        const char *colon = strchr(entry->d_name, ':');
+
+        if (!colon || strchr(colon + 1, ':')) continue;
+        energyZoneLabel(directory, entry->d_name, label, sizeof(label));
+        energyAddZone(directory, entry->d_name, label, &interval);
+    }
+    rewinddir(dir);
+    while ((entry = readdir(dir)) && energyZoneCount < kEnergyMaxZones) {
+        const char *colon = strchr(entry->d_name, ':'), *last = strrchr(entry->d_name, ':');
+
+        if (!colon || colon == last) continue;
+        energyZoneLabel(directory, entry->d_name, label, sizeof(label));
+        if (strcmp(label, "dram")) continue;
+        (void)snprintf(parent, sizeof(parent), "%.*s", (int)(last - entry->d_name), entry->d_name);
+        energyZoneLabel(directory, parent, package, sizeof(package));
+        (void)snprintf(label, sizeof(label), "%s dram", package);
+        energyAddZone(directory, entry->d_name, label, &interval);
+    }
+    closedir(dir);
+
+    if (!energyZoneCount) {
+        fprintf(stderr, "caffeinate: no readable energy counters in %s\n", directory);
+        return -1;
+    }
+
+    energyCommand = command;
+    energyCounting = counting;
+    energySince = monotonicNow();
+    if (!reactorAddTimer((interval ? interval : 1) * 1000, 1, energySample, NULL)) {
+        return -1;
+    }
+    (void)atexit(energyReport);
+    return 0;
+}
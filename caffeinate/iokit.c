@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#if defined(__APPLE__)
+
+#include <stdio.h>
+
+#include <CoreFoundation/CFNumber.h>
+
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/pwr_mgt/IOPMLibPrivate.h>
+
+#include "caffeinate.h"
+
+/*
+ * powerd assertions. They belong to the task that created them and go
+ * away with it, so they cannot be handed to the utility.
+ */
+
+typedef struct {
+    AssertionFlag assertionFlag;
+    CFStringRef assertionType;
+} AssertionMapEntry;
+
+
+static AssertionMapEntry assertionMap[] = {
+    { kIdleAssertionFlag,       kIOPMAssertionTypePreventUserIdleSystemSleep },
+    { kDisplayAssertionFlag,    kIOPMAssertionTypePreventUserIdleDisplaySleep },
+    { kSystemAssertionFlag,     kIOPMAssertionTypePreventSystemSleep}};
+
+
+typedef struct {
+    PropertyFlag  propertyFlag;
+    CFStringRef   propertyType;
+    CFTypeRef     propertyVal;
+} PropertyMapEntry;
+
+static IOPMAssertionID    assertionIDs[sizeof(assertionMap)/sizeof(AssertionMapEntry)];
+
+static CFStringRef        kHumanReadableReason = CFSTR("THE CAFFEINATE TOOL IS PREVENTING SLEEP.");
+static CFStringRef        kLocalizationBundlePath = CFSTR("/System/Library/CoreServices/powerd.bundle");
+
+static AssertionMapEntry *
+iokitEntry(AssertionFlag type, u_int *index)
+{
+    u_int i;
+
+    for (i = 0; i < sizeof(assertionMap)/sizeof(AssertionMapEntry); ++i) {
+        if (assertionMap[i].assertionFlag != type) continue;
+        *index = i;
+        return &assertionMap[i];
+    }
+    return NULL;
+}
+
+static int
+iokitCreate(AssertionFlag type, const char *details)
+{
+    IOReturn result;
+    CFStringRef assertionDetailsString = NULL;
+    IOPMAssertionID assertionID = 0;
+    AssertionMapEntry *entry;
+    u_int i;
+
+    entry = iokitEntry(type, &i);
+    if (!entry) {
+        return kIOReturnBadArgument;
+    }
+    assertionDetailsString = CFStringCreateWithCString(kCFAllocatorDefault,
+                                                       details, kCFStringEncodingMacRoman);
+    if (!assertionDetailsString) {
+        fprintf(stderr, "Failed to create assertion name %s\n", details);
+        return kIOReturnNoMemory;
+    }
+
+    result = IOPMAssertionCreateWithDescription(entry->assertionType,
+                                                CFSTR(kAssertionNameString), assertionDetailsString,
+                                                kHumanReadableReason, kLocalizationBundlePath, 0.0, NULL, &assertionID);
+    CFRelease(assertionDetailsString);
+    if (result != kIOReturnSuccess)
+    {
+        fprintf(stderr, "Failed to create %s assertion\n",
+                CFStringGetCStringPtr(entry->assertionType, kCFStringEncodingMacRoman));
+        return result;
+    }
+    assertionIDs[i] = assertionID;
+    return kIOReturnSuccess;
+}
+
+static int
+iokitSetProperty(AssertionFlag type, PropertyFlag property)
+{
+    PropertyMapEntry propertiesMap[] = {
+        {kAssertionOnBattFlag, kIOPMAssertionAppliesToLimitedPowerKey, (CFBooleanRef)kCFBooleanTrue}
+    };
+    IOReturn result = kIOReturnBadArgument;
+    AssertionMapEntry *entry;
+    u_int i, j;
+
+    entry = iokitEntry(type, &i);
+    if (!entry || !assertionIDs[i]) {
+        return kIOReturnNotFound;
+    }
+    for (j = 0; j < sizeof(propertiesMap)/sizeof(PropertyMapEntry); j++)
+    {
+        if (propertiesMap[j].propertyFlag != property) continue;
+
+        result = IOPMAssertionSetProperty(assertionIDs[i],
+                                          propertiesMap[j].propertyType,
+                                          propertiesMap[j].propertyVal);
+        if (result != kIOReturnSuccess)
+        {
+            fprintf(stderr, "Failed to set property %s on assertion %s\n",
+                    CFStringGetCStringPtr(propertiesMap[j].propertyType, kCFStringEncodingMacRoman),
+                    CFStringGetCStringPtr(entry->assertionType, kCFStringEncodingMacRoman));
+        }
+    }
+    return result;
+}
+
+static int
+iokitRelease(AssertionFlag type)
+{
+    IOReturn result = kIOReturnSuccess;
+    u_int i;
+
+    if (iokitEntry(type, &i) && assertionIDs[i]) {
+        result = IOPMAssertionRelease(assertionIDs[i]);
+        assertionIDs[i] = 0;
+    }
+    return result;
+}
+
+static int
+iokitQuery(AssertionFlag type)
+{
+    u_int i;
+
+    return (iokitEntry(type, &i) && assertionIDs[i]) ? kBackendProcessHeld : kBackendNotHeld;
+}
+
+const AssertionBackend iokitBackend = {
+    .name           = "iokit",
+    .types          = kIdleAssertionFlag | kDisplayAssertionFlag | kSystemAssertionFlag,
+    .inheritable    = 0,
+    .create         = iokitCreate,
+    .setProperty    = iokitSetProperty,
+    .release        = iokitRelease,
+    .query          = iokitQuery,
+};
+
+#endif /* __APPLE__ */
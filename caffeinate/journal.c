@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "caffeinate.h"
+
+/*
+ * sysfs settings that caffeinate changes for the utility's lifetime
+ * (--perf, --device, -l with --cpus) and must put back. Every value is recorded in the
+ * journal before it is changed, and the journal is on disk first, so that
+ * a caffeinate that was killed or crashed leaves behind what is needed to
+ * undo it: the next one to open the journal restores any whose holders
+ * are all gone. Several may run at once; the journal lists them all, only
+ * the first one to change a file records its original value, and the last
+ * one out restores everything.
+ */
+
+#define kJournalPath            "/var/run/caffeinate.journal"
+#define kJournalMaxHolders      256
+#define kJournalMaxEntries      4096
+
+typedef struct {
+    char    path[512];
+    char    value[64];
+} JournalEntry;
+
+typedef struct {
+    JournalEntry    *entries;
+    int             count;
+    pid_t           holders[kJournalMaxHolders];
+    int             holderCount;
+} Journal;
+
+static Journal          journal;
+static int              journalLock = -1;
+static int              journalHeld = 0;
+
+static const char *
+journalPath(void)
+{
+    const char *path = getenv("CAFFEINATE_JOURNAL");
+
+    return (path && *path) ? path : kJournalPath;
+}
+
+int
+sysfsReadValue(const char *path, char *value, size_t size)
+{
+    ssize_t count;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    count = read(fd, value, size - 1);
+    close(fd);
+    if (count <= 0) {
+        return -1;
+    }
+    value[count] = '\0';
+    value[strcspn(value, "\n")] = '\0';
+    return 0;
+}
+
+int
+sysfsWriteValue(const char *path, const char *value)
+{
+    ssize_t length = (ssize_t)strlen(value);
+    int fd, result = 0;
+
+    fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write(fd, value, (size_t)length) != length) {
+        result = -1;
+    }
+    if (close(fd) < 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/*
+ * "holder <pid>" and "<path> <value>" lines; a missing journal is empty.
+ * Paths have no spaces (journalSave() refuses them), so the value is the
+ * rest of the line, however empty or spaced out it is.
+ */
+static int
+journalRead(void)
+{
+    char line[640];
+    FILE *file;
+    size_t length;
+
+    free(journal.entries);
+    memset(&journal, 0, sizeof(journal));
+    journal.entries = calloc(kJournalMaxEntries, sizeof(JournalEntry));
+    if (!journal.entries) {
+        return -1;
+    }
+    file = fopen(journalPath(), "re");
+    if (!file) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        JournalEntry *entry = &journal.entries[journal.count];
+        int pid;
+
+        line[strcspn(line, "\n")] = '\0';
+        length = strcspn(line, " ");
+        if (sscanf(line, "holder %d", &pid) == 1) {
+            if (journal.holderCount < kJournalMaxHolders) journal.holders[journal.holderCount++] = pid;
+        } else if (journal.count < kJournalMaxEntries && line[length] == ' '
+                   && length < sizeof(entry->path) && strlen(line + length + 1) < sizeof(entry->value)) {
+            memcpy(entry->path, line, length);
+            entry->path[length] = '\0';
+            (void)snprintf(entry->value, sizeof(entry->value), "%s", line + length + 1);
+            journal.count++;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static int
+journalWrite(void)
+{
+    char temporary[1024];
+    FILE *file;
+    int i;
+
+    if (!journal.holderCount && !journal.count) {
+        return (unlink(journalPath()) < 0 && errno != ENOENT) ? -1 : 0;
+    }
+    (void)snprintf(temporary, sizeof(temporary), "%s.%d.tmp", journalPath(), (int)getpid());
+    file = fopen(temporary, "we");
+    if (!file) {
+        fprintf(stderr, "caffeinate: %s: %s\n", temporary, strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < journal.holderCount; i++) {
+        fprintf(file, "holder %d\n", (int)journal.holders[i]);
+    }
+    for (i = 0; i < journal.count; i++) {
+        fprintf(file, "%s %s\n", journal.entries[i].path, journal.entries[i].value);
+    }
+    /* On disk before any of it is acted on. */
+    if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+        fclose(file);
+        (void)unlink(temporary);
+        return -1;
+    }
+    fclose(file);
+    if (rename(temporary, journalPath()) < 0) {
+        fprintf(stderr, "caffeinate: %s: %s\n", journalPath(), strerror(errno));
+        (void)unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+/* Drop pid, and any holder that is no longer running. */
+static void
+journalPrune(pid_t pid)
+{
+    int i, kept = 0;
+
+    for (i = 0; i < journal.holderCount; i++) {
+        pid_t holder = journal.holders[i];
+
+        if (holder == pid || (kill(holder, 0) < 0 && errno == ESRCH)) continue;
+        journal.holders[kept++] = holder;
+    }
+    journal.holderCount = kept;
+}
+
+/* Undo everything, last change first (a governor before the preference it overrides). */
+static void
+journalRestore(void)
+{
+    int i;
+
+    for (i = journal.count - 1; i >= 0; i--) {
+        if (sysfsWriteValue(journal.entries[i].path, journal.entries[i].value) < 0) {
+            fprintf(stderr, "caffeinate: could not restore %s to %s: %s\n",
+                    journal.entries[i].path, journal.entries[i].value, strerror(errno));
+        }
+    }
+    journal.count = 0;
+}
+
+static int
+journalLockOpen(void)
+{
+    char path[1024];
+
+    (void)snprintf(path, sizeof(path), "%s.lock", journalPath());
+    journalLock = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (journalLock < 0) {
+        fprintf(stderr, "caffeinate: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (flock(journalLock, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            close(journalLock);
+            journalLock = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Unlock, committed or not. */
+void
+journalClose(void)
+{
+    if (journalLock >= 0) {
+        close(journalLock);
+        journalLock = -1;
+    }
+}
+
+static void
+journalRelease(void)
+{
+    if (!journalHeld || journalLockOpen()) {
+        return;
+    }
+    if (journalRead() == 0) {
+        journalPrune(getpid());
+        if (!journal.holderCount) {
+            journalRestore();
+        }
+        (void)journalWrite();
+    }
+    journalHeld = 0;
+    journalClose();
+}
+
+/*
+ * Lock the journal for a round of journalSave() calls, restoring what a
+ * dead caffeinate left behind first.
+ */
+int
+journalOpen(void)
+{
+    if (journalLockOpen()) {
+        return -1;
+    }
+    if (journalRead() < 0) {
+        fprintf(stderr, "caffeinate: %s: %s\n", journalPath(), strerror(errno));
+        journalClose();
+        return -1;
+    }
+    journalPrune(0);
+    if (!journal.holderCount && journal.count) {
+        journalRestore();
+    }
+    return 0;
+}
+
+/* Record path's current value, unless a holder already did. */
+int
+journalSave(const char *path)
+{
+    JournalEntry *entry;
+    int i;
+
+    for (i = 0; i < journal.count; i++) {
+        if (!strcmp(journal.entries[i].path, path)) return 0;
+    }
+    if (journal.count >= kJournalMaxEntries) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (strlen(path) >= sizeof(journal.entries[0].path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (strpbrk(path, " \n")) {
+        errno = EINVAL;
+        return -1;
+    }
+    entry = &journal.entries[journal.count];
+    if (sysfsReadValue(path, entry->value, sizeof(entry->value)) < 0) {
+        return -1;
+    }
+    (void)snprintf(entry->path, sizeof(entry->path), "%s", path);
+    journal.count++;
+    return 0;
+}
+
+/*
+ * Put the saved values on disk with this process as a holder. Only then may
+ * the files be changed, before journalClose(); they are restored when the
+ * last holder exits.
+ */
+int
+journalCommit(void)
+{
+    int i;
+
+    for (i = 0; i < journal.holderCount && journal.holders[i] != getpid(); i++)
+        ;
+    if (i == journal.holderCount && journal.holderCount < kJournalMaxHolders) {
+        journal.holders[journal.holderCount++] = getpid();
+    }
+    if (journalWrite() < 0) {
+        return -1;
+    }
+    if (!journalHeld) {
+        journalHeld = 1;
+        (void)atexit(journalRelease);
+    }
+    return 0;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate -l usec: keep the CPUs out of idle states that take longer
+ * than usec to leave, for as long as the utility runs.
+ *
+ * Without --cpus this is a request on /dev/cpu_dma_latency, which holds
+ * for as long as the descriptor is open. The descriptor is opened without
+ * FD_CLOEXEC, like a logind inhibitor, so the utility keeps it across
+ * execvp() and the request goes away with it. With --cpus only the
+ * utility's CPUs are held back, through their pm_qos_resume_latency_us;
+ * those are plain sysfs values, so the previous ones go through the
+ * settings journal in journal.c and are written back when caffeinate
+ * exits, or by the next one if it was killed. There "0" means no
+ * constraint at all, and the strictest request, the 0 usec that -l 0 asks
+ * for, is spelled "n/a".
+ */
+
+#define kLatencyDevice          "/dev/cpu_dma_latency"
+
+#if defined(__linux__)
+
+static int              latencyFD = -1;
+
+static const char *
+latencyDevice(void)
+{
+    const char *path = getenv("CAFFEINATE_DMA_LATENCY");
+
+    return (path && *path) ? path : kLatencyDevice;
+}
+
+static void
+latencyCPUPath(char *buffer, size_t size, int cpu)
+{
+    (void)snprintf(buffer, size, "%s/devices/system/cpu/cpu%d/power/pm_qos_resume_latency_us",
+                   sysfsRoot(), cpu);
+}
+
+static int
+latencyHoldCPUs(unsigned usec, const ChildPlacement *placement)
+{
+    char path[1024], value[16];
+    int cpu, result = -1;
+
+    if (usec) {
+        (void)snprintf(value, sizeof(value), "%u", usec);
+    } else {
+        (void)snprintf(value, sizeof(value), "n/a");
+    }
+    if (journalOpen() < 0) {
+        return -1;
+    }
+    for (cpu = 0; cpu < kPlacementMaxCPUs; cpu++) {
+        if (!(placement->cpus[cpu / 64] & (1ULL << (cpu % 64)))) continue;
+        latencyCPUPath(path, sizeof(path), cpu);
+        if (journalSave(path) < 0) {
+            fprintf(stderr, "caffeinate: %s: %s\n", path, strerror(errno));
+            goto finish;
+        }
+    }
+    if (journalCommit() < 0) {
+        goto finish;
+    }
+
+    for (cpu = 0; cpu < kPlacementMaxCPUs; cpu++) {
+        if (!(placement->cpus[cpu / 64] & (1ULL << (cpu % 64)))) continue;
+        latencyCPUPath(path, sizeof(path), cpu);
+        if (sysfsWriteValue(path, value) < 0) {
+            fprintf(stderr, "caffeinate: %s: %s\n", path, strerror(errno));
+            goto finish;
+        }
+    }
+    result = 0;
+finish:
+    journalClose();
+    return result;
+}
+
+/*
+ * Put the latency request in place. Must come before forking the utility,
+ * which inherits the /dev/cpu_dma_latency descriptor.
+ */
+int
+latencyHold(unsigned usec, const ChildPlacement *placement)
+{
+    int32_t value = (int32_t)usec;
+
+    if (placement->hasCPUs) {
+        return latencyHoldCPUs(usec, placement);
+    }
+    latencyFD = open(latencyDevice(), O_WRONLY);
+    if (latencyFD < 0) {
+        fprintf(stderr, "caffeinate: %s: %s\n", latencyDevice(), strerror(errno));
+        return -1;
+    }
+    /* Four bytes are taken as a binary s32; anything else is parsed as hex. */
+    if (write(latencyFD, &value, sizeof(value)) != sizeof(value)) {
+        fprintf(stderr, "caffeinate: %s: %s\n", latencyDevice(), strerror(errno));
+        close(latencyFD);
+        latencyFD = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* The utility has its copy of the descriptor; ours would only outlive it. */
+void
+latencyForked(void)
+{
+    if (latencyFD >= 0) {
+        close(latencyFD);
+        latencyFD = -1;
+    }
+}
+
+/* Whether caffeinate has to stay around to undo the request. */
+int
+latencyResident(const ChildPlacement *placement)
+{
+    return placement->hasCPUs;
+}
+
+#else
+
+int
+latencyHold(unsigned usec, const ChildPlacement *placement)
+{
+    (void)usec;
+    (void)placement;
+    fprintf(stderr, "caffeinate: -l is not supported on this platform\n");
+    return -1;
+}
+
+void
+latencyForked(void)
+{
+}
+
+int
+latencyResident(const ChildPlacement *placement)
+{
+    (void)placement;
+    return 0;
+}
+
+#endif
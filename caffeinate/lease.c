@@ -0,0 +1,798 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "caffeinate.h"
+
+/*
+ * Keep-awake leases for jobs spanning several hosts. A coordinator
+ * (caffeinate --lease-server) grants time-bounded leases over TCP; each
+ * node's caffeinate (caffeinate --lease host:port/job) holds its
+ * assertions for exactly as long as it holds a lease it knows to be valid.
+ *
+ * The protocol is line based:
+ *
+ *      server: CAFFEINATE 1                    greeting, on connect
+ *      client: ACQUIRE <job>
+ *      server: GRANT <id> <ttl-ms>
+ *      client: RENEW <id> [<id> ...]
+ *      server: RENEWED <ttl-ms> [<id> ...]
+ *      server: LOST <id> [<id> ...]            unknown or already expired
+ *      client: RELEASE <id> [<id> ...]
+ *
+ * Renewal is batched at both ends so the coordinator scales to thousands
+ * of nodes: a node holding leases on several jobs renews them all in one
+ * RENEW and gets one reply, the coordinator answers everything read from
+ * a connection in as few writes as fit, and instead of a timer per lease
+ * it expires leases in a single sweep every kLeaseSweepInterval. Nodes
+ * renew at a third of the TTL with jitter, so renewals do not arrive in
+ * lockstep.
+ *
+ * A node measures its lease from when it sent the request that granted or
+ * renewed it, never from when the reply arrived, so its view of the lease
+ * always ends before the coordinator's does.
+ */
+
+#define kLeaseGreeting          "CAFFEINATE 1"
+#define kLeaseLineMax           4096
+#define kLeaseJobMax            64
+#define kLeaseMaxJobs           32      /* per node; a RENEW for all fits a line */
+#define kLeaseSweepInterval     1000    /* ms */
+
+/**************************************************
+ * Coordinator
+ **************************************************/
+
+typedef struct {
+    uint64_t    id;             /* slot << 32 | generation; 0 when free */
+    int64_t     expires;        /* monotonic ns */
+    char        job[kLeaseJobMax];
+} Lease;
+
+typedef struct {
+    int                 fd;
+    ReactorSourceRef    source;
+    size_t              length;
+    char                buffer[kLeaseLineMax];
+} LeaseConnection;
+
+typedef struct {
+    int         fd;             /* written out to when full; -1 to drop what does not fit */
+    int         failed;
+    size_t      length;
+    char        data[kLeaseLineMax];
+} LeaseOutput;
+
+static Lease            *leases = NULL;
+static uint32_t         leaseCapacity = 0;
+static uint32_t         leaseCount = 0;
+static uint32_t         leaseGeneration = 0;
+static int64_t          leaseTTL = 0;
+
+static void
+leaseAppend(LeaseOutput *output, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static int
+leaseFlush(LeaseOutput *output)
+{
+    if (output->failed) {
+        return -1;
+    }
+    if (output->length && write(output->fd, output->data, output->length) != (ssize_t)output->length) {
+        output->failed = 1;
+        return -1;
+    }
+    output->length = 0;
+    return 0;
+}
+
+/* Pieces are never split, so an id is written whole or not at all. */
+static void
+leaseAppend(LeaseOutput *output, const char *format, ...)
+{
+    char piece[128];
+    va_list args;
+    int count;
+
+    va_start(args, format);
+    count = vsnprintf(piece, sizeof(piece), format, args);
+    va_end(args);
+    if (count <= 0 || (size_t)count >= sizeof(piece)) {
+        return;
+    }
+    if (output->length + (size_t)count > sizeof(output->data)
+        && (output->fd < 0 || leaseFlush(output) < 0)) {
+        return;
+    }
+    memcpy(output->data + output->length, piece, (size_t)count);
+    output->length += (size_t)count;
+}
+
+static Lease *
+leaseLookup(uint64_t id)
+{
+    uint32_t slot = (uint32_t)(id >> 32);
+
+    if (!id || slot >= leaseCapacity || leases[slot].id != id) {
+        return NULL;
+    }
+    return &leases[slot];
+}
+
+static Lease *
+leaseGrant(const char *job)
+{
+    uint32_t slot;
+
+    for (slot = 0; slot < leaseCapacity && leases[slot].id; slot++)
+        ;
+    if (slot == leaseCapacity) {
+        uint32_t capacity = leaseCapacity ? leaseCapacity * 2 : 64;
+        Lease *grown = realloc(leases, capacity * sizeof(*leases));
+
+        if (!grown) {
+            return NULL;
+        }
+        memset(grown + leaseCapacity, 0, (capacity - leaseCapacity) * sizeof(*leases));
+        leases = grown;
+        leaseCapacity = capacity;
+    }
+    if (!++leaseGeneration) ++leaseGeneration;
+    leases[slot].id = ((uint64_t)slot << 32) | leaseGeneration;
+    leases[slot].expires = monotonicNow() + leaseTTL;
+    (void)snprintf(leases[slot].job, sizeof(leases[slot].job), "%s", job);
+    leaseCount++;
+    return &leases[slot];
+}
+
+static void
+leaseSweep(void *context)
+{
+    int64_t now = monotonicNow();
+    uint32_t slot;
+
+    (void)context;
+    for (slot = 0; slot < leaseCapacity; slot++) {
+        if (leases[slot].id && leases[slot].expires <= now) {
+            leases[slot].id = 0;
+            leaseCount--;
+        }
+    }
+}
+
+static void
+leaseServeLine(char *line, LeaseOutput *output)
+{
+    char *verb = strtok(line, " ");
+    char *word;
+
+    if (!verb) {
+        return;
+    }
+    if (!strcmp(verb, "ACQUIRE")) {
+        Lease *lease;
+
+        word = strtok(NULL, " ");
+        if (!word || !(lease = leaseGrant(word))) {
+            leaseAppend(output, "DENY\n");
+            return;
+        }
+        leaseAppend(output, "GRANT %llu %lld\n", (unsigned long long)lease->id,
+                    (long long)(leaseTTL / 1000000));
+    } else if (!strcmp(verb, "RENEW")) {
+        /* A line holds fewer ids than this, each at least "1 ". */
+        uint64_t ids[kLeaseLineMax / 2];
+        int64_t now = monotonicNow();
+        int count = 0, lost = 0, i;
+
+        while ((word = strtok(NULL, " ")) && count < (int)(sizeof(ids) / sizeof(*ids))) {
+            ids[count++] = strtoull(word, NULL, 10);
+        }
+        leaseAppend(output, "RENEWED %lld", (long long)(leaseTTL / 1000000));
+        for (i = 0; i < count; i++) {
+            Lease *lease = leaseLookup(ids[i]);
+
+            if (lease && lease->expires > now) {
+                lease->expires = now + leaseTTL;
+                leaseAppend(output, " %llu", (unsigned long long)ids[i]);
+            } else {
+                /* Answered below, once the renewed ones are out. */
+                ids[lost++] = ids[i];
+            }
+        }
+        leaseAppend(output, "\n");
+        for (i = 0; i < lost; i++) {
+            leaseAppend(output, "%s %llu", i ? "" : "LOST", (unsigned long long)ids[i]);
+        }
+        if (lost) {
+            leaseAppend(output, "\n");
+        }
+    } else if (!strcmp(verb, "RELEASE")) {
+        while ((word = strtok(NULL, " "))) {
+            Lease *lease = leaseLookup(strtoull(word, NULL, 10));
+
+            if (lease) {
+                lease->id = 0;
+                leaseCount--;
+            }
+        }
+    }
+}
+
+static void
+leaseConnectionClose(LeaseConnection *connection)
+{
+    reactorRemove(connection->source);
+    close(connection->fd);
+    free(connection);
+}
+
+static void
+leaseConnectionReadable(void *context)
+{
+    LeaseConnection *connection = context;
+    LeaseOutput output;
+    ssize_t count;
+    char *line, *newline;
+
+    count = read(connection->fd, connection->buffer + connection->length,
+                 sizeof(connection->buffer) - connection->length - 1);
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (count <= 0) {
+        /* Its leases stay until they expire; the node may just be reconnecting. */
+        leaseConnectionClose(connection);
+        return;
+    }
+    connection->length += (size_t)count;
+    connection->buffer[connection->length] = '\0';
+
+    output.fd = connection->fd;
+    output.failed = 0;
+    output.length = 0;
+    line = connection->buffer;
+    while ((newline = strchr(line, '\n'))) {
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r') newline[-1] = '\0';
+        leaseServeLine(line, &output);
+        line = newline + 1;
+    }
+    connection->length -= (size_t)(line - connection->buffer);
+    memmove(connection->buffer, line, connection->length);
+    if (connection->length == sizeof(connection->buffer) - 1) {
+        leaseConnectionClose(connection);
+        return;
+    }
+
+    /* Replies are small; a peer that cannot take them is dropped. */
+    if (leaseFlush(&output) < 0) {
+        leaseConnectionClose(connection);
+    }
+}
+
+static void
+leaseAccept(void *context)
+{
+    int listener = (int)(intptr_t)context;
+    LeaseConnection *connection;
+    int fd, one = 1;
+
+    fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    (void)fcntl(fd, F_SETFL, O_NONBLOCK);
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    connection = calloc(1, sizeof(*connection));
+    if (!connection || write(fd, kLeaseGreeting "\n", sizeof(kLeaseGreeting)) < 0
+        || !(connection->source = reactorAddDescriptor(fd, leaseConnectionReadable, connection))) {
+        free(connection);
+        close(fd);
+        return;
+    }
+    connection->fd = fd;
+}
+
+/* Split "host:port" or "[v6]:port"; host may be empty. */
+static int
+leaseResolve(const char *address, int passive, struct addrinfo **result)
+{
+    char host[256];
+    const char *port;
+    struct addrinfo hints;
+    size_t length;
+
+    port = strrchr(address, ':');
+    length = port ? (size_t)(port - address) : 0;
+    port = port ? port + 1 : address;
+    if (length >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, address, length);
+    host[length] = '\0';
+    if (length >= 2 && host[0] == '[' && host[length - 1] == ']') {
+        memmove(host, host + 1, length - 2);
+        host[length - 2] = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    return getaddrinfo(host[0] ? host : NULL, port, &hints, result) ? -1 : 0;
+}
+
+void
+leaseServe(const char *address, unsigned ttl)
+{
+    struct addrinfo *addresses, *entry;
+    int listener = -1, one = 1;
+
+    leaseTTL = (int64_t)ttl * 1000000000;
+    if (leaseResolve(address, 1, &addresses)) {
+        fprintf(stderr, "caffeinate: cannot resolve %s\n", address);
+        exit(1);
+    }
+    for (entry = addresses; entry && listener < 0; entry = entry->ai_next) {
+        listener = socket(entry->ai_family, entry->ai_socktype, entry->ai_protocol);
+        if (listener < 0) continue;
+        (void)setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listener, entry->ai_addr, entry->ai_addrlen) < 0 || listen(listener, SOMAXCONN) < 0) {
+            close(listener);
+            listener = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (listener < 0) {
+        perror(address);
+        exit(1);
+    }
+    (void)fcntl(listener, F_SETFD, FD_CLOEXEC);
+    (void)fcntl(listener, F_SETFL, O_NONBLOCK);
+
+    if (!reactorAddDescriptor(listener, leaseAccept, (void *)(intptr_t)listener)
+        || !reactorAddTimer(kLeaseSweepInterval, 1, leaseSweep, NULL)) {
+        exit(1);
+    }
+    reactorRun();
+}
+
+/**************************************************
+ * Node
+ **************************************************/
+
+static struct addrinfo  *leaseServer = NULL;
+static struct addrinfo  *leaseAddress = NULL;   /* being connected to, or connected */
+static int              leaseConnecting = 0;
+static LeaseCallback    leaseCallback = NULL;
+static void             *leaseContext = NULL;
+
+/* One per job; a node in several jobs renews all of its leases at once. */
+typedef struct {
+    char        job[kLeaseJobMax];
+    uint64_t    id;             /* 0 until granted */
+    uint64_t    acquiring;      /* order of its unanswered ACQUIRE; 0 if none */
+    int64_t     requested;      /* when the oldest unanswered request naming it was sent */
+    int64_t     expires;        /* monotonic ns; 0 when not held */
+} LeaseHold;
+
+static LeaseHold        leaseHolds[kLeaseMaxJobs];
+static int              leaseHoldCount = 0;
+static uint64_t         leaseAcquireCount = 0;
+
+static int              leaseFD = -1;
+static ReactorSourceRef leaseSource = NULL;
+static ReactorSourceRef leaseRenewTimer = NULL;
+static ReactorSourceRef leaseExpiryTimer = NULL;
+static size_t           leaseLength = 0;
+static char             leaseBuffer[kLeaseLineMax];
+static int              leaseValid = 0;
+static int64_t          leaseRetry = 0;         /* ms between attempts */
+
+static void leaseConnect(void);
+
+static void
+leaseSetValid(int valid)
+{
+    if (valid != leaseValid) {
+        leaseValid = valid;
+        leaseCallback(valid, leaseContext);
+    }
+}
+
+/* Valid while any lease is; the expiry timer follows the first to run out. */
+static void
+leaseUpdate(void)
+{
+    int64_t now = monotonicNow(), first = 0;
+    int i;
+
+    for (i = 0; i < leaseHoldCount; i++) {
+        int64_t expires = leaseHolds[i].expires;
+
+        if (expires > now && (!first || expires < first)) first = expires;
+    }
+    (void)reactorSetTimer(leaseExpiryTimer, first ? (uint64_t)((first - now) / 1000000) + 1 : 0);
+    leaseSetValid(first != 0);
+}
+
+/* A third of the TTL, give or take a tenth. */
+static uint64_t
+leaseRenewInterval(int64_t ttlMS)
+{
+    int64_t base = ttlMS / 3;
+    int64_t spread = base / 10;
+
+    return (uint64_t)(base - spread + (spread ? random() % (2 * spread + 1) : 0));
+}
+
+static void
+leaseDisconnect(void)
+{
+    int i;
+
+    if (leaseFD < 0) {
+        return;
+    }
+    reactorRemove(leaseSource);
+    leaseSource = NULL;
+    close(leaseFD);
+    leaseFD = -1;
+    leaseLength = 0;
+    /* Nothing sent on it will be answered. */
+    for (i = 0; i < leaseHoldCount; i++) {
+        leaseHolds[i].acquiring = 0;
+        leaseHolds[i].requested = 0;
+    }
+    /* The leases, if any, stay valid until they expire; retry well before. */
+    (void)reactorSetTimer(leaseRenewTimer, (uint64_t)leaseRetry);
+}
+
+static int
+leaseSend(const LeaseOutput *request)
+{
+    if (!request->length) {
+        return 0;
+    }
+    if (leaseFD < 0 || write(leaseFD, request->data, request->length) != (ssize_t)request->length) {
+        leaseDisconnect();
+        return -1;
+    }
+    return 0;
+}
+
+/* Renew every lease held in one RENEW, and ask for any not held. */
+static void
+leaseRequest(void)
+{
+    LeaseOutput request;
+    int64_t now = monotonicNow();
+    int i, renewing = 0;
+
+    request.fd = -1;
+    request.length = 0;
+    for (i = 0; i < leaseHoldCount; i++) {
+        LeaseHold *hold = &leaseHolds[i];
+
+        if (!hold->id) continue;
+        leaseAppend(&request, "%s %llu", renewing++ ? "" : "RENEW", (unsigned long long)hold->id);
+        if (!hold->requested) hold->requested = now;
+    }
+    if (renewing) {
+        leaseAppend(&request, "\n");
+    }
+    for (i = 0; i < leaseHoldCount; i++) {
+        LeaseHold *hold = &leaseHolds[i];
+
+        if (hold->id || hold->acquiring) continue;
+        leaseAppend(&request, "ACQUIRE %s\n", hold->job);
+        hold->acquiring = ++leaseAcquireCount;
+        hold->requested = now;
+    }
+    (void)leaseSend(&request);
+}
+
+/* GRANT and DENY answer ACQUIREs in the order they were sent. */
+static LeaseHold *
+leaseAcquired(void)
+{
+    LeaseHold *oldest = NULL;
+    int i;
+
+    for (i = 0; i < leaseHoldCount; i++) {
+        if (leaseHolds[i].acquiring && (!oldest || leaseHolds[i].acquiring < oldest->acquiring)) {
+            oldest = &leaseHolds[i];
+        }
+    }
+    if (oldest) {
+        oldest->acquiring = 0;
+    }
+    return oldest;
+}
+
+static LeaseHold *
+leaseFind(uint64_t id)
+{
+    int i;
+
+    for (i = 0; id && i < leaseHoldCount; i++) {
+        if (leaseHolds[i].id == id) return &leaseHolds[i];
+    }
+    return NULL;
+}
+
+static void
+leaseHeld(LeaseHold *hold, uint64_t id, int64_t ttlMS)
+{
+    int64_t expires = hold->requested + ttlMS * 1000000;
+
+    hold->id = id;
+    leaseRetry = ttlMS / 3 ? ttlMS / 3 : 1;
+    /* Answered too late to count on, the lease is renewed all the same. */
+    if (hold->requested && expires > monotonicNow()) {
+        hold->expires = expires;
+        (void)reactorSetTimer(leaseRenewTimer, leaseRenewInterval(ttlMS));
+    } else {
+        (void)reactorSetTimer(leaseRenewTimer, (uint64_t)leaseRetry);
+    }
+    hold->requested = 0;
+    leaseUpdate();
+}
+
+static void
+leaseHandleLine(char *line)
+{
+    char *verb = strtok(line, " ");
+    char *word;
+    LeaseHold *hold;
+    int lost = 0;
+
+    if (!verb) {
+        return;
+    }
+    if (!strcmp(verb, kLeaseGreeting) || !strncmp(verb, "CAFFEINATE", 10)) {
+        leaseRequest();
+    } else if (!strcmp(verb, "GRANT")) {
+        uint64_t id = strtoull((word = strtok(NULL, " ")) ? word : "0", NULL, 10);
+        int64_t ttl = strtoll((word = strtok(NULL, " ")) ? word : "0", NULL, 10);
+
+        if ((hold = leaseAcquired())) leaseHeld(hold, id, ttl);
+    } else if (!strcmp(verb, "RENEWED")) {
+        int64_t ttl = strtoll((word = strtok(NULL, " ")) ? word : "0", NULL, 10);
+
+        while ((word = strtok(NULL, " "))) {
+            if ((hold = leaseFind(strtoull(word, NULL, 10)))) leaseHeld(hold, hold->id, ttl);
+        }
+    } else if (!strcmp(verb, "LOST")) {
+        while ((word = strtok(NULL, " "))) {
+            if (!(hold = leaseFind(strtoull(word, NULL, 10)))) continue;
+            hold->id = 0;
+            hold->requested = 0;
+            hold->expires = 0;
+            lost = 1;
+        }
+        if (lost) {
+            leaseUpdate();
+            leaseRequest();
+        }
+    } else if (!strcmp(verb, "DENY")) {
+        if ((hold = leaseAcquired())) hold->requested = 0;
+        (void)reactorSetTimer(leaseRenewTimer, (uint64_t)leaseRetry);
+    }
+}
+
+static void
+leaseReadable(void *context)
+{
+    ssize_t count;
+    char *line, *newline;
+
+    (void)context;
+    if (leaseConnecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        /* A refused or unreachable address: go on to the next one right away. */
+        if (getsockopt(leaseFD, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error) {
+            reactorRemove(leaseSource);
+            leaseSource = NULL;
+            close(leaseFD);
+            leaseFD = -1;
+            leaseAddress = leaseAddress ? leaseAddress->ai_next : NULL;
+            leaseConnect();
+            return;
+        }
+        leaseConnecting = 0;
+    }
+    count = read(leaseFD, leaseBuffer + leaseLength, sizeof(leaseBuffer) - leaseLength - 1);
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (count <= 0) {
+        leaseDisconnect();
+        return;
+    }
+    leaseLength += (size_t)count;
+    leaseBuffer[leaseLength] = '\0';
+    line = leaseBuffer;
+    while (leaseFD >= 0 && (newline = strchr(line, '\n'))) {
+        *newline = '\0';
+        leaseHandleLine(line);
+        line = newline + 1;
+    }
+    if (leaseFD >= 0) {
+        leaseLength -= (size_t)(line - leaseBuffer);
+        memmove(leaseBuffer, line, leaseLength);
+    }
+}
+
+/*
+ * Connect without blocking the reactor: the coordinator's greeting is what
+ * makes the socket readable once the connection is up, and a connection
+ * that fails makes it readable too, with SO_ERROR set. Each address the
+ * coordinator resolved to is tried in turn, starting from the one that
+ * last worked; after the last, the retry timer starts over from the first.
+ */
+static void
+leaseConnect(void)
+{
+    int one = 1;
+
+    leaseConnecting = 0;
+    while (leaseAddress && leaseFD < 0) {
+        leaseFD = socket(leaseAddress->ai_family, leaseAddress->ai_socktype, leaseAddress->ai_protocol);
+        if (leaseFD >= 0) {
+            (void)fcntl(leaseFD, F_SETFD, FD_CLOEXEC);
+            (void)fcntl(leaseFD, F_SETFL, O_NONBLOCK);
+            (void)setsockopt(leaseFD, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (connect(leaseFD, leaseAddress->ai_addr, leaseAddress->ai_addrlen) == 0) break;
+            if (errno == EINPROGRESS) {
+                leaseConnecting = 1;
+                break;
+            }
+            close(leaseFD);
+            leaseFD = -1;
+        }
+        leaseAddress = leaseAddress->ai_next;
+    }
+    if (leaseFD < 0 || !(leaseSource = reactorAddDescriptor(leaseFD, leaseReadable, NULL))) {
+        if (leaseFD >= 0) close(leaseFD);
+        leaseFD = -1;
+        leaseAddress = leaseServer;
+        (void)reactorSetTimer(leaseRenewTimer, (uint64_t)leaseRetry);
+    }
+}
+
+static void
+leaseRenewFired(void *context)
+{
+    (void)context;
+    if (leaseFD < 0) {
+        leaseConnect();
+    } else {
+        leaseRequest();
+    }
+}
+
+static void
+leaseExpired(void *context)
+{
+    int64_t now = monotonicNow();
+    int i;
+
+    (void)context;
+    /* Not renewed in time: ask for those leases anew. */
+    for (i = 0; i < leaseHoldCount; i++) {
+        if (leaseHolds[i].expires && leaseHolds[i].expires <= now) {
+            leaseHolds[i].id = 0;
+            leaseHolds[i].expires = 0;
+        }
+    }
+    leaseUpdate();
+    if (leaseValid) {
+        leaseRequest();
+    } else {
+        /* Nothing held any more: start over on a fresh connection. */
+        leaseDisconnect();
+    }
+}
+
+static void
+leaseRelease(void)
+{
+    LeaseOutput request;
+    int i, releasing = 0;
+
+    request.fd = -1;
+    request.length = 0;
+    for (i = 0; i < leaseHoldCount; i++) {
+        if (!leaseHolds[i].id) continue;
+        leaseAppend(&request, "%s %llu", releasing++ ? "" : "RELEASE", (unsigned long long)leaseHolds[i].id);
+    }
+    if (releasing && leaseFD >= 0) {
+        leaseAppend(&request, "\n");
+        (void)leaseSend(&request);
+    }
+}
+
+/*
+ * spec is host:port/job[,job...]. callback is told whenever the node
+ * starts or stops holding a lease on any of the jobs.
+ */
+int
+leaseJoin(const char *spec, LeaseCallback callback, void *context)
+{
+    const char *slash = strrchr(spec, '/'), *job, *end;
+    char address[300];
+
+    if (!slash || (size_t)(slash - spec) >= sizeof(address)) {
+        fprintf(stderr, "caffeinate: lease must be host:port/job\n");
+        return -1;
+    }
+    for (job = slash + 1; ; job = end + 1) {
+        end = job + strcspn(job, ",");
+        if (end == job || (size_t)(end - job) >= kLeaseJobMax || leaseHoldCount == kLeaseMaxJobs
+            || memchr(job, ' ', (size_t)(end - job)) || memchr(job, '\r', (size_t)(end - job))
+            || memchr(job, '\n', (size_t)(end - job))) {
+            fprintf(stderr, "caffeinate: lease must be host:port/job[,job...], at most %d jobs\n",
+                    kLeaseMaxJobs);
+            return -1;
+        }
+        memcpy(leaseHolds[leaseHoldCount].job, job, (size_t)(end - job));
+        leaseHolds[leaseHoldCount++].job[end - job] = '\0';
+        if (!*end) break;
+    }
+    memcpy(address, spec, (size_t)(slash - spec));
+    address[slash - spec] = '\0';
+    if (leaseResolve(address, 0, &leaseServer)) {
+        fprintf(stderr, "caffeinate: cannot resolve %s\n", address);
+        return -1;
+    }
+
+    leaseCallback = callback;
+    leaseContext = context;
+    leaseRetry = 1000;
+    srandom((unsigned)(getpid() ^ monotonicNow()));
+    leaseRenewTimer = reactorAddTimer(0, 0, leaseRenewFired, NULL);
+    leaseExpiryTimer = reactorAddTimer(0, 0, leaseExpired, NULL);
+    if (!leaseRenewTimer || !leaseExpiryTimer) {
+        return -1;
+    }
+    (void)atexit(leaseRelease);
+    leaseAddress = leaseServer;
+    leaseConnect();
+    return 0;
+}
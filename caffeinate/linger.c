@@ -0,0 +1,716 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if defined(__APPLE__)
+#include <mach-o/dyld.h>
+#endif
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate --linger <seconds>: instead of creating and releasing its
+ * own assertions, caffeinate attaches to a detached holder process that
+ * owns them and keeps them for <seconds> after its last client goes away.
+ * A build running thousands of short commands under caffeinate then pays
+ * for one create and one release instead of one of each per command.
+ *
+ * There is one holder per user and assertion set, listening on a unix
+ * socket in $XDG_RUNTIME_DIR (or a private directory under /tmp). Holding a client connection open is
+ * the hold: the holder greets each client with "OK" once it has the
+ * assertions, and notices a client's exit as end of file. The first
+ * caffeinate to find no holder starts one; an flock(2) on a lock file next
+ * to the socket keeps two from starting at once.
+ */
+
+#define kLingerReplyTimeout     1000    /* ms */
+#define kLingerHandoffTimeout   5000    /* ms */
+#define kLingerHandoffVersion   1
+#define kLingerHandoffBatch     64      /* descriptors per message */
+
+static char             lingerPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int              lingerFD = -1;
+
+static AssertionFlag    lingerFlags = kDefaultAssertionFlag;
+static int64_t          lingerSince = 0;
+static unsigned         lingerClients = 0;
+static unsigned         lingerSeconds = 0;
+static ReactorSourceRef lingerTimer = NULL;
+static int64_t          lingerDeadline = 0;
+static PropertyFlag     lingerPropFlags = kDefaultPropertyFlag;
+static int              lingerLock = -1;
+static int              lingerListener = -1;
+static char             lingerExecutable[PATH_MAX];
+
+/*
+ * /tmp is shared, so the socket goes in a directory of our own there:
+ * created 0700 if missing, and otherwise only used if it is a real
+ * directory that we own and nobody else can get into.
+ */
+static int
+lingerPrivateDirectory(char *directory, size_t size)
+{
+    struct stat sb;
+
+    (void)snprintf(directory, size, "/tmp/caffeinate-%u", (unsigned)getuid());
+    if (mkdir(directory, 0700) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    if (lstat(directory, &sb) < 0 || !S_ISDIR(sb.st_mode) || sb.st_uid != getuid()
+        || (sb.st_mode & 077)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+lingerSetPath(AssertionFlag flags, PropertyFlag propFlags)
+{
+    const char *directory = getenv("XDG_RUNTIME_DIR");
+    char fallback[64];
+    int length;
+
+    if (!directory || !*directory) {
+        if (lingerPrivateDirectory(fallback, sizeof(fallback))) {
+            return -1;
+        }
+        directory = fallback;
+    }
+    length = snprintf(lingerPath, sizeof(lingerPath), "%s/caffeinate-%u-%x.sock", directory,
+                      (unsigned)getuid(), (unsigned)(flags | (propFlags << 8)));
+    return (length > 0 && (size_t)length < sizeof(lingerPath) - 5) ? 0 : -1;
+}
+
+static int
+lingerAddress(struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, lingerPath, strlen(lingerPath) + 1);
+    return (int)(offsetof(struct sockaddr_un, sun_path) + strlen(lingerPath) + 1);
+}
+
+/**************************************************
+ * Holder
+ **************************************************/
+
+typedef struct LingerClient {
+    int                 fd;
+    ReactorSourceRef    source;
+    struct LingerClient *next;
+} LingerClient;
+
+static LingerClient     *lingerClientList = NULL;
+
+/* Count down to lingerExpired() from now, or stop if ms is 0. */
+static void
+lingerArm(uint64_t ms)
+{
+    lingerDeadline = ms ? monotonicNow() + (int64_t)ms * 1000000 : 0;
+    (void)reactorSetTimer(lingerTimer, ms);
+}
+
+static void
+lingerExpired(void *context)
+{
+    int64_t now = auditNow();
+    int flag;
+
+    (void)context;
+    /* Stop taking clients first; one that raced in sees EOF and starts over. */
+    (void)unlink(lingerPath);
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        int64_t began;
+        int result;
+
+        if (!(lingerFlags & flag)) continue;
+        began = monotonicNow();
+        result = releaseAssertion((AssertionFlag)flag);
+        auditRecord(kAuditRelease, (AssertionFlag)flag, getpid(), "linger", lingerSince,
+                    now - lingerSince, monotonicNow() - began, result);
+    }
+    exit(0);
+}
+
+static void
+lingerClientReadable(void *context)
+{
+    LingerClient *client = context, **link;
+    char buffer[64];
+    ssize_t count;
+
+    count = read(client->fd, buffer, sizeof(buffer));
+    if (count > 0 || (count < 0 && (errno == EAGAIN || errno == EINTR))) {
+        return;
+    }
+    for (link = &lingerClientList; *link != client; link = &(*link)->next)
+        ;
+    *link = client->next;
+    reactorRemove(client->source);
+    close(client->fd);
+    free(client);
+    if (--lingerClients == 0) {
+        lingerArm((uint64_t)lingerSeconds * 1000);
+    }
+}
+
+/* Start watching fd, a client that has already been greeted. */
+static int
+lingerAddClient(int fd)
+{
+    LingerClient *client = malloc(sizeof(*client));
+
+    if (!client || !(client->source = reactorAddDescriptor(fd, lingerClientReadable, client))) {
+        free(client);
+        return -1;
+    }
+    client->fd = fd;
+    client->next = lingerClientList;
+    lingerClientList = client;
+    if (lingerClients++ == 0) {
+        lingerArm(0);
+    }
+    return 0;
+}
+
+static void
+lingerAccept(void *context)
+{
+    int listener = (int)(intptr_t)context;
+    int fd;
+
+    fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (write(fd, "OK\n", 3) != 3 || lingerAddClient(fd)) {
+        close(fd);
+    }
+}
+
+/*
+ * Where this binary was installed, noted when the holder starts: by the
+ * time of an upgrade the running image may have been replaced there.
+ */
+static void
+lingerNoteExecutable(void)
+{
+#if defined(__APPLE__)
+    char path[PATH_MAX];
+    uint32_t size = sizeof(path);
+
+    if (_NSGetExecutablePath(path, &size) != 0 || !realpath(path, lingerExecutable)) {
+        lingerExecutable[0] = '\0';
+    }
+#else
+    ssize_t length = readlink("/proc/self/exe", lingerExecutable, sizeof(lingerExecutable) - 1);
+
+    lingerExecutable[length > 0 ? length : 0] = '\0';
+#endif
+}
+
+/*
+ * Hot upgrade: on SIGUSR2 the holder starts the binary now installed where
+ * it was started from and hands it everything over a socketpair: its state
+ * as text, and the lock, the listening socket, the inhibitor descriptors
+ * and the client connections with SCM_RIGHTS. Assertions that are not
+ * descriptors (the screen saver's, IOKit's) are created anew by the new
+ * holder. Only once it says it has taken over does this one release what
+ * the other could not take, and exit; until then it keeps everything, so
+ * coverage never lapses and a new binary that fails to start costs
+ * nothing. Clients that connect meanwhile wait in the listen backlog.
+ */
+
+static int
+lingerSendFDs(int channel, const char *text, const int *fds, int count)
+{
+    union {
+        struct cmsghdr  header;
+        char            space[CMSG_SPACE(kLingerHandoffBatch * sizeof(int))];
+    } control;
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+
+    memset(&message, 0, sizeof(message));
+    iov.iov_base = (void *)text;
+    iov.iov_len = strlen(text);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (count) {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.space;
+        message.msg_controllen = CMSG_SPACE((size_t)count * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN((size_t)count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, (size_t)count * sizeof(int));
+    }
+    while (sendmsg(channel, &message, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+/* Returns the number of descriptors received into fds, or -1. */
+static int
+lingerReceiveFDs(int channel, char *text, size_t size, int *fds, int capacity)
+{
+    union {
+        struct cmsghdr  header;
+        char            space[CMSG_SPACE(kLingerHandoffBatch * sizeof(int))];
+    } control;
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t length;
+    int count = 0;
+
+    memset(&message, 0, sizeof(message));
+    iov.iov_base = text;
+    iov.iov_len = size - 1;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    while ((length = recvmsg(channel, &message, 0)) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (length <= 0) {
+        return -1;
+    }
+    text[length] = '\0';
+    for (cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        int received;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        received = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        if (received > capacity - count) {
+            return -1;
+        }
+        memcpy(fds + count, CMSG_DATA(cmsg), (size_t)received * sizeof(int));
+        count += received;
+    }
+    return count;
+}
+
+static int
+lingerHandOff(int channel)
+{
+    char state[2048];
+    int fds[kLingerHandoffBatch];
+    LingerClient *client;
+    size_t length;
+    int count = 0, flag;
+
+    fds[count++] = lingerLock;
+    fds[count++] = lingerListener;
+    length = (size_t)snprintf(state, sizeof(state),
+                              "version %d\nflags %x %x\nsince %lld\nseconds %u\ndeadline %lld\n"
+                              "clients %u\npath %s\n",
+                              kLingerHandoffVersion, (unsigned)lingerFlags, (unsigned)lingerPropFlags,
+                              (long long)lingerSince, lingerSeconds, (long long)lingerDeadline,
+                              lingerClients, lingerPath);
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        const AssertionBackend *backend;
+        int held, index = -1;
+
+        if (!(lingerFlags & flag) || !(backend = backendHolding((AssertionFlag)flag))) continue;
+        held = backend->query((AssertionFlag)flag);
+        if (held >= 0) {
+            index = count;
+            fds[count++] = held;
+        }
+        length += (size_t)snprintf(state + length, sizeof(state) - length, "backend %x %s %d\n",
+                                   (unsigned)flag, backend->name, index);
+    }
+    if (length >= sizeof(state) || lingerSendFDs(channel, state, fds, count)) {
+        return -1;
+    }
+
+    /* The clients follow, a batch at a time. */
+    count = 0;
+    for (client = lingerClientList; client; client = client->next) {
+        fds[count++] = client->fd;
+        if (count == kLingerHandoffBatch || !client->next) {
+            if (lingerSendFDs(channel, "clients", fds, count)) return -1;
+            count = 0;
+        }
+    }
+    return 0;
+}
+
+static void
+lingerUpgrade(void *context)
+{
+    struct pollfd pfd;
+    char number[16], reply = 0;
+    int channel[2], flag;
+    pid_t pid;
+
+    (void)context;
+    if (!lingerExecutable[0] || socketpair(AF_UNIX, SOCK_DGRAM, 0, channel) < 0) {
+        return;
+    }
+    (void)fcntl(channel[0], F_SETFD, FD_CLOEXEC);
+    pid = fork();
+    if (pid == 0) {
+        /* The new holder gets its inhibitor descriptors through the channel, not by inheritance. */
+        reactorPrepareChild();
+        for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+            const AssertionBackend *backend = backendHolding((AssertionFlag)flag);
+            int held = backend ? backend->query((AssertionFlag)flag) : kBackendNotHeld;
+
+            if (held >= 0) close(held);
+        }
+        (void)snprintf(number, sizeof(number), "%d", channel[1]);
+        execl(lingerExecutable, "caffeinate", "--linger-takeover", number, (char *)NULL);
+        _exit(127);
+    }
+    close(channel[1]);
+    if (pid > 0 && lingerHandOff(channel[0]) == 0) {
+        pfd.fd = channel[0];
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, kLingerHandoffTimeout) == 1) {
+            (void)read(channel[0], &reply, 1);
+        }
+    }
+    close(channel[0]);
+    if (reply != 'k') {
+        /* Keep holding; the new binary did not take over. */
+        if (pid > 0) {
+            (void)kill(pid, SIGKILL);
+            (void)waitpid(pid, NULL, 0);
+            /* Whatever it had created by then would otherwise outlive it. */
+            for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+                const AssertionBackend *backend = backendHolding((AssertionFlag)flag);
+
+                if ((lingerFlags & flag) && backend && backend->reclaim) {
+                    backend->reclaim((AssertionFlag)flag, pid);
+                }
+            }
+        }
+        return;
+    }
+    for (flag = kIdleAssertionFlag; flag <= kSystemAssertionFlag; flag <<= 1) {
+        const AssertionBackend *backend = backendHolding((AssertionFlag)flag);
+
+        if (backend && backend->query((AssertionFlag)flag) == kBackendProcessHeld) {
+            (void)backend->release((AssertionFlag)flag);
+        }
+    }
+    exit(0);
+}
+
+/*
+ * Take clients on lingerListener, and upgrades on SIGUSR2. SIGTERM lets
+ * go at once, releasing what would otherwise outlive the holder (a wake
+ * lock).
+ */
+static int
+lingerListen(void)
+{
+    if (!reactorAddDescriptor(lingerListener, lingerAccept, (void *)(intptr_t)lingerListener)
+        || !reactorAddSignal(SIGUSR2, lingerUpgrade, NULL)
+        || !reactorAddSignal(SIGTERM, lingerExpired, NULL)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void
+lingerHold(AssertionFlag flags, PropertyFlag propFlags, int ready) __attribute__((noreturn));
+
+/*
+ * Close whatever the holder inherited beyond stdio and keep. A pipe the
+ * caller waits on for end of file (a CI log, a make jobserver) must not
+ * stay open for the holder's lifetime.
+ */
+static void
+lingerCloseInherited(int keep)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int fd;
+
+    dir = opendir("/dev/fd");
+    if (!dir) {
+        for (fd = STDERR_FILENO + 1; fd < getdtablesize(); fd++) {
+            if (fd != keep) (void)close(fd);
+        }
+        return;
+    }
+    while ((entry = readdir(dir))) {
+        fd = atoi(entry->d_name);
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9' || fd <= STDERR_FILENO
+            || fd == keep || fd == dirfd(dir)) continue;
+        (void)close(fd);
+    }
+    closedir(dir);
+}
+
+static void
+lingerHold(AssertionFlag flags, PropertyFlag propFlags, int ready)
+{
+    struct sockaddr_un address;
+    char lockPath[sizeof(lingerPath) + 8];
+    int null;
+
+    null = open("/dev/null", O_RDWR);
+    if (null >= 0) {
+        (void)dup2(null, STDIN_FILENO);
+        (void)dup2(null, STDOUT_FILENO);
+        (void)dup2(null, STDERR_FILENO);
+        if (null > STDERR_FILENO) close(null);
+    }
+    lingerCloseInherited(ready);
+    (void)chdir("/");
+    lingerNoteExecutable();
+
+    (void)snprintf(lockPath, sizeof(lockPath), "%s.lock", lingerPath);
+    lingerLock = open(lockPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lingerLock < 0 || flock(lingerLock, LOCK_EX | LOCK_NB) < 0) {
+        /* Someone else is the holder; our client just has to connect again. */
+        (void)write(ready, "b", 1);
+        _exit(0);
+    }
+
+    if (flags && createAssertions("linger", flags, propFlags)) {
+        _exit(1);
+    }
+    lingerFlags = flags;
+    lingerPropFlags = propFlags;
+    lingerSince = auditNow();
+    (void)statusPagePublish(flags, propFlags, "(linger)");
+
+    (void)unlink(lingerPath);
+    lingerListener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lingerListener < 0
+        || bind(lingerListener, (struct sockaddr *)&address, (socklen_t)lingerAddress(&address)) < 0
+        || chmod(lingerPath, 0600) < 0 || listen(lingerListener, SOMAXCONN) < 0) {
+        _exit(1);
+    }
+    (void)fcntl(lingerListener, F_SETFD, FD_CLOEXEC);
+
+    lingerTimer = reactorAddTimer(0, 0, lingerExpired, NULL);
+    if (!lingerTimer || lingerListen()) {
+        _exit(1);
+    }
+    (void)write(ready, "r", 1);
+    close(ready);
+    lingerArm((uint64_t)lingerSeconds * 1000);
+    reactorRun();
+}
+
+/*
+ * caffeinate --linger-takeover <fd>: the new side of a hot upgrade, started
+ * by the old holder with its end of the channel. Nothing is released if
+ * this fails; the old holder just carries on.
+ */
+void
+lingerTakeOver(int channel)
+{
+    char state[2048], line[256], name[32], *cursor, *next;
+    int fds[kLingerHandoffBatch], clients[kLingerHandoffBatch];
+    unsigned flags = 0, propFlags = 0, expected = 0, received = 0, type;
+    long long since = 0, deadline = 0;
+    AssertionFlag create = kDefaultAssertionFlag;
+    int count, version = 0, index, i;
+
+    (void)fcntl(channel, F_SETFD, FD_CLOEXEC);
+    lingerNoteExecutable();
+    count = lingerReceiveFDs(channel, state, sizeof(state), fds, kLingerHandoffBatch);
+    if (count < 2) {
+        _exit(1);
+    }
+    lingerLock = fds[0];
+    lingerListener = fds[1];
+    (void)fcntl(lingerLock, F_SETFD, FD_CLOEXEC);
+    (void)fcntl(lingerListener, F_SETFD, FD_CLOEXEC);
+
+    for (cursor = state; *cursor; cursor = next) {
+        next = cursor + strcspn(cursor, "\n");
+        if (*next) *next++ = '\0';
+        if (sscanf(cursor, "version %d", &version) == 1
+            || sscanf(cursor, "flags %x %x", &flags, &propFlags) == 2
+            || sscanf(cursor, "since %lld", &since) == 1
+            || sscanf(cursor, "seconds %u", &lingerSeconds) == 1
+            || sscanf(cursor, "deadline %lld", &deadline) == 1
+            || sscanf(cursor, "clients %u", &expected) == 1) {
+            continue;
+        }
+        if (!strncmp(cursor, "path ", 5)) {
+            (void)snprintf(lingerPath, sizeof(lingerPath), "%s", cursor + 5);
+        } else if (sscanf(cursor, "backend %x %31s %d", &type, name, &index) == 3) {
+            if (index >= count || backendAdopt((AssertionFlag)type, name, index >= 0 ? fds[index] : -1)) {
+                _exit(1);
+            }
+            if (index < 0) create |= (AssertionFlag)type;
+        }
+    }
+    if (version != kLingerHandoffVersion || !lingerPath[0]) {
+        _exit(1);
+    }
+
+    lingerFlags = (AssertionFlag)flags;
+    lingerPropFlags = (PropertyFlag)propFlags;
+    lingerSince = since;
+    /* Ours, alongside the old holder's, before it lets go of them. */
+    if (create && createAssertions("linger", create, lingerPropFlags)) {
+        _exit(1);
+    }
+
+    lingerTimer = reactorAddTimer(0, 0, lingerExpired, NULL);
+    if (!lingerTimer || lingerListen()) {
+        _exit(1);
+    }
+    while (received < expected) {
+        count = lingerReceiveFDs(channel, line, sizeof(line), clients, kLingerHandoffBatch);
+        if (count <= 0) {
+            _exit(1);
+        }
+        for (i = 0; i < count; i++) {
+            (void)fcntl(clients[i], F_SETFD, FD_CLOEXEC);
+            if (lingerAddClient(clients[i])) _exit(1);
+        }
+        received += (unsigned)count;
+    }
+    if (!lingerClients) {
+        /* Carry on counting down where the old holder was. */
+        int64_t remaining = deadline ? (int64_t)deadline - monotonicNow() : 0;
+
+        lingerArm(remaining > 1000000 ? (uint64_t)(remaining / 1000000) : 1);
+    }
+    (void)statusPagePublish(lingerFlags, lingerPropFlags, "(linger)");
+
+    (void)write(channel, "k", 1);
+    close(channel);
+    reactorRun();
+}
+
+/**************************************************
+ * Client
+ **************************************************/
+
+static int
+lingerConnect(void)
+{
+    struct sockaddr_un address;
+    struct pollfd pfd;
+    char reply[3];
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (connect(fd, (struct sockaddr *)&address, (socklen_t)lingerAddress(&address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, kLingerReplyTimeout) != 1 || read(fd, reply, sizeof(reply)) != 3
+        || memcmp(reply, "OK\n", 3)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void
+lingerSpawn(AssertionFlag flags, PropertyFlag propFlags)
+{
+    int ready[2];
+    char status;
+    pid_t pid;
+
+    if (pipe(ready) < 0) {
+        return;
+    }
+    switch (pid = fork()) {
+        case -1:
+            break;
+        case 0:
+            /* Detach twice so the holder is nobody's child and owns no terminal. */
+            close(ready[0]);
+            (void)setsid();
+            (void)signal(SIGHUP, SIG_IGN);
+            if (fork() == 0) {
+                lingerHold(flags, propFlags, ready[1]);
+            }
+            _exit(0);
+        default:
+            close(ready[1]);
+            (void)waitpid(pid, NULL, 0);
+            /* A byte once the holder listens; EOF if it gave up. */
+            while (read(ready[0], &status, 1) < 0 && errno == EINTR)
+                ;
+            break;
+    }
+    close(ready[0]);
+    if (pid < 0) close(ready[1]);
+}
+
+/*
+ * Have a holder keep flags for us, starting one if needed. Returns 0 if
+ * one does, for as long as this process lives; -1 if caffeinate should
+ * create its own assertions as usual. Must run before the reactor is set
+ * up, since the holder is forked from here.
+ */
+int
+lingerJoin(AssertionFlag flags, PropertyFlag propFlags, unsigned seconds)
+{
+    int attempt;
+
+    if (lingerSetPath(flags, propFlags)) {
+        return -1;
+    }
+    /* Only used if this process starts the holder; a running one keeps its own. */
+    lingerSeconds = seconds;
+    for (attempt = 0; attempt < 3 && lingerFD < 0; attempt++) {
+        lingerFD = lingerConnect();
+        if (lingerFD < 0) {
+            lingerSpawn(flags, propFlags);
+        }
+    }
+    return (lingerFD >= 0) ? 0 : -1;
+}
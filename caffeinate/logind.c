@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "caffeinate.h"
+
+/*
+ * systemd-logind has no per-display lock; an "idle" inhibitor stops the
+ * session from going idle, which is what blanks the screen and triggers
+ * IdleAction. "sleep" blocks suspend and hibernate outright. logind does
+ * not distinguish power sources, so -b is implied.
+ *
+ * Each inhibitor is a descriptor handed back by logind; the lock lasts as
+ * long as any copy of it stays open. The descriptors are deliberately left
+ * without FD_CLOEXEC so that they survive execvp() and are released when the
+ * utility exits, like an IOKit assertion owned by its process.
+ */
+
+typedef struct {
+    AssertionFlag assertionFlag;
+    const char    *assertionType;
+} AssertionMapEntry;
+
+static AssertionMapEntry assertionMap[] = {
+    { kIdleAssertionFlag,       "idle" },
+    { kDisplayAssertionFlag,    "idle" },
+    { kSystemAssertionFlag,     "sleep" }};
+
+static int                inhibitorFDs[sizeof(assertionMap)/sizeof(AssertionMapEntry)] = { -1, -1, -1 };
+static int                logindConn = -1;
+
+static int
+logindInit(void)
+{
+    logindConn = dbusOpen(kDBusSystemBus);
+    if (logindConn < 0) {
+        perror("Failed to connect to the system bus");
+        return -1;
+    }
+    return 0;
+}
+
+/* Nothing needs the bus once the inhibitors are taken. */
+static void
+logindSettle(void)
+{
+    if (logindConn >= 0) {
+        close(logindConn);
+        logindConn = -1;
+    }
+}
+
+static int
+logindIndex(AssertionFlag type)
+{
+    u_int i;
+
+    for (i = 0; i < sizeof(assertionMap)/sizeof(AssertionMapEntry); ++i) {
+        if (assertionMap[i].assertionFlag == type) return (int)i;
+    }
+    return -1;
+}
+
+static int
+logindCreate(AssertionFlag type, const char *details)
+{
+    DBusReply reply;
+    int i = logindIndex(type);
+    u_int j;
+
+    if (i < 0) {
+        return EINVAL;
+    }
+
+    /* -i and -d share the "idle" lock; take it once. */
+    for (j = 0; j < sizeof(assertionMap)/sizeof(AssertionMapEntry); j++) {
+        if ((int)j != i && inhibitorFDs[j] >= 0
+            && !strcmp(assertionMap[j].assertionType, assertionMap[i].assertionType)) break;
+    }
+    if (j < sizeof(assertionMap)/sizeof(AssertionMapEntry)) {
+        inhibitorFDs[i] = fcntl(inhibitorFDs[j], F_DUPFD, 0);
+        return (inhibitorFDs[i] < 0) ? errno : 0;
+    }
+
+    errno = 0;
+    if (dbusCall(logindConn, "org.freedesktop.login1", "/org/freedesktop/login1",
+                 "org.freedesktop.login1.Manager", "Inhibit", &reply, "ssss",
+                 assertionMap[i].assertionType, kAssertionNameString, details, "block")
+        || reply.fd < 0)
+    {
+        fprintf(stderr, "Failed to create %s assertion%s%s\n", assertionMap[i].assertionType,
+                reply.error[0] ? ": " : "", reply.error);
+        return errno ? errno : EIO;
+    }
+    inhibitorFDs[i] = reply.fd;
+    return 0;
+}
+
+static int
+logindRelease(AssertionFlag type)
+{
+    int i = logindIndex(type);
+    int result = 0;
+
+    if (i >= 0 && inhibitorFDs[i] >= 0) {
+        if (close(inhibitorFDs[i]) < 0) result = errno;
+        inhibitorFDs[i] = -1;
+    }
+    return result;
+}
+
+static int
+logindQuery(AssertionFlag type)
+{
+    int i = logindIndex(type);
+
+    return (i >= 0 && inhibitorFDs[i] >= 0) ? inhibitorFDs[i] : kBackendNotHeld;
+}
+
+static int
+logindAdopt(AssertionFlag type, int fd)
+{
+    int i = logindIndex(type);
+
+    if (i < 0) {
+        return EINVAL;
+    }
+    if (inhibitorFDs[i] >= 0) {
+        close(inhibitorFDs[i]);
+    }
+    inhibitorFDs[i] = fd;
+    return 0;
+}
+
+const AssertionBackend logindBackend = {
+    .name           = "logind",
+    .types          = kIdleAssertionFlag | kDisplayAssertionFlag | kSystemAssertionFlag,
+    .inheritable    = 1,
+    .init           = logindInit,
+    .settle         = logindSettle,
+    .create         = logindCreate,
+    .release        = logindRelease,
+    .query          = logindQuery,
+    .adopt          = logindAdopt,
+};
+
+#endif /* __linux__ */
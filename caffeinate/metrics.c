@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate --metrics <file> tails the audit ring and rewrites <file> as a
+ * node_exporter textfile. The per-wrapper processes never touch it: they
+ * only append to the ring, and the exporter folds new records into its
+ * histograms on a fixed interval, writing the file (to a temporary name,
+ * then rename(2)) at most once per interval and only when something
+ * changed.
+ */
+
+#define kMetricsTypes           3
+#define kMetricsMaxBuckets      12
+
+typedef struct {
+    uint64_t    buckets[kMetricsMaxBuckets];   /* per bucket, not cumulative; last is +Inf */
+    uint64_t    count;
+    double      sum;
+} Histogram;
+
+static const double kHoldBuckets[] = {
+    1, 10, 60, 300, 900, 3600, 14400, 43200, 86400
+};
+static const double kLatencyBuckets[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.05, 0.25, 1
+};
+
+static Histogram        holdSeconds[kMetricsTypes];
+static Histogram        createSeconds[kMetricsTypes];
+static Histogram        releaseSeconds[kMetricsTypes];
+static Histogram        sleepAckSeconds;
+static uint64_t         createFailures[kMetricsTypes];
+static uint64_t         recordsLost = 0;
+static AuditCursor      metricsCursor = { 0, 0 };
+static int              metricsScanned = 0;
+static int              metricsChanged = 1;
+static const char       *metricsPath = NULL;
+
+static const AssertionFlag kMetricsTypeFlags[kMetricsTypes] = {
+    kIdleAssertionFlag, kDisplayAssertionFlag, kSystemAssertionFlag
+};
+
+static int
+metricsTypeIndex(AssertionFlag type)
+{
+    int i;
+
+    for (i = 0; i < kMetricsTypes; i++) {
+        if (kMetricsTypeFlags[i] == type) return i;
+    }
+    return -1;
+}
+
+static void
+histogramObserve(Histogram *histogram, const double *bounds, size_t count, double value)
+{
+    size_t i;
+
+    for (i = 0; i < count && value > bounds[i]; i++)
+        ;
+    histogram->buckets[i]++;
+    histogram->count++;
+    histogram->sum += value;
+}
+
+static void
+metricsVisit(const AuditEntry *entry, void *context)
+{
+    int type = metricsTypeIndex(entry->type);
+
+    (void)context;
+    if (entry->event == kAuditSleep) {
+        histogramObserve(&sleepAckSeconds, kLatencyBuckets,
+                         sizeof(kLatencyBuckets)/sizeof(double), (double)entry->latency / 1e9);
+        metricsChanged = 1;
+        return;
+    }
+    if (type < 0) {
+        return;
+    }
+
+    if (entry->event == kAuditCreate) {
+        if (entry->result != 0) {
+            createFailures[type]++;
+        } else if (entry->latency >= 0) {
+            histogramObserve(&createSeconds[type], kLatencyBuckets,
+                             sizeof(kLatencyBuckets)/sizeof(double), (double)entry->latency / 1e9);
+        }
+    } else if (entry->event == kAuditRelease) {
+        histogramObserve(&holdSeconds[type], kHoldBuckets,
+                         sizeof(kHoldBuckets)/sizeof(double), (double)entry->duration / 1e9);
+        if (entry->latency >= 0) {
+            histogramObserve(&releaseSeconds[type], kLatencyBuckets,
+                             sizeof(kLatencyBuckets)/sizeof(double), (double)entry->latency / 1e9);
+        }
+    }
+    metricsChanged = 1;
+}
+
+/* OpenMetrics wants canonical floats: "1.0", not "1". */
+static void
+metricsFormatBound(char *buffer, size_t size, double value)
+{
+    (void)snprintf(buffer, size, "%g", value);
+    if (!strpbrk(buffer, ".e")) {
+        (void)strncat(buffer, ".0", size - strlen(buffer) - 1);
+    }
+}
+
+static void
+metricsWriteBuckets(FILE *file, const char *name, const char *labels,
+                    const Histogram *histogram, const double *bounds, size_t count)
+{
+    uint64_t cumulative = 0;
+    char bound[32];
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        cumulative += histogram->buckets[i];
+        metricsFormatBound(bound, sizeof(bound), bounds[i]);
+        fprintf(file, "%s_bucket{%s%sle=\"%s\"} %llu\n", name, labels, *labels ? "," : "", bound,
+                (unsigned long long)cumulative);
+    }
+    fprintf(file, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, *labels ? "," : "",
+            (unsigned long long)histogram->count);
+    fprintf(file, "%s_sum%s%s%s %.9g\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+            histogram->sum);
+    fprintf(file, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+            (unsigned long long)histogram->count);
+}
+
+static void
+metricsWriteHistogram(FILE *file, const char *name, const char *help,
+                      const Histogram *histograms, const double *bounds, size_t count)
+{
+    char labels[32];
+    int type;
+
+    fprintf(file, "# HELP %s %s\n", name, help);
+    fprintf(file, "# TYPE %s histogram\n", name);
+    for (type = 0; type < kMetricsTypes; type++) {
+        (void)snprintf(labels, sizeof(labels), "type=\"%s\"", assertionTypeName(kMetricsTypeFlags[type]));
+        metricsWriteBuckets(file, name, labels, &histograms[type], bounds, count);
+    }
+}
+
+static int
+metricsWrite(void)
+{
+    char temporary[1024];
+    FILE *file;
+    int fd, type;
+
+    (void)snprintf(temporary, sizeof(temporary), "%s.%d.tmp", metricsPath, (int)getpid());
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || !(file = fdopen(fd, "w"))) {
+        perror(temporary);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    metricsWriteHistogram(file, "caffeinate_assertion_hold_seconds",
+                          "Time an assertion was held before being released.",
+                          holdSeconds, kHoldBuckets, sizeof(kHoldBuckets)/sizeof(double));
+    metricsWriteHistogram(file, "caffeinate_assertion_create_latency_seconds",
+                          "Time spent creating an assertion in the power management backend.",
+                          createSeconds, kLatencyBuckets, sizeof(kLatencyBuckets)/sizeof(double));
+    metricsWriteHistogram(file, "caffeinate_assertion_release_latency_seconds",
+                          "Time spent releasing an assertion in the power management backend.",
+                          releaseSeconds, kLatencyBuckets, sizeof(kLatencyBuckets)/sizeof(double));
+    fprintf(file, "# HELP caffeinate_sleep_ack_latency_seconds Time from a sleep notification to its acknowledgement by --on-sleep.\n");
+    fprintf(file, "# TYPE caffeinate_sleep_ack_latency_seconds histogram\n");
+    metricsWriteBuckets(file, "caffeinate_sleep_ack_latency_seconds", "", &sleepAckSeconds,
+                        kLatencyBuckets, sizeof(kLatencyBuckets)/sizeof(double));
+
+    fprintf(file, "# HELP caffeinate_assertion_create_failures_total Assertions that could not be created.\n");
+    fprintf(file, "# TYPE caffeinate_assertion_create_failures_total counter\n");
+    for (type = 0; type < kMetricsTypes; type++) {
+        fprintf(file, "caffeinate_assertion_create_failures_total{type=\"%s\"} %llu\n",
+                assertionTypeName(kMetricsTypeFlags[type]), (unsigned long long)createFailures[type]);
+    }
+    fprintf(file, "# HELP caffeinate_audit_records_lost_total Audit records overwritten or abandoned mid-write before the exporter read them.\n");
+    fprintf(file, "# TYPE caffeinate_audit_records_lost_total counter\n");
+    fprintf(file, "caffeinate_audit_records_lost_total %llu\n", (unsigned long long)recordsLost);
+    fprintf(file, "# EOF\n");
+
+    if (fclose(file) != 0) {
+        perror(temporary);
+        (void)unlink(temporary);
+        return -1;
+    }
+    if (rename(temporary, metricsPath) < 0) {
+        perror(metricsPath);
+        (void)unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+metricsTick(void *context)
+{
+    uint64_t lost;
+
+    (void)context;
+    lost = auditScan(&metricsCursor, metricsVisit, NULL);
+    /* Records overwritten before the exporter started were never its to lose. */
+    if (lost && metricsScanned) {
+        recordsLost += lost;
+        metricsChanged = 1;
+    }
+    metricsScanned = 1;
+    if (metricsChanged && metricsWrite() == 0) {
+        metricsChanged = 0;
+    }
+}
+
+void
+metricsExport(const char *path, unsigned interval)
+{
+    metricsPath = path;
+    metricsTick(NULL);
+    if (!reactorAddTimer((uint64_t)interval * 1000, 1, metricsTick, NULL)) {
+        exit(1);
+    }
+    reactorRun();
+}
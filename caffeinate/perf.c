@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate --perf: run the utility's CPUs at the performance governor
+ * (or, where the driver only offers an energy/performance preference, at
+ * the "performance" preference), and put them back as they were after,
+ * through the settings journal in journal.c.
+ */
+
+#define kPerfValue              "performance"
+
+#if defined(__linux__)
+
+/*
+ * The files to set for cpu, with what to set them to, into paths/values;
+ * returns how many (0 without cpufreq).
+ */
+static int
+perfFiles(int cpu, char paths[2][256], const char *values[2])
+{
+    char directory[200], path[256], available[256];
+    int count = 0;
+
+    (void)snprintf(directory, sizeof(directory), "%s/devices/system/cpu/cpu%d/cpufreq", sysfsRoot(), cpu);
+    (void)snprintf(path, sizeof(path), "%s/scaling_available_governors", directory);
+    if (sysfsReadValue(path, available, sizeof(available)) == 0 && strstr(available, kPerfValue)) {
+        /* Journal order is restore order reversed: preference first, governor last. */
+        (void)snprintf(paths[count], 256, "%s/energy_performance_preference", directory);
+        if (access(paths[count], W_OK) == 0) values[count++] = NULL;
+        (void)snprintf(paths[count], 256, "%s/scaling_governor", directory);
+        values[count++] = kPerfValue;
+        return count;
+    }
+    (void)snprintf(paths[count], 256, "%s/energy_performance_preference", directory);
+    if (access(paths[count], W_OK) == 0) {
+        values[count++] = kPerfValue;
+    }
+    return count;
+}
+
+static int
+perfSelected(const ChildPlacement *placement, const cpu_set_t *allowed, int cpu)
+{
+    if (placement->hasCPUs) {
+        return !!(placement->cpus[cpu / 64] & (1ULL << (cpu % 64)));
+    }
+    return cpu < CPU_SETSIZE && CPU_ISSET(cpu, allowed);
+}
+
+/*
+ * Set the utility's CPUs (those given to --cpus, or all that caffeinate
+ * may run on) to performance. Must come before forking the utility.
+ */
+int
+perfStart(const ChildPlacement *placement)
+{
+    cpu_set_t allowed;
+    char paths[2][256];
+    const char *values[2];
+    int cpu, i, count, changed = 0, result = -1;
+
+    CPU_ZERO(&allowed);
+    if (!placement->hasCPUs && sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+
+    if (journalOpen() < 0) {
+        return -1;
+    }
+    for (cpu = 0; cpu < kPlacementMaxCPUs; cpu++) {
+        if (!perfSelected(placement, &allowed, cpu)) continue;
+        count = perfFiles(cpu, paths, values);
+        for (i = 0; i < count; i++) {
+            if (journalSave(paths[i]) < 0) {
+                fprintf(stderr, "caffeinate: %s: %s\n", paths[i], strerror(errno));
+                goto finish;
+            }
+        }
+        changed += count;
+    }
+    if (!changed) {
+        fprintf(stderr, "caffeinate: no cpufreq controls for the utility's CPUs\n");
+        result = 0;
+        goto finish;
+    }
+    if (journalCommit() < 0) {
+        goto finish;
+    }
+
+    for (cpu = 0; cpu < kPlacementMaxCPUs; cpu++) {
+        if (!perfSelected(placement, &allowed, cpu)) continue;
+        count = perfFiles(cpu, paths, values);
+        for (i = 0; i < count; i++) {
+            if (values[i] && sysfsWriteValue(paths[i], values[i]) < 0) {
+                fprintf(stderr, "caffeinate: %s: %s\n", paths[i], strerror(errno));
+                goto finish;
+            }
+        }
+    }
+    result = 0;
+finish:
+    journalClose();
+    return result;
+}
+
+#else
+
+int
+perfStart(const ChildPlacement *placement)
+{
+    (void)placement;
+    fprintf(stderr, "caffeinate: --perf is not supported on this platform\n");
+    return -1;
+}
+
+#endif
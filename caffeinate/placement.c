@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "caffeinate.h"
+
+/*
+ * What taskset(1), chrt(1), nice(1) and ionice(1) would do, applied by the
+ * forked child itself just before execvp(), so that none of them costs a
+ * fork and exec of its own in front of the utility. Everything is parsed
+ * up front in the parent so that a bad argument is a usage error rather
+ * than a failed launch.
+ */
+
+#if defined(__linux__)
+#define kIOPrioClassShift       13
+#define kIOPrioWhoProcess       1
+#endif
+
+typedef struct {
+    const char  *name;
+    int         value;
+} PlacementName;
+
+#if defined(__linux__)
+static const PlacementName kSchedPolicies[] = {
+    { "other",  SCHED_OTHER },
+    { "batch",  SCHED_BATCH },
+    { "idle",   SCHED_IDLE },
+    { "fifo",   SCHED_FIFO },
+    { "rr",     SCHED_RR },
+    { NULL,     0 }
+};
+
+static const PlacementName kIOPrioClasses[] = {
+    { "rt",     1 },
+    { "be",     2 },
+    { "idle",   3 },
+    { NULL,     0 }
+};
+#endif
+
+void
+placementInit(ChildPlacement *placement)
+{
+    memset(placement, 0, sizeof(*placement));
+    placement->policy = -1;
+}
+
+#if defined(__linux__)
+static int
+placementLookup(const PlacementName *names, const char *name, size_t length)
+{
+    for (; names->name; names++) {
+        if (strlen(names->name) == length && !strncmp(names->name, name, length)) {
+            return names->value;
+        }
+    }
+    return -1;
+}
+#endif
+
+#if !defined(__linux__)
+static int
+placementUnsupported(const char *option)
+{
+    fprintf(stderr, "caffeinate: %s is not supported on this platform\n", option);
+    return -1;
+}
+#endif
+
+/* "0-3,8,10-11", as taskset -c takes it. */
+int
+placementParseCPUs(ChildPlacement *placement, const char *list)
+{
+#if defined(__linux__)
+    const char *p = list;
+
+    memset(placement->cpus, 0, sizeof(placement->cpus));
+    do {
+        unsigned long first, last;
+        char *end;
+
+        first = last = strtoul(p, &end, 10);
+        if (end == p) goto invalid;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p || last < first) goto invalid;
+        }
+        if (last >= kPlacementMaxCPUs) goto invalid;
+        for (; first <= last; first++) {
+            placement->cpus[first / 64] |= 1ULL << (first % 64);
+        }
+        p = end;
+    } while (*p++ == ',');
+    if (p[-1] != '\0') goto invalid;
+
+    placement->hasCPUs = 1;
+    return 0;
+invalid:
+    fprintf(stderr, "caffeinate: invalid CPU list \"%s\"\n", list);
+    return -1;
+#else
+    (void)placement;
+    (void)list;
+    return placementUnsupported("--cpus");
+#endif
+}
+
+/* "fifo:50", "rr:10", "batch", "idle" or "other", as chrt takes them. */
+int
+placementParseSched(ChildPlacement *placement, const char *spec)
+{
+#if defined(__linux__)
+    const char *colon = strchr(spec, ':');
+    int policy = placementLookup(kSchedPolicies, spec, colon ? (size_t)(colon - spec) : strlen(spec));
+    int priority = 0;
+
+    if (policy < 0) goto invalid;
+    if (colon) {
+        char *end;
+
+        priority = (int)strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end) goto invalid;
+    }
+    if (priority < sched_get_priority_min(policy) || priority > sched_get_priority_max(policy)) {
+        fprintf(stderr, "caffeinate: priority %d is out of range for %.*s\n", priority,
+                colon ? (int)(colon - spec) : (int)strlen(spec), spec);
+        return -1;
+    }
+    placement->policy = policy;
+    placement->priority = priority;
+    return 0;
+invalid:
+    fprintf(stderr, "caffeinate: invalid scheduling policy \"%s\"\n", spec);
+    return -1;
+#else
+    (void)placement;
+    (void)spec;
+    return placementUnsupported("--sched");
+#endif
+}
+
+int
+placementParseNice(ChildPlacement *placement, const char *value)
+{
+    char *end;
+    long nice = strtol(value, &end, 10);
+
+    if (end == value || *end || nice < -20 || nice > 19) {
+        fprintf(stderr, "caffeinate: invalid nice value \"%s\"\n", value);
+        return -1;
+    }
+    placement->nice = (int)nice;
+    placement->hasNice = 1;
+    return 0;
+}
+
+/* "rt:4", "be:7" or "idle", as ionice -c/-n take them. */
+int
+placementParseIOPrio(ChildPlacement *placement, const char *spec)
+{
+#if defined(__linux__)
+    const char *colon = strchr(spec, ':');
+    int class = placementLookup(kIOPrioClasses, spec, colon ? (size_t)(colon - spec) : strlen(spec));
+    int level = 4;
+
+    if (class < 0) goto invalid;
+    if (colon) {
+        char *end;
+
+        level = (int)strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end || level < 0 || level > 7) goto invalid;
+    }
+    placement->ioprio = (class << kIOPrioClassShift) | (class == 3 ? 0 : level);
+    return 0;
+invalid:
+    fprintf(stderr, "caffeinate: invalid I/O priority \"%s\"\n", spec);
+    return -1;
+#else
+    (void)placement;
+    (void)spec;
+    return placementUnsupported("--ioprio");
+#endif
+}
+
+/*
+ * Called in the child between fork() and execvp(); sets errno and returns
+ * -1 on the first setting the kernel refuses.
+ */
+int
+placementApply(const ChildPlacement *placement)
+{
+#if defined(__linux__)
+    if (placement->hasCPUs) {
+        cpu_set_t set;
+        int cpu;
+
+        CPU_ZERO(&set);
+        for (cpu = 0; cpu < kPlacementMaxCPUs && cpu < CPU_SETSIZE; cpu++) {
+            if (placement->cpus[cpu / 64] & (1ULL << (cpu % 64))) CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("sched_setaffinity");
+            return -1;
+        }
+    }
+    if (placement->ioprio
+        && syscall(SYS_ioprio_set, kIOPrioWhoProcess, 0, placement->ioprio) < 0) {
+        perror("ioprio_set");
+        return -1;
+    }
+    if (placement->policy >= 0) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = placement->priority;
+        if (sched_setscheduler(0, placement->policy, &param) < 0) {
+            perror("sched_setscheduler");
+            return -1;
+        }
+    }
+#endif
+    if (placement->hasNice && setpriority(PRIO_PROCESS, 0, placement->nice) < 0) {
+        perror("setpriority");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <stdio.h>
+
+#if defined(__APPLE__)
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <IOKit/ps/IOPowerSources.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/pwr_mgt/IOPMLibPrivate.h>
+#endif
+
+#include "caffeinate.h"
+
+#if defined(__APPLE__)
+
+/*
+ * The active preferences are copied from powerd once and kept until powerd
+ * says they changed, or the power source switched (which changes which
+ * profile is active), so asking costs no IPC in the common case.
+ */
+static CFDictionaryRef  prefsActive = NULL;
+static int              prefsStale = 1;
+static ReactorCallback  prefsCallback = NULL;
+static void             *prefsContext = NULL;
+
+static int
+prefsTimerIsNever(CFDictionaryRef prefs, CFStringRef key)
+{
+    CFNumberRef number = CFDictionaryGetValue(prefs, key);
+    int minutes;
+
+    if (!number || CFGetTypeID(number) != CFNumberGetTypeID()
+        || !CFNumberGetValue(number, kCFNumberIntType, &minutes)) {
+        return 0;
+    }
+    return minutes == 0;
+}
+
+AssertionFlag
+prefsRedundantAssertions(void)
+{
+    AssertionFlag redundant = kDefaultAssertionFlag;
+
+    if (prefsStale) {
+        if (prefsActive) CFRelease(prefsActive);
+        prefsActive = IOPMCopyActivePMPreferences();
+        prefsStale = 0;
+    }
+    if (!prefsActive) {
+        return redundant;
+    }
+    if (prefsTimerIsNever(prefsActive, CFSTR(kIOPMSystemSleepKey))) {
+        redundant |= kIdleAssertionFlag;
+    }
+    if (prefsTimerIsNever(prefsActive, CFSTR(kIOPMDisplaySleepKey))) {
+        redundant |= kDisplayAssertionFlag;
+    }
+    return redundant;
+}
+
+static void
+prefsChanged(void *context)
+{
+    (void)context;
+    prefsStale = 1;
+    if (prefsCallback) {
+        prefsCallback(prefsContext);
+    }
+}
+
+/* Call callback whenever the redundant set may have changed. */
+int
+prefsWatch(ReactorCallback callback, void *context)
+{
+    CFRunLoopSourceRef prefsSource, powerSource;
+
+    if (prefsCallback) {
+        return 0;
+    }
+    prefsSource = IOPMPrefsNotificationCreateRunLoopSource(prefsChanged, NULL);
+    powerSource = IOPSNotificationCreateRunLoopSource(prefsChanged, NULL);
+    if (!prefsSource || !powerSource
+        || !reactorAddRunLoopSource(prefsSource) || !reactorAddRunLoopSource(powerSource)) {
+        fprintf(stderr, "caffeinate: cannot watch power management preferences\n");
+        if (prefsSource) CFRelease(prefsSource);
+        if (powerSource) CFRelease(powerSource);
+        return -1;
+    }
+    CFRelease(prefsSource);
+    CFRelease(powerSource);
+    prefsCallback = callback;
+    prefsContext = context;
+    return 0;
+}
+
+#else /* logind */
+
+/*
+ * logind's IdleAction is not the whole story on Linux: desktop power
+ * managers suspend on idle themselves and honour the same inhibitors, so
+ * no assertion is ever treated as redundant.
+ */
+AssertionFlag
+prefsRedundantAssertions(void)
+{
+    return kDefaultAssertionFlag;
+}
+
+int
+prefsWatch(ReactorCallback callback, void *context)
+{
+    (void)callback;
+    (void)context;
+    return 0;
+}
+
+#endif
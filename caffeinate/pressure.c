@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate --while-pressure: hold the assertions only while the host is
+ * under CPU, I/O or memory pressure, as reported by PSI (pressure stall
+ * information, /proc/pressure). Nothing polls: each threshold is a kernel
+ * trigger, and the kernel wakes caffeinate (POLLPRI) only when stalls over
+ * a window exceed it. A trigger fires at most once per window while the
+ * pressure lasts, so kPressureQuiet windows without one mean it subsided.
+ *
+ * A new trigger's first windows can include stalls from before it was
+ * registered, when nothing was sampling them, so events in the first
+ * kPressureQuiet windows are not trusted; pressure that is real by then
+ * keeps firing afterwards.
+ */
+
+#define kPressureWindow         2000000 /* us; unprivileged triggers need a multiple of 2 s */
+#define kPressureQuiet          2       /* windows */
+#define kPressureMaxTriggers    6
+
+#if defined(__linux__)
+
+typedef struct {
+    char        resource[16];   /* cpu, io or memory */
+    char        kind[16];       /* some or full */
+    unsigned    percent;        /* of the window spent stalled */
+    int         fd;
+} PressureTrigger;
+
+static PressureTrigger  pressureTriggers[kPressureMaxTriggers];
+static int              pressureTriggerCount = 0;
+static PressureCallback pressureCallback = NULL;
+static void             *pressureContext = NULL;
+static ReactorSourceRef pressureTimer = NULL;
+static int              pressured = 0;
+static int64_t          pressureTrusted = 0;
+
+/* resource[:some|full]:percent */
+static int
+pressureParseOne(const char *spec)
+{
+    PressureTrigger *trigger = &pressureTriggers[pressureTriggerCount];
+    char resource[16], kind[16];
+    unsigned percent;
+    char extra;
+
+    if (pressureTriggerCount == kPressureMaxTriggers) {
+        return -1;
+    }
+    if (sscanf(spec, "%15[a-z]:%15[a-z]:%u%c", resource, kind, &percent, &extra) == 3) {
+        /* The kind of stall was given. */
+    } else if (sscanf(spec, "%15[a-z]:%u%c", resource, &percent, &extra) == 2) {
+        strcpy(kind, "some");
+    } else {
+        return -1;
+    }
+    if ((strcmp(resource, "cpu") && strcmp(resource, "io") && strcmp(resource, "memory"))
+        || (strcmp(kind, "some") && strcmp(kind, "full")) || percent < 1 || percent > 100) {
+        return -1;
+    }
+    (void)snprintf(trigger->resource, sizeof(trigger->resource), "%s", resource);
+    (void)snprintf(trigger->kind, sizeof(trigger->kind), "%s", kind);
+    trigger->percent = percent;
+    trigger->fd = -1;
+    pressureTriggerCount++;
+    return 0;
+}
+
+/* A comma-separated list of thresholds; any one of them counts as pressure. */
+int
+pressureParse(const char *list)
+{
+    char *copy = strdup(list), *spec, *state = NULL;
+    int result = 0;
+
+    if (!copy) {
+        perror("");
+        return -1;
+    }
+    for (spec = strtok_r(copy, ",", &state); spec && !result; spec = strtok_r(NULL, ",", &state)) {
+        result = pressureParseOne(spec);
+        if (result) {
+            fprintf(stderr, "caffeinate: bad pressure threshold %s; expected cpu|io|memory[:some|full]:percent\n",
+                    spec);
+        }
+    }
+    free(copy);
+    return result;
+}
+
+static void
+pressureSubsided(void *context)
+{
+    (void)context;
+    pressured = 0;
+    pressureCallback(0, pressureContext);
+}
+
+static void
+pressureTriggered(void *context)
+{
+    (void)context;
+    if (monotonicNow() < pressureTrusted) {
+        return;
+    }
+    if (!pressured) {
+        pressured = 1;
+        pressureCallback(1, pressureContext);
+    }
+    (void)reactorSetTimer(pressureTimer, (uint64_t)kPressureQuiet * kPressureWindow / 1000);
+}
+
+/*
+ * Register the triggers. callback gets 1 when a threshold is crossed and 0
+ * once none has been for kPressureQuiet windows; nothing is called until
+ * then.
+ */
+int
+pressureWatch(PressureCallback callback, void *context)
+{
+    char path[64], trigger[64];
+    int i, length;
+
+    pressureCallback = callback;
+    pressureContext = context;
+    pressureTrusted = monotonicNow() + (int64_t)kPressureQuiet * kPressureWindow * 1000;
+    pressureTimer = reactorAddTimer(0, 0, pressureSubsided, NULL);
+    if (!pressureTimer) {
+        return -1;
+    }
+    for (i = 0; i < pressureTriggerCount; i++) {
+        PressureTrigger *entry = &pressureTriggers[i];
+
+        length = snprintf(trigger, sizeof(trigger), "%s %u %u", entry->kind,
+                          entry->percent * (kPressureWindow / 100), kPressureWindow);
+        if ((size_t)snprintf(path, sizeof(path), "/proc/pressure/%s", entry->resource) >= sizeof(path)
+            || length < 0 || (size_t)length >= sizeof(trigger)) {
+            fprintf(stderr, "caffeinate: %s: trigger too long\n", entry->resource);
+            return -1;
+        }
+        entry->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (entry->fd < 0 || write(entry->fd, trigger, (size_t)length + 1) < 0) {
+            fprintf(stderr, "caffeinate: %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        if (!reactorAddPriority(entry->fd, pressureTriggered, entry)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#else
+
+int
+pressureParse(const char *list)
+{
+    (void)list;
+    fprintf(stderr, "caffeinate: --while-pressure is not supported on this platform\n");
+    return -1;
+}
+
+int
+pressureWatch(PressureCallback callback, void *context)
+{
+    (void)callback;
+    (void)context;
+    return -1;
+}
+
+#endif
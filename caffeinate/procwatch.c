@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <ctype.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#endif
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate -p <pattern>: hold the assertions while any process whose
+ * name (comm), program (argv[0] without its directory) or whole command
+ * line matches pattern, an fnmatch(3) glob, is running.
+ *
+ * /proc is scanned once, at startup. From then on the kernel reports every
+ * fork, exec, rename and exit through the netlink process connector, and
+ * the matching processes are kept in an in-memory set: only an exec or a
+ * rename makes caffeinate look at that one process, and a fork or exit is
+ * a set lookup. A socket filter drops the events that can never matter,
+ * thread creation and exit and uid/gid/sid changes, before they wake
+ * caffeinate. The connector needs CAP_NET_ADMIN.
+ */
+
+#if defined(__linux__)
+
+#define kProcWatchBuffer        (4 << 20)       /* receive buffer, bytes */
+#define kProcWatchMinSlots      64
+
+static const char       *procWatchPattern = NULL;
+static pid_t            *procWatchSlots = NULL; /* open addressing; 0 is empty, -1 a tombstone */
+static size_t           procWatchCapacity = 0;
+static size_t           procWatchUsed = 0;      /* including tombstones */
+static size_t           procWatchCount = 0;
+static ProcWatchCallback procWatchCallback = NULL;
+static void             *procWatchContext = NULL;
+static int              procWatchFD = -1;
+
+/**************************************************
+ * The set of matching processes
+ **************************************************/
+
+static size_t
+procWatchHash(pid_t pid)
+{
+    return ((size_t)pid * 2654435761u) & (procWatchCapacity - 1);
+}
+
+static pid_t *
+procWatchFind(pid_t pid)
+{
+    size_t i;
+
+    if (!procWatchCapacity) {
+        return NULL;
+    }
+    for (i = procWatchHash(pid); procWatchSlots[i]; i = (i + 1) & (procWatchCapacity - 1)) {
+        if (procWatchSlots[i] == pid) return &procWatchSlots[i];
+    }
+    return NULL;
+}
+
+static int
+procWatchGrow(void)
+{
+    pid_t *old = procWatchSlots;
+    size_t oldCapacity = procWatchCapacity, i;
+
+    /* Rehashing also clears the tombstones, so the table need not grow every time. */
+    for (procWatchCapacity = kProcWatchMinSlots; (procWatchCount + 1) * 4 > procWatchCapacity; )
+        procWatchCapacity *= 2;
+    procWatchSlots = calloc(procWatchCapacity, sizeof(pid_t));
+    if (!procWatchSlots) {
+        procWatchSlots = old;
+        procWatchCapacity = oldCapacity;
+        return -1;
+    }
+    procWatchUsed = procWatchCount;
+    for (i = 0; i < oldCapacity; i++) {
+        size_t j;
+
+        if (old[i] <= 0) continue;
+        for (j = procWatchHash(old[i]); procWatchSlots[j]; j = (j + 1) & (procWatchCapacity - 1))
+            ;
+        procWatchSlots[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static void
+procWatchAdd(pid_t pid)
+{
+    size_t i;
+
+    if (pid <= 0 || procWatchFind(pid)) {
+        return;
+    }
+    if ((procWatchUsed + 1) * 2 > procWatchCapacity && procWatchGrow()) {
+        return;
+    }
+    for (i = procWatchHash(pid); procWatchSlots[i] > 0; i = (i + 1) & (procWatchCapacity - 1))
+        ;
+    if (!procWatchSlots[i]) procWatchUsed++;
+    procWatchSlots[i] = pid;
+    if (procWatchCount++ == 0 && procWatchCallback) {
+        procWatchCallback(1, procWatchContext);
+    }
+}
+
+static void
+procWatchRemove(pid_t pid)
+{
+    pid_t *slot = procWatchFind(pid);
+
+    if (!slot) {
+        return;
+    }
+    *slot = -1;
+    if (--procWatchCount == 0 && procWatchCallback) {
+        procWatchCallback(0, procWatchContext);
+    }
+}
+
+/**************************************************
+ * Matching
+ **************************************************/
+
+static ssize_t
+procWatchRead(pid_t pid, const char *file, char *buffer, size_t size)
+{
+    char path[64];
+    ssize_t count;
+    int fd;
+
+    (void)snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, file);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    count = read(fd, buffer, size - 1);
+    close(fd);
+    if (count < 0) {
+        return -1;
+    }
+    buffer[count] = '\0';
+    return count;
+}
+
+static int
+procWatchMatches(pid_t pid)
+{
+    char comm[32], line[4096], *program;
+    ssize_t count, i;
+
+    if (procWatchRead(pid, "comm", comm, sizeof(comm)) > 0) {
+        comm[strcspn(comm, "\n")] = '\0';
+        if (fnmatch(procWatchPattern, comm, 0) == 0) return 1;
+    }
+    count = procWatchRead(pid, "cmdline", line, sizeof(line));
+    if (count <= 0) {
+        /* Kernel threads have no command line. */
+        return 0;
+    }
+    program = strrchr(line, '/');
+    if (fnmatch(procWatchPattern, program ? program + 1 : line, 0) == 0) {
+        return 1;
+    }
+    /* The arguments are NUL-separated; match them as a shell would show them. */
+    for (i = 0; i < count - 1; i++) {
+        if (!line[i]) line[i] = ' ';
+    }
+    return fnmatch(procWatchPattern, line, 0) == 0;
+}
+
+static void
+procWatchCheck(pid_t pid)
+{
+    if (procWatchMatches(pid)) {
+        procWatchAdd(pid);
+    } else {
+        procWatchRemove(pid);
+    }
+}
+
+/**************************************************
+ * Process connector
+ **************************************************/
+
+#define kProcWatchEventOffset   (NLMSG_LENGTH(0) + offsetof(struct cn_msg, data))
+#define kProcWatchField(field)  (kProcWatchEventOffset + offsetof(struct proc_event, field))
+
+
+/*
+ * Pass exec and comm events, and fork and exit events of processes rather
+ * than threads. BPF loads are big-endian, so the event codes are too; the
+ * pids are only compared with each other.
+ */
+static int
+procWatchAttachFilter(void)
+{
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kProcWatchField(what)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXEC), 12, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_COMM), 11, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_FORK), 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXIT), 4, 8),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kProcWatchField(event_data.fork.child_pid)),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kProcWatchField(event_data.fork.child_tgid)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_X, 0, 5, 4),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kProcWatchField(event_data.exit.process_pid)),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kProcWatchField(event_data.exit.process_tgid)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_X, 0, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    };
+    struct sock_fprog program = { sizeof(filter) / sizeof(filter[0]), filter };
+
+    return setsockopt(procWatchFD, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program));
+}
+
+static int
+procWatchSubscribe(void)
+{
+    struct {
+        struct nlmsghdr     header;
+        struct cn_msg       message;
+        enum proc_cn_mcast_op operation;
+    } __attribute__((packed)) request;
+    struct sockaddr_nl address;
+    int size = kProcWatchBuffer;
+
+    procWatchFD = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_CONNECTOR);
+    if (procWatchFD < 0) {
+        return -1;
+    }
+    /* Bursts of short-lived processes must not overflow it. */
+    if (setsockopt(procWatchFD, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+        (void)setsockopt(procWatchFD, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    /* Without the filter every event is delivered; that costs wakeups, not correctness. */
+    (void)procWatchAttachFilter();
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    address.nl_pid = 0;
+    if (bind(procWatchFD, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        return -1;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = NLMSG_DONE;
+    request.header.nlmsg_pid = (__u32)getpid();
+    request.message.id.idx = CN_IDX_PROC;
+    request.message.id.val = CN_VAL_PROC;
+    request.message.len = sizeof(request.operation);
+    request.operation = PROC_CN_MCAST_LISTEN;
+    if (send(procWatchFD, &request, sizeof(request), 0) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void
+procWatchEvent(const struct proc_event *event)
+{
+    switch (event->what) {
+        case PROC_EVENT_FORK:
+            /* A new process (not a thread) of a matching one is another match. */
+            if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid
+                && procWatchFind(event->event_data.fork.parent_tgid)) {
+                procWatchAdd(event->event_data.fork.child_tgid);
+            }
+            break;
+        case PROC_EVENT_EXEC:
+            procWatchCheck(event->event_data.exec.process_tgid);
+            break;
+        case PROC_EVENT_COMM:
+            procWatchCheck(event->event_data.comm.process_tgid);
+            break;
+        case PROC_EVENT_EXIT:
+            if (event->event_data.exit.process_pid == event->event_data.exit.process_tgid) {
+                procWatchRemove(event->event_data.exit.process_tgid);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Events were dropped: the set may be missing processes that started, and
+ * may hold some that exited. The latter can be checked without a scan.
+ */
+static void
+procWatchOverflowed(void)
+{
+    size_t i;
+
+    fprintf(stderr, "caffeinate: -p: process events were lost; processes started meanwhile are missed\n");
+    for (i = 0; i < procWatchCapacity; i++) {
+        pid_t pid = procWatchSlots[i];
+
+        if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) procWatchRemove(pid);
+    }
+}
+
+static void
+procWatchReadable(void *context)
+{
+    char buffer[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *header;
+    ssize_t count;
+
+    (void)context;
+    while ((count = recv(procWatchFD, buffer, sizeof(buffer), 0)) != 0) {
+        if (count < 0) {
+            if (errno == ENOBUFS) {
+                procWatchOverflowed();
+                continue;
+            }
+            return;
+        }
+        for (header = (struct nlmsghdr *)buffer; NLMSG_OK(header, count);
+             header = NLMSG_NEXT(header, count)) {
+            const struct cn_msg *message = NLMSG_DATA(header);
+
+            if (header->nlmsg_type == NLMSG_NOOP || header->nlmsg_type == NLMSG_ERROR) continue;
+            if (message->id.idx != CN_IDX_PROC || message->id.val != CN_VAL_PROC) continue;
+            procWatchEvent((const struct proc_event *)message->data);
+        }
+    }
+}
+
+/* The one scan: every process running now. */
+static void
+procWatchScan(void)
+{
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir("/proc");
+    if (!dir) {
+        return;
+    }
+    while ((entry = readdir(dir))) {
+        if (!isdigit((unsigned char)entry->d_name[0])) continue;
+        if (procWatchMatches((pid_t)atoi(entry->d_name))) {
+            procWatchAdd((pid_t)atoi(entry->d_name));
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Start following processes matching pattern. callback gets 1 when the
+ * first one appears (possibly from here, if one is already running) and 0
+ * when the last one is gone. caffeinate's own process never counts.
+ */
+int
+procWatchStart(const char *pattern, ProcWatchCallback callback, void *context)
+{
+    procWatchPattern = pattern;
+    /* Subscribe first, so that nothing starting during the scan is missed. */
+    if (procWatchSubscribe() < 0) {
+        fprintf(stderr, "caffeinate: -p: process connector: %s\n", strerror(errno));
+        return -1;
+    }
+    if (!reactorAddDescriptor(procWatchFD, procWatchReadable, NULL)) {
+        return -1;
+    }
+    procWatchScan();
+    procWatchRemove(getpid());
+    procWatchCallback = callback;
+    procWatchContext = context;
+    if (procWatchCount) {
+        callback(1, context);
+    }
+    return 0;
+}
+
+#else
+
+int
+procWatchStart(const char *pattern, ProcWatchCallback callback, void *context)
+{
+    (void)pattern;
+    (void)callback;
+    (void)context;
+    fprintf(stderr, "caffeinate: -p is not supported on this platform\n");
+    return -1;
+}
+
+#endif
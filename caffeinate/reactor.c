@@ -0,0 +1,624 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#else
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#if defined(__APPLE__)
+#include <CoreFoundation/CoreFoundation.h>
+#endif
+
+#include "caffeinate.h"
+
+#if defined(__linux__) && !defined(SYS_pidfd_open)
+#define SYS_pidfd_open          434
+#endif
+
+#define kReactorMaxEvents       16
+
+typedef enum {
+    kReactorDescriptor,
+    kReactorProcess,
+    kReactorSignal,
+    kReactorTimer,
+#if defined(__APPLE__)
+    kReactorMachPort
+#endif
+} ReactorSourceKind;
+
+struct ReactorSource {
+    ReactorSourceKind   kind;
+    int                 ident;      /* fd, pid, signo or timer id */
+    int                 fd;         /* descriptor registered with the kernel (Linux) */
+    int                 repeats;
+    int                 removed;
+    int                 signalled;  /* process watched through SIGCHLD, without a pidfd */
+    ReactorCallback     callback;
+    void                *context;
+    ReactorSourceRef    next;       /* pending release list */
+};
+
+static int              reactorFD = -1;
+static ReactorSourceRef reactorGraveyard = NULL;
+#if defined(__linux__)
+static sigset_t         reactorSavedMask;
+#else
+static int              reactorNextTimer = 1;
+static int              reactorSignalCount = 0;
+static int              reactorSignals[NSIG];
+#endif
+
+static ReactorSourceRef
+reactorNewSource(ReactorSourceKind kind, int ident, ReactorCallback callback, void *context)
+{
+    ReactorSourceRef source = calloc(1, sizeof(*source));
+
+    if (!source) {
+        return NULL;
+    }
+    source->kind = kind;
+    source->ident = ident;
+    source->fd = -1;
+    source->callback = callback;
+    source->context = context;
+    return source;
+}
+
+static void
+reactorDispatch(ReactorSourceRef source)
+{
+    if (source->removed) {
+        return;
+    }
+#if defined(__linux__)
+    if (source->kind == kReactorSignal) {
+        struct signalfd_siginfo info;
+        if (read(source->fd, &info, sizeof(info)) < 0 && errno == EAGAIN) {
+            return;
+        }
+    } else if (source->kind == kReactorProcess && source->signalled) {
+        struct signalfd_siginfo info;
+        siginfo_t child;
+
+        while (read(source->fd, &info, sizeof(info)) > 0)
+            ;
+        /* SIGCHLD is for any child; only call back once this one can be reaped. */
+        memset(&child, 0, sizeof(child));
+        if (waitid(P_PID, (id_t)source->ident, &child, WEXITED | WNOHANG | WNOWAIT) < 0
+            || child.si_pid == 0) {
+            return;
+        }
+    } else if (source->kind == kReactorTimer) {
+        uint64_t expirations;
+        if (read(source->fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN) {
+            return;
+        }
+    }
+#endif
+    source->callback(source->context);
+}
+
+static void
+reactorReap(void)
+{
+    while (reactorGraveyard) {
+        ReactorSourceRef next = reactorGraveyard->next;
+        free(reactorGraveyard);
+        reactorGraveyard = next;
+    }
+}
+
+#if defined(__linux__)
+
+int
+reactorInit(void)
+{
+    if (reactorFD >= 0) {
+        return 0;
+    }
+    reactorFD = epoll_create1(EPOLL_CLOEXEC);
+    if (reactorFD < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    (void)sigprocmask(SIG_SETMASK, NULL, &reactorSavedMask);
+    return 0;
+}
+
+static ReactorSourceRef
+reactorWatch(ReactorSourceRef source, int fd, uint32_t events)
+{
+    struct epoll_event event;
+
+    if (!source) {
+        return NULL;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = source;
+    if (epoll_ctl(reactorFD, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("epoll_ctl");
+        free(source);
+        return NULL;
+    }
+    source->fd = fd;
+    return source;
+}
+
+ReactorSourceRef
+reactorAddDescriptor(int fd, ReactorCallback callback, void *context)
+{
+    if (reactorInit()) {
+        return NULL;
+    }
+    return reactorWatch(reactorNewSource(kReactorDescriptor, fd, callback, context), fd, EPOLLIN);
+}
+
+/*
+ * Like reactorAddDescriptor(), for descriptors that report events with
+ * EPOLLPRI alone, such as PSI triggers (which are always readable).
+ */
+ReactorSourceRef
+reactorAddPriority(int fd, ReactorCallback callback, void *context)
+{
+    if (reactorInit()) {
+        return NULL;
+    }
+    return reactorWatch(reactorNewSource(kReactorDescriptor, fd, callback, context), fd, EPOLLPRI);
+}
+
+static ReactorSourceRef
+reactorAddChild(pid_t pid, ReactorCallback callback, void *context)
+{
+    ReactorSourceRef source;
+    sigset_t mask;
+    int fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    (void)sigprocmask(SIG_BLOCK, &mask, NULL);
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        perror("signalfd");
+        return NULL;
+    }
+    source = reactorWatch(reactorNewSource(kReactorProcess, pid, callback, context), fd, EPOLLIN);
+    if (!source) {
+        close(fd);
+        return NULL;
+    }
+    source->signalled = 1;
+    /* The child may have exited before SIGCHLD was blocked; look once regardless. */
+    (void)raise(SIGCHLD);
+    return source;
+}
+
+ReactorSourceRef
+reactorAddProcess(pid_t pid, ReactorCallback callback, void *context)
+{
+    ReactorSourceRef source;
+    int fd;
+
+    if (reactorInit()) {
+        return NULL;
+    }
+    fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0) {
+        /* Before Linux 5.3: SIGCHLD through a signalfd, so that nothing blocks in wait. */
+        return reactorAddChild(pid, callback, context);
+    }
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    source = reactorWatch(reactorNewSource(kReactorProcess, pid, callback, context), fd, EPOLLIN);
+    if (!source) {
+        close(fd);
+    }
+    return source;
+}
+
+ReactorSourceRef
+reactorAddSignal(int signo, ReactorCallback callback, void *context)
+{
+    ReactorSourceRef source;
+    sigset_t mask;
+    int fd;
+
+    if (reactorInit()) {
+        return NULL;
+    }
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+    (void)sigprocmask(SIG_BLOCK, &mask, NULL);
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        perror("signalfd");
+        return NULL;
+    }
+    source = reactorWatch(reactorNewSource(kReactorSignal, signo, callback, context), fd, EPOLLIN);
+    if (!source) {
+        close(fd);
+    }
+    return source;
+}
+
+ReactorSourceRef
+reactorAddTimer(uint64_t intervalMS, int repeats, ReactorCallback callback, void *context)
+{
+    ReactorSourceRef source;
+    int fd;
+
+    if (reactorInit()) {
+        return NULL;
+    }
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("timerfd_create");
+        return NULL;
+    }
+    source = reactorWatch(reactorNewSource(kReactorTimer, fd, callback, context), fd, EPOLLIN);
+    if (!source) {
+        close(fd);
+        return NULL;
+    }
+    source->repeats = repeats;
+    if (intervalMS && reactorSetTimer(source, intervalMS)) {
+        reactorRemove(source);
+        return NULL;
+    }
+    return source;
+}
+
+int
+reactorSetTimer(ReactorSourceRef source, uint64_t intervalMS)
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = intervalMS / 1000;
+    spec.it_value.tv_nsec = (intervalMS % 1000) * 1000000;
+    if (source->repeats) {
+        spec.it_interval = spec.it_value;
+    }
+    if (timerfd_settime(source->fd, 0, &spec, NULL) < 0) {
+        perror("timerfd_settime");
+        return -1;
+    }
+    return 0;
+}
+
+void
+reactorRemove(ReactorSourceRef source)
+{
+    if (!source || source->removed) {
+        return;
+    }
+    (void)epoll_ctl(reactorFD, EPOLL_CTL_DEL, source->fd, NULL);
+    if (source->kind != kReactorDescriptor) {
+        close(source->fd);
+    }
+    source->removed = 1;
+    source->next = reactorGraveyard;
+    reactorGraveyard = source;
+}
+
+void
+reactorPrepareChild(void)
+{
+    if (reactorFD < 0) {
+        return;
+    }
+    (void)sigprocmask(SIG_SETMASK, &reactorSavedMask, NULL);
+}
+
+void
+reactorRun(void)
+{
+    struct epoll_event events[kReactorMaxEvents];
+    int i, count;
+
+    if (reactorInit()) {
+        exit(1);
+    }
+    for (;;) {
+        count = epoll_wait(reactorFD, events, kReactorMaxEvents, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (i = 0; i < count; i++) {
+            reactorDispatch(events[i].data.ptr);
+        }
+        reactorReap();
+    }
+}
+
+#else /* kqueue */
+
+int
+reactorInit(void)
+{
+    if (reactorFD >= 0) {
+        return 0;
+    }
+    reactorFD = kqueue();
+    if (reactorFD < 0) {
+        perror("kqueue");
+        return -1;
+    }
+    (void)fcntl(reactorFD, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+static ReactorSourceRef
+reactorWatch(ReactorSourceRef source, int16_t filter, uint32_t fflags, intptr_t data, uint16_t flags)
+{
+    struct kevent event;
+
+    if (!source) {
+        return NULL;
+    }
+    EV_SET(&event, source->ident, filter, EV_ADD | flags, fflags, data, source);
+    if (kevent(reactorFD, &event, 1, NULL, 0, NULL) < 0) {
+        perror("kevent");
+        free(source);
+        return NULL;
+    }
+    return source;
+}
+
+ReactorSourceRef
+reactorAddDescriptor(int fd, ReactorCallback callback, void *context)
+{
+    if (reactorInit()) {
+        return NULL;
+    }
+    return reactorWatch(reactorNewSource(kReactorDescriptor, fd, callback, context),
+                        EVFILT_READ, 0, 0, 0);
+}
+
+ReactorSourceRef
+reactorAddProcess(pid_t pid, ReactorCallback callback, void *context)
+{
+    if (reactorInit()) {
+        return NULL;
+    }
+    return reactorWatch(reactorNewSource(kReactorProcess, pid, callback, context),
+                        EVFILT_PROC, NOTE_EXIT, 0, EV_ONESHOT);
+}
+
+ReactorSourceRef
+reactorAddSignal(int signo, ReactorCallback callback, void *context)
+{
+    ReactorSourceRef source;
+
+    if (reactorInit()) {
+        return NULL;
+    }
+    /* EVFILT_SIGNAL only observes; keep the default action from firing. */
+    (void)signal(signo, SIG_IGN);
+    source = reactorWatch(reactorNewSource(kReactorSignal, signo, callback, context),
+                          EVFILT_SIGNAL, 0, 0, 0);
+    if (source && reactorSignalCount < NSIG) {
+        reactorSignals[reactorSignalCount++] = signo;
+    }
+    return source;
+}
+
+#if defined(__APPLE__)
+/*
+ * Wake when a message is queued on any port in portSet; the callback is
+ * expected to mach_msg() it off.
+ */
+ReactorSourceRef
+reactorAddMachPort(mach_port_t portSet, ReactorCallback callback, void *context)
+{
+    if (reactorInit()) {
+        return NULL;
+    }
+    return reactorWatch(reactorNewSource(kReactorMachPort, (int)portSet, callback, context),
+                        EVFILT_MACHPORT, 0, 0, 0);
+}
+
+/*
+ * Framework notifications (IOPMPrefs, IOPS, ...) come as run loop sources.
+ * The port-based (version 1) ones are driven from here instead: their port
+ * goes in a port set of its own, and each message is handed to the
+ * source's perform callout just as CFRunLoop would.
+ */
+typedef struct {
+    CFRunLoopSourceContext1 context;
+    mach_port_t             port;
+} ReactorRunLoopSource;
+
+static void
+reactorRunLoopSourceFire(void *context)
+{
+    ReactorRunLoopSource *runLoopSource = context;
+    struct {
+        mach_msg_header_t   header;
+        uint8_t             body[1024];
+    } message;
+
+    while (mach_msg(&message.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(message),
+                    runLoopSource->port, 0, MACH_PORT_NULL) == MACH_MSG_SUCCESS) {
+        (void)runLoopSource->context.perform(&message, message.header.msgh_size,
+                                             kCFAllocatorDefault, runLoopSource->context.info);
+    }
+}
+
+ReactorSourceRef
+reactorAddRunLoopSource(CFRunLoopSourceRef source)
+{
+    ReactorRunLoopSource *runLoopSource = calloc(1, sizeof(*runLoopSource));
+    ReactorSourceRef reactorSource;
+    mach_port_t portSet;
+
+    if (!runLoopSource) {
+        return NULL;
+    }
+    CFRunLoopSourceGetContext(source, (CFRunLoopSourceContext *)&runLoopSource->context);
+    if (runLoopSource->context.version != 1 || !runLoopSource->context.getPort
+        || !runLoopSource->context.perform) {
+        free(runLoopSource);
+        return NULL;
+    }
+    runLoopSource->port = runLoopSource->context.getPort(runLoopSource->context.info);
+    if (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_PORT_SET, &portSet) != KERN_SUCCESS) {
+        free(runLoopSource);
+        return NULL;
+    }
+    if (mach_port_insert_member(mach_task_self(), runLoopSource->port, portSet) != KERN_SUCCESS
+        || !(reactorSource = reactorAddMachPort(portSet, reactorRunLoopSourceFire, runLoopSource))) {
+        (void)mach_port_mod_refs(mach_task_self(), portSet, MACH_PORT_RIGHT_PORT_SET, -1);
+        free(runLoopSource);
+        return NULL;
+    }
+    /* The source stays alive, and its port valid, for as long as it is watched. */
+    CFRetain(source);
+    return reactorSource;
+}
+#endif
+
+ReactorSourceRef
+reactorAddTimer(uint64_t intervalMS, int repeats, ReactorCallback callback, void *context)
+{
+    ReactorSourceRef source;
+
+    if (reactorInit()) {
+        return NULL;
+    }
+    source = reactorNewSource(kReactorTimer, reactorNextTimer++, callback, context);
+    if (!source) {
+        return NULL;
+    }
+    source->repeats = repeats;
+    if (intervalMS && reactorSetTimer(source, intervalMS)) {
+        free(source);
+        return NULL;
+    }
+    return source;
+}
+
+int
+reactorSetTimer(ReactorSourceRef source, uint64_t intervalMS)
+{
+    struct kevent event;
+
+    if (!intervalMS) {
+        EV_SET(&event, source->ident, EVFILT_TIMER, EV_DELETE, 0, 0, source);
+        (void)kevent(reactorFD, &event, 1, NULL, 0, NULL);
+        return 0;
+    }
+    EV_SET(&event, source->ident, EVFILT_TIMER,
+           EV_ADD | (source->repeats ? 0 : EV_ONESHOT), 0, (intptr_t)intervalMS, source);
+    if (kevent(reactorFD, &event, 1, NULL, 0, NULL) < 0) {
+        perror("kevent");
+        return -1;
+    }
+    return 0;
+}
+
+void
+reactorRemove(ReactorSourceRef source)
+{
+    struct kevent event;
+
+    if (!source || source->removed) {
+        return;
+    }
+    switch (source->kind) {
+        case kReactorDescriptor:
+            EV_SET(&event, source->ident, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+            break;
+        case kReactorProcess:
+            EV_SET(&event, source->ident, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
+            break;
+        case kReactorSignal:
+            EV_SET(&event, source->ident, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
+            break;
+        case kReactorTimer:
+            EV_SET(&event, source->ident, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+            break;
+#if defined(__APPLE__)
+        case kReactorMachPort:
+            EV_SET(&event, source->ident, EVFILT_MACHPORT, EV_DELETE, 0, 0, NULL);
+            break;
+#endif
+    }
+    /* Already-fired one-shot filters are gone; ENOENT is expected. */
+    (void)kevent(reactorFD, &event, 1, NULL, 0, NULL);
+    source->removed = 1;
+    source->next = reactorGraveyard;
+    reactorGraveyard = source;
+}
+
+void
+reactorPrepareChild(void)
+{
+    int i;
+
+    for (i = 0; i < reactorSignalCount; i++) {
+        (void)signal(reactorSignals[i], SIG_DFL);
+    }
+}
+
+void
+reactorRun(void)
+{
+    struct kevent events[kReactorMaxEvents];
+    int i, count;
+
+    if (reactorInit()) {
+        exit(1);
+    }
+    for (;;) {
+        count = kevent(reactorFD, NULL, 0, events, kReactorMaxEvents, NULL);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("kevent");
+            exit(1);
+        }
+        for (i = 0; i < count; i++) {
+            reactorDispatch(events[i].udata);
+        }
+        reactorReap();
+    }
+}
+
+#endif
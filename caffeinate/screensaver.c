@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "caffeinate.h"
+
+/*
+ * org.freedesktop.ScreenSaver on the session bus: Inhibit returns a cookie
+ * that keeps the screen from blanking and the session from going idle
+ * until UnInhibit, or until the connection that took it closes. So the
+ * connection stays open for as long as any cookie is held, and the
+ * inhibition cannot outlive this process or be handed to the utility.
+ * The backend is still marked as outliving it only so that SIGTERM and
+ * SIGHUP run the exit handlers, and the cookie is uninhibited rather than
+ * just dropped with the connection.
+ */
+
+#define kScreenSaverTypes       (kIdleAssertionFlag | kDisplayAssertionFlag)
+
+static int              screenSaverConn = -1;
+static uint32_t         screenSaverCookies[2];     /* idle, display; 0 if none */
+
+static int
+screenSaverInit(void)
+{
+    if (screenSaverConn >= 0) {
+        return 0;
+    }
+    screenSaverConn = dbusOpen(kDBusSessionBus);
+    if (screenSaverConn < 0) {
+        perror("Failed to connect to the session bus");
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t *
+screenSaverCookie(AssertionFlag type)
+{
+    switch (type) {
+        case kIdleAssertionFlag:    return &screenSaverCookies[0];
+        case kDisplayAssertionFlag: return &screenSaverCookies[1];
+        default:                    return NULL;
+    }
+}
+
+static int
+screenSaverCreate(AssertionFlag type, const char *details)
+{
+    uint32_t *cookie = screenSaverCookie(type);
+    DBusReply reply;
+
+    if (!cookie) {
+        return EINVAL;
+    }
+    /* Releasing the last cookie closed the connection. */
+    if (screenSaverInit()) {
+        return ENOTCONN;
+    }
+    errno = 0;
+    if (dbusCall(screenSaverConn, "org.freedesktop.ScreenSaver", "/org/freedesktop/ScreenSaver",
+                 "org.freedesktop.ScreenSaver", "Inhibit", &reply, "ss", "caffeinate", details)
+        || !reply.value)
+    {
+        fprintf(stderr, "Failed to inhibit the screen saver%s%s\n",
+                reply.error[0] ? ": " : "", reply.error);
+        return errno ? errno : EIO;
+    }
+    *cookie = reply.value;
+    return 0;
+}
+
+static int
+screenSaverRelease(AssertionFlag type)
+{
+    uint32_t *cookie = screenSaverCookie(type);
+    DBusReply reply;
+    int result = 0;
+
+    if (!cookie || !*cookie) {
+        return 0;
+    }
+    errno = 0;
+    if (screenSaverConn < 0
+        || dbusCall(screenSaverConn, "org.freedesktop.ScreenSaver", "/org/freedesktop/ScreenSaver",
+                    "org.freedesktop.ScreenSaver", "UnInhibit", &reply, "u", *cookie)) {
+        result = errno ? errno : EIO;
+    }
+    *cookie = 0;
+    if (!screenSaverCookies[0] && !screenSaverCookies[1] && screenSaverConn >= 0) {
+        close(screenSaverConn);
+        screenSaverConn = -1;
+    }
+    return result;
+}
+
+static int
+screenSaverQuery(AssertionFlag type)
+{
+    uint32_t *cookie = screenSaverCookie(type);
+
+    return (cookie && *cookie) ? kBackendProcessHeld : kBackendNotHeld;
+}
+
+const AssertionBackend screenSaverBackend = {
+    .name           = "screensaver",
+    .types          = kScreenSaverTypes,
+    .inheritable    = 0,
+    .outlives       = 1,
+    .init           = screenSaverInit,
+    .create         = screenSaverCreate,
+    .release        = screenSaverRelease,
+    .query          = screenSaverQuery,
+};
+
+#endif /* __linux__ */
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__APPLE__)
+#include <IOKit/IOMessage.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#endif
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate --on-sleep freeze|SIGNAL: when the system is going to sleep
+ * anyway (the assertions do not cover battery power without -b, and logind
+ * lets privileged callers override inhibitors), put the utility in a state
+ * it can survive sleep in before acknowledging, and undo it on wake.
+ *
+ * "freeze" moves the utility into a cgroup of its own and freezes that,
+ * descendants included; where the cgroup cannot be created, and on Darwin,
+ * it stops the utility with SIGSTOP instead. Any other action is a signal
+ * sent to the utility so that it can checkpoint itself. On wake the cgroup
+ * is thawed, or SIGCONT sent.
+ *
+ * The system is held for at most kSleepAckDeadline, well inside logind's
+ * default InhibitDelayMaxSec of 5 seconds, and the time from notification
+ * to acknowledgement goes to the audit ring.
+ */
+
+#define kSleepAckDeadline       1000    /* ms */
+
+static int              sleepSignal = -1;       /* 0 to freeze */
+static pid_t            sleepChild = 0;
+static const char       *sleepCommand = NULL;
+static char             sleepCgroup[1024];
+static int              sleepFrozen = 0;
+
+static const struct {
+    const char  *name;
+    int         signo;
+} kSleepSignals[] = {
+    { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "TERM", SIGTERM }, { NULL, 0 }
+};
+
+int
+sleepWatchParse(const char *action)
+{
+    char *end;
+    long signo;
+    int i;
+
+    if (!strcmp(action, "freeze")) {
+        sleepSignal = 0;
+        return 0;
+    }
+    if (!strncmp(action, "SIG", 3)) action += 3;
+    for (i = 0; kSleepSignals[i].name; i++) {
+        if (!strcmp(action, kSleepSignals[i].name)) {
+            sleepSignal = kSleepSignals[i].signo;
+            return 0;
+        }
+    }
+    signo = strtol(action, &end, 10);
+    if (end == action || *end || signo <= 0 || signo >= NSIG) {
+        fprintf(stderr, "caffeinate: invalid --on-sleep action \"%s\"\n", action);
+        return -1;
+    }
+    sleepSignal = (int)signo;
+    return 0;
+}
+
+#if defined(__linux__)
+
+static int
+sleepCgroupWrite(const char *file, const char *value)
+{
+    char path[1100];
+    int fd, result;
+
+    (void)snprintf(path, sizeof(path), "%s/%s", sleepCgroup, file);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    result = (write(fd, value, strlen(value)) < 0) ? -1 : 0;
+    close(fd);
+    return result;
+}
+
+/* Wait for cgroup.events to report "frozen 1", or until deadline. */
+static void
+sleepCgroupWaitFrozen(int64_t deadline)
+{
+    char path[1100], events[256];
+    struct pollfd pfd;
+    int64_t now;
+
+    (void)snprintf(path, sizeof(path), "%s/cgroup.events", sleepCgroup);
+    pfd.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (pfd.fd < 0) {
+        return;
+    }
+    pfd.events = POLLPRI;
+    while ((now = monotonicNow()) < deadline) {
+        ssize_t count = pread(pfd.fd, events, sizeof(events) - 1, 0);
+
+        if (count < 0) break;
+        events[count] = '\0';
+        if (strstr(events, "frozen 1")) break;
+        (void)poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1);
+    }
+    close(pfd.fd);
+}
+
+static const char *kSleepCgroupMounts[] = { "fs/cgroup", "fs/cgroup/unified", NULL };
+
+static void
+sleepCgroupRemove(void)
+{
+    if (sleepCgroup[0]) {
+        (void)rmdir(sleepCgroup);
+    }
+}
+
+/*
+ * Make a cgroup for the utility below our own. Returns -1 if the hierarchy
+ * is not cgroup v2 or not writable by us.
+ */
+static int
+sleepCgroupCreate(void)
+{
+    char line[1024];
+    FILE *file;
+    size_t length;
+    int found = 0, i;
+
+    file = fopen("/proc/self/cgroup", "r");
+    if (!file) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (!strncmp(line, "0::", 3)) {
+            line[strcspn(line, "\n")] = '\0';
+            found = 1;
+            break;
+        }
+    }
+    fclose(file);
+    if (!found) {
+        return -1;
+    }
+
+    /* cgroup2 is either mounted on /sys/fs/cgroup or, in hybrid setups, below it. */
+    for (i = 0; kSleepCgroupMounts[i]; i++) {
+        char probe[sizeof(sleepCgroup) + sizeof("/cgroup.controllers")];
+
+        /* A path that does not fit is not one to create a cgroup in. */
+        if (snprintf(sleepCgroup, sizeof(sleepCgroup), "%s/%s%s", sysfsRoot(), kSleepCgroupMounts[i],
+                     strcmp(line + 3, "/") ? line + 3 : "") >= (int)sizeof(sleepCgroup)) continue;
+        (void)snprintf(probe, sizeof(probe), "%s/cgroup.controllers", sleepCgroup);
+        if (access(probe, F_OK) == 0) break;
+    }
+    if (!kSleepCgroupMounts[i]) {
+        sleepCgroup[0] = '\0';
+        return -1;
+    }
+    length = strlen(sleepCgroup);
+    if (snprintf(sleepCgroup + length, sizeof(sleepCgroup) - length, "/caffeinate-%d", (int)getpid())
+            >= (int)(sizeof(sleepCgroup) - length)
+        || (mkdir(sleepCgroup, 0755) < 0 && errno != EEXIST)) {
+        sleepCgroup[0] = '\0';
+        return -1;
+    }
+    (void)atexit(sleepCgroupRemove);
+    return 0;
+}
+
+#endif
+
+/* Parent, before fork(). */
+int
+sleepWatchPrepare(void)
+{
+    if (sleepSignal < 0) {
+        return 0;
+    }
+#if defined(__linux__)
+    if (sleepSignal == 0 && sleepCgroupCreate() < 0) {
+        fprintf(stderr, "caffeinate: cannot create a cgroup to freeze; stopping with SIGSTOP instead\n");
+        sleepSignal = SIGSTOP;
+    }
+#else
+    if (sleepSignal == 0) {
+        sleepSignal = SIGSTOP;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Child, before execvp(): join the cgroup that will be frozen. Outside it
+ * the utility would keep running through sleep, so failing is fatal.
+ */
+int
+sleepWatchChild(void)
+{
+#if defined(__linux__)
+    if (sleepSignal == 0 && sleepCgroupWrite("cgroup.procs", "0")) {
+        fprintf(stderr, "caffeinate: %s/cgroup.procs: %s\n", sleepCgroup, strerror(errno));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void
+sleepWillSleep(void)
+{
+    int64_t notified = monotonicNow();
+
+    if (sleepSignal > 0) {
+        (void)kill(sleepChild, sleepSignal);
+    }
+#if defined(__linux__)
+    else if (sleepCgroupWrite("cgroup.freeze", "1") == 0) {
+        sleepCgroupWaitFrozen(notified + (int64_t)kSleepAckDeadline * 1000000);
+    }
+#endif
+    sleepFrozen = 1;
+    auditRecord(kAuditSleep, kDefaultAssertionFlag, sleepChild, sleepCommand, auditNow(), 0,
+                monotonicNow() - notified, 0);
+}
+
+static void
+sleepHasWoken(void)
+{
+    if (!sleepFrozen) {
+        return;
+    }
+    sleepFrozen = 0;
+#if defined(__linux__)
+    if (sleepSignal == 0) {
+        (void)sleepCgroupWrite("cgroup.freeze", "0");
+        return;
+    }
+#endif
+    (void)kill(sleepChild, SIGCONT);
+}
+
+#if defined(__linux__)
+
+/*
+ * A "delay" inhibitor makes logind wait for us before suspending; closing
+ * it is the acknowledgement. It is taken again on every wake.
+ */
+static int              sleepBus = -1;
+static int              sleepDelayFD = -1;
+static ReactorSourceRef sleepSource = NULL;
+
+static int
+sleepTakeDelay(void)
+{
+    DBusReply reply;
+
+    if (dbusCall(sleepBus, "org.freedesktop.login1", "/org/freedesktop/login1",
+                 "org.freedesktop.login1.Manager", "Inhibit", &reply, "ssss",
+                 "sleep", kAssertionNameString, "caffeinate preparing a utility for sleep", "delay")
+        || reply.fd < 0) {
+        fprintf(stderr, "caffeinate: cannot delay sleep%s%s\n", reply.error[0] ? ": " : "", reply.error);
+        return -1;
+    }
+    (void)fcntl(reply.fd, F_SETFD, FD_CLOEXEC);
+    sleepDelayFD = reply.fd;
+    return 0;
+}
+
+static void
+sleepBusReadable(void *context)
+{
+    DBusSignal event;
+    int result;
+
+    (void)context;
+    do {
+        result = dbusReadSignal(sleepBus, &event);
+        if (result < 0) {
+            fprintf(stderr, "caffeinate: lost the system bus; no longer watching for sleep\n");
+            reactorRemove(sleepSource);
+            close(sleepBus);
+            sleepBus = -1;
+            return;
+        }
+        if (result == 0 || strcmp(event.member, "PrepareForSleep")
+            || strcmp(event.interface, "org.freedesktop.login1.Manager")) continue;
+
+        if (event.value) {
+            sleepWillSleep();
+            if (sleepDelayFD >= 0) {
+                close(sleepDelayFD);
+                sleepDelayFD = -1;
+            }
+        } else {
+            sleepHasWoken();
+            if (sleepDelayFD < 0) (void)sleepTakeDelay();
+        }
+    } while (dbusPendingSignal());
+}
+
+/* Parent, once the utility is running. */
+int
+sleepWatchStart(pid_t pid, const char *command)
+{
+    DBusReply reply;
+
+    if (sleepSignal < 0) {
+        return 0;
+    }
+    sleepChild = pid;
+    sleepCommand = command;
+
+    sleepBus = dbusOpen(kDBusSystemBus);
+    if (sleepBus < 0) {
+        perror("Failed to connect to the system bus");
+        return -1;
+    }
+    if (dbusCall(sleepBus, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                 "org.freedesktop.DBus", "AddMatch", &reply, "s",
+                 "type='signal',sender='org.freedesktop.login1',"
+                 "interface='org.freedesktop.login1.Manager',member='PrepareForSleep'")
+        || sleepTakeDelay()
+        || !(sleepSource = reactorAddDescriptor(sleepBus, sleepBusReadable, NULL))) {
+        close(sleepBus);
+        sleepBus = -1;
+        return -1;
+    }
+    return 0;
+}
+
+#else /* IOKit */
+
+/*
+ * IORegisterForSystemPower() rather than an IOPMConnection: its
+ * notification port can be put in a port set that the kqueue reactor
+ * watches, so no run loop or dispatch queue is needed.
+ */
+static io_connect_t             sleepRootPort = MACH_PORT_NULL;
+static IONotificationPortRef    sleepNotifyPort = NULL;
+static io_object_t              sleepNotifier = MACH_PORT_NULL;
+
+static void
+sleepPowerCallback(void *refcon, io_service_t service, natural_t messageType, void *messageArgument)
+{
+    (void)refcon;
+    (void)service;
+
+    switch (messageType) {
+        case kIOMessageCanSystemSleep:
+            IOAllowPowerChange(sleepRootPort, (long)messageArgument);
+            break;
+        case kIOMessageSystemWillSleep:
+            sleepWillSleep();
+            IOAllowPowerChange(sleepRootPort, (long)messageArgument);
+            break;
+        case kIOMessageSystemHasPoweredOn:
+            sleepHasWoken();
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+sleepPortReadable(void *context)
+{
+    struct {
+        mach_msg_header_t   header;
+        uint8_t             body[1024];
+    } message;
+    mach_port_t port = (mach_port_t)(uintptr_t)context;
+
+    while (mach_msg(&message.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(message),
+                    port, 0, MACH_PORT_NULL) == MACH_MSG_SUCCESS) {
+        IODispatchCalloutFromMessage(NULL, &message.header, sleepNotifyPort);
+    }
+}
+
+int
+sleepWatchStart(pid_t pid, const char *command)
+{
+    mach_port_t port, portSet;
+
+    if (sleepSignal < 0) {
+        return 0;
+    }
+    sleepChild = pid;
+    sleepCommand = command;
+
+    sleepRootPort = IORegisterForSystemPower(NULL, &sleepNotifyPort, sleepPowerCallback, &sleepNotifier);
+    if (sleepRootPort == MACH_PORT_NULL) {
+        fprintf(stderr, "caffeinate: cannot register for sleep notifications\n");
+        return -1;
+    }
+    port = IONotificationPortGetMachPort(sleepNotifyPort);
+    if (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_PORT_SET, &portSet) != KERN_SUCCESS
+        || mach_port_insert_member(mach_task_self(), port, portSet) != KERN_SUCCESS
+        || !reactorAddMachPort(portSet, sleepPortReadable, (void *)(uintptr_t)port)) {
+        fprintf(stderr, "caffeinate: cannot watch for sleep notifications\n");
+        return -1;
+    }
+    return 0;
+}
+
+#endif
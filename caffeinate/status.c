@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "caffeinate.h"
+#include "status.h"
+
+static CaffeinateStatusPage *statusPage = NULL;
+static CaffeinateStatusSlot *statusSlot = NULL;
+
+static const char *
+statusPagePath(void)
+{
+    const char *path = getenv("CAFFEINATE_STATUS");
+
+    return (path && *path) ? path : kCaffeinateStatusPath;
+}
+
+static CaffeinateStatusPage *
+statusPageMap(int writable)
+{
+    CaffeinateStatusPage *page;
+    struct stat sb;
+    int fd;
+
+    fd = open(statusPagePath(), writable ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &sb) < 0
+        || (sb.st_size < (off_t)sizeof(*page) && (!writable || ftruncate(fd, sizeof(*page)) < 0))) {
+        close(fd);
+        return NULL;
+    }
+    page = mmap(NULL, sizeof(*page), writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    /*
+     * First writer stamps the header. The lock makes a writer that starts
+     * meanwhile wait for it instead of finding the magic not yet there.
+     */
+    if (writable && __atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != kCaffeinateStatusMagic
+        && flock(fd, LOCK_EX) == 0) {
+        if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != kCaffeinateStatusMagic && !page->version) {
+            page->version = kCaffeinateStatusVersion;
+            page->slotCount = kCaffeinateStatusSlots;
+            __atomic_store_n(&page->magic, kCaffeinateStatusMagic, __ATOMIC_RELEASE);
+        }
+        (void)flock(fd, LOCK_UN);
+    }
+    close(fd);
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != kCaffeinateStatusMagic
+        || page->version != kCaffeinateStatusVersion) {
+        munmap(page, sizeof(*page));
+        return NULL;
+    }
+    return page;
+}
+
+static int
+statusOwnerAlive(pid_t pid)
+{
+    return pid && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+/* The sequence and the pid share an aligned 64-bit word, so both move in one CAS. */
+typedef union {
+    struct {
+        uint32_t    sequence;
+        int32_t     pid;
+    } parts;
+    uint64_t    word;
+} StatusSlotLock;
+
+/*
+ * Lock a slot for this process if it is free or its owner is gone: even
+ * and unowned, or left odd by a writer that died mid-update. The pid is
+ * taken along with the lock, so an odd slot always names its writer.
+ */
+static int
+statusSlotClaim(CaffeinateStatusSlot *slot)
+{
+    uint64_t *word = (uint64_t *)(void *)&slot->sequence;
+    StatusSlotLock current, claimed;
+
+    current.word = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+    if (statusOwnerAlive(current.parts.pid)) {
+        return 0;
+    }
+    claimed.parts.sequence = current.parts.sequence + ((current.parts.sequence & 1) ? 2 : 1);
+    claimed.parts.pid = getpid();
+    return __atomic_compare_exchange_n(word, &current.word, claimed.word, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void
+statusSlotBegin(CaffeinateStatusSlot *slot)
+{
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+statusSlotEnd(CaffeinateStatusSlot *slot)
+{
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Claim a slot, either a free one or one left behind by a dead caffeinate,
+ * and describe the assertions held on behalf of command. Publishing is
+ * best effort: without write access to the page the tool works as before.
+ */
+int
+statusPagePublish(AssertionFlag flags, PropertyFlag propFlags, const char *command)
+{
+    unsigned i;
+
+    if (statusSlot) {
+        statusSlotBegin(statusSlot);
+        statusSlot->assertionFlags = flags;
+        statusSlot->propertyFlags = propFlags;
+        statusSlotEnd(statusSlot);
+        return 0;
+    }
+
+    if (!statusPage && !(statusPage = statusPageMap(1))) {
+        return -1;
+    }
+
+    for (i = 0; i < kCaffeinateStatusSlots && !statusSlot; i++) {
+        CaffeinateStatusSlot *slot = &statusPage->slots[i];
+
+        if (!statusSlotClaim(slot)) continue;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->assertionFlags = flags;
+        slot->propertyFlags = propFlags;
+        slot->since = (int64_t)time(NULL);
+        memset(slot->command, 0, sizeof(slot->command));
+        if (command) {
+            const char *base = strrchr(command, '/');
+            strncpy(slot->command, base ? base + 1 : command, sizeof(slot->command) - 1);
+        }
+        statusSlotEnd(slot);
+        statusSlot = slot;
+        (void)atexit(statusPageWithdraw);
+    }
+
+    return statusSlot ? 0 : -1;
+}
+
+void
+statusPageWithdraw(void)
+{
+    if (!statusSlot) {
+        return;
+    }
+    statusSlotBegin(statusSlot);
+    statusSlot->pid = 0;
+    statusSlot->assertionFlags = 0;
+    statusSlotEnd(statusSlot);
+    statusSlot = NULL;
+}
+
+/*
+ * caffeinate --status: list who is keeping the host awake. Exits 0 when at
+ * least one live caffeinate holds assertions, 1 otherwise.
+ */
+int
+statusPageShow(void)
+{
+    const CaffeinateStatusPage *page = statusPageMap(0);
+    CaffeinateStatusSlot slot;
+    int live = 0;
+    unsigned i;
+
+    if (!page) {
+        printf("No caffeinate status published at %s\n", statusPagePath());
+        return 1;
+    }
+
+    for (i = 0; i < page->slotCount && i < kCaffeinateStatusSlots; i++) {
+        char since[32], assertions[8];
+        time_t when;
+        int n = 0;
+
+        if (caffeinateStatusReadSlot(page, i, &slot) <= 0) continue;
+        if (!statusOwnerAlive(slot.pid)) continue;
+        /* Waiting on a lease, pressure, a process or writes: nothing held yet. */
+        if (!slot.assertionFlags) continue;
+
+        if (!live++) {
+            printf("%-7s %-19s  %-10s  %s\n", "PID", "SINCE", "ASSERTIONS", "COMMAND");
+        }
+        when = (time_t)slot.since;
+        (void)strftime(since, sizeof(since), "%Y-%m-%d %H:%M:%S", localtime(&when));
+        assertions[n++] = '-';
+        if (slot.assertionFlags & kDisplayAssertionFlag) assertions[n++] = 'd';
+        if (slot.assertionFlags & kIdleAssertionFlag) assertions[n++] = 'i';
+        if (slot.assertionFlags & kSystemAssertionFlag) assertions[n++] = 's';
+        if (slot.propertyFlags & kAssertionOnBattFlag) assertions[n++] = 'b';
+        assertions[n] = '\0';
+        slot.command[sizeof(slot.command) - 1] = '\0';
+        printf("%-7d %-19s  %-10s  %s\n", (int)slot.pid, since, assertions,
+               slot.command[0] ? slot.command : "(forever)");
+    }
+
+    if (!live) {
+        printf("No assertions held by caffeinate\n");
+    }
+    return live ? 0 : 1;
+}
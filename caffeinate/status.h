@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _CAFFEINATE_STATUS_H_
+#define _CAFFEINATE_STATUS_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*!
+ * The status page is a single shared page, normally at kCaffeinateStatusPath,
+ * into which every running caffeinate publishes the assertions it holds.
+ * Clients mmap it read-only and call caffeinateStatusReadSlot(); no locks
+ * are taken and no IPC is involved.
+ *
+ * Each slot is updated under a sequence lock: the sequence is odd while a
+ * write is in progress, and a reader retries until it sees the same even
+ * value before and after copying the slot. Writers claim a free slot by
+ * moving its sequence to odd and setting their pid in one compare-and-swap
+ * of the two adjacent fields, so the sequence doubles as the writer lock
+ * and an odd slot always names its writer. A pid of 0 marks a free slot.
+ *
+ * A caffeinate killed without warning, even mid-update, leaves its slot
+ * behind until another instance reclaims it; readers that care can check
+ * the pid with kill(pid, 0).
+ */
+
+#define kCaffeinateStatusPath       "/var/run/caffeinate.status"
+#define kCaffeinateStatusMagic      0x46464143      /* "CAFF" */
+#define kCaffeinateStatusVersion    1
+#define kCaffeinateStatusSlots      63
+
+typedef struct {
+    uint32_t    sequence;
+    int32_t     pid;
+    uint32_t    assertionFlags;     /* AssertionFlag bits */
+    uint32_t    propertyFlags;      /* PropertyFlag bits */
+    int64_t     since;              /* seconds since the epoch */
+    char        command[40];        /* utility name, or "" when asserting forever */
+} CaffeinateStatusSlot;
+
+typedef struct {
+    uint32_t                magic;
+    uint32_t                version;
+    uint32_t                slotCount;
+    uint32_t                reserved[13];
+    CaffeinateStatusSlot    slots[kCaffeinateStatusSlots];
+} CaffeinateStatusPage;
+
+/*!
+ * @function    caffeinateStatusReadSlot
+ * @abstract    Takes a consistent snapshot of one slot.
+ * @result      Returns 1 if the slot is in use, 0 if it is free, and -1 if
+ *              a writer died mid-update and the slot never settled.
+ */
+static inline int
+caffeinateStatusReadSlot(const CaffeinateStatusPage *page, unsigned index, CaffeinateStatusSlot *out)
+{
+    const CaffeinateStatusSlot *slot = &page->slots[index];
+    uint32_t before, after;
+    unsigned spins = 0;
+
+    do {
+        if (++spins > 100000) {
+            return -1;
+        }
+        before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(out, (const void *)slot, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    return out->pid != 0;
+}
+
+#endif /* _CAFFEINATE_STATUS_H_ */
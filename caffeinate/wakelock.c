@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "caffeinate.h"
+
+/*
+ * Kernel wakeup sources from user space (CONFIG_PM_WAKELOCKS): a name
+ * written to /sys/power/wake_lock is held until it is written to
+ * /sys/power/wake_unlock. This blocks opportunistic sleep
+ * (/sys/power/autosleep) and any suspend that goes through
+ * /sys/power/wakeup_count, as on Android-derived and embedded systems
+ * without logind. The lock is the kernel's, not tied to any descriptor or
+ * process: caffeinate has to release it, and cannot pass it on.
+ */
+
+#define kWakeLockTypes          (kIdleAssertionFlag | kSystemAssertionFlag)
+
+static AssertionFlag    wakeLockHeld = kDefaultAssertionFlag;
+
+static void
+wakeLockName(char *buffer, size_t size, AssertionFlag type, pid_t pid)
+{
+    (void)snprintf(buffer, size, "caffeinate-%d-%s", (int)pid, assertionTypeName(type));
+}
+
+static int
+wakeLockWrite(const char *file, AssertionFlag type, pid_t pid)
+{
+    char path[1024], name[64];
+    ssize_t length;
+    int fd, result = 0;
+
+    (void)snprintf(path, sizeof(path), "%s/power/%s", sysfsRoot(), file);
+    wakeLockName(name, sizeof(name), type, pid);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+    length = (ssize_t)strlen(name);
+    if (write(fd, name, (size_t)length) != length) {
+        result = errno ? errno : EIO;
+    }
+    close(fd);
+    return result;
+}
+
+static int
+wakeLockCreate(AssertionFlag type, const char *details)
+{
+    int result;
+
+    (void)details;
+    errno = 0;
+    result = wakeLockWrite("wake_lock", type, getpid());
+    if (result) {
+        fprintf(stderr, "Failed to take a %s wake lock: %s\n", assertionTypeName(type), strerror(result));
+        return result;
+    }
+    wakeLockHeld |= type;
+    return 0;
+}
+
+static int
+wakeLockRelease(AssertionFlag type)
+{
+    if (!(wakeLockHeld & type)) {
+        return 0;
+    }
+    wakeLockHeld &= ~type;
+    errno = 0;
+    return wakeLockWrite("wake_unlock", type, getpid());
+}
+
+static int
+wakeLockQuery(AssertionFlag type)
+{
+    return (wakeLockHeld & type) ? kBackendProcessHeld : kBackendNotHeld;
+}
+
+/* The lock is named after the pid, so anyone can unlock a dead caffeinate's. */
+static void
+wakeLockReclaim(AssertionFlag type, pid_t pid)
+{
+    (void)wakeLockWrite("wake_unlock", type, pid);
+}
+
+const AssertionBackend wakeLockBackend = {
+    .name           = "wakelock",
+    .types          = kWakeLockTypes,
+    .inheritable    = 0,
+    .outlives       = 1,
+    .create         = wakeLockCreate,
+    .release        = wakeLockRelease,
+    .query          = wakeLockQuery,
+    .reclaim        = wakeLockReclaim,
+};
+
+#endif /* __linux__ */
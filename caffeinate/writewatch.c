@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#endif
+
+#include "caffeinate.h"
+
+/*
+ * caffeinate --while-writing <dir>: hold the assertions while files under
+ * dir are being written, and release them once nothing has been for the
+ * quiet period.
+ *
+ * Every directory in the tree gets an inotify watch. While the tree is
+ * quiet, caffeinate waits on the inotify descriptor. The first event takes
+ * the assertions, and from then on the descriptor is left alone: a timer
+ * ticks kWriteWatchTicks times per quiet period and drains whatever queued
+ * up in one go, so a flood of writes costs one wakeup per tick rather than
+ * one per write(2). The kernel only merges an event into an identical one
+ * queued right before it, so with several files being written the queue
+ * still grows with the writes and may overflow; an overflow only says that
+ * the tick was busy. Directories created while events were being dropped
+ * are picked up by one rescan when the tree next goes quiet.
+ */
+
+#define kWriteWatchTicks        4               /* per quiet period */
+#define kWriteWatchMask         (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO)
+
+#if defined(__linux__)
+
+static int              writeWatchFD = -1;
+static char             *writeWatchRoot = NULL;
+static int              writeWatchStale = 0;        /* events were dropped */
+static char             **writeWatchPaths = NULL;   /* directory of each watch descriptor */
+static int              writeWatchPathCount = 0;
+static int              writeWatchFull = 0;
+static ReactorSourceRef writeWatchSource = NULL;
+static ReactorSourceRef writeWatchTimer = NULL;
+static uint64_t         writeWatchTickMS = 0;
+static unsigned         writeWatchQuietTicks = 0;
+static WriteWatchCallback writeWatchCallback = NULL;
+static void             *writeWatchContext = NULL;
+
+/**************************************************
+ * Watches
+ **************************************************/
+
+static int
+writeWatchAdd(const char *path)
+{
+    int wd, error;
+
+    wd = inotify_add_watch(writeWatchFD, path, kWriteWatchMask | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        error = errno;
+        if (error == ENOSPC && !writeWatchFull) {
+            /* fs.inotify.max_user_watches; the rest of the tree goes unwatched. */
+            fprintf(stderr, "caffeinate: --while-writing: out of inotify watches at %s\n", path);
+            writeWatchFull = 1;
+        }
+        errno = error;
+        return -1;
+    }
+    if (wd >= writeWatchPathCount) {
+        int count = writeWatchPathCount ? writeWatchPathCount : 64;
+        char **paths;
+
+        while (count <= wd) count *= 2;
+        paths = realloc(writeWatchPaths, (size_t)count * sizeof(char *));
+        if (!paths) {
+            return -1;
+        }
+        memset(paths + writeWatchPathCount, 0, (size_t)(count - writeWatchPathCount) * sizeof(char *));
+        writeWatchPaths = paths;
+        writeWatchPathCount = count;
+    }
+    /* A directory watched again keeps its descriptor. */
+    free(writeWatchPaths[wd]);
+    writeWatchPaths[wd] = strdup(path);
+    return 0;
+}
+
+static int
+writeWatchVisit(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+    (void)sb;
+    (void)ftw;
+    if (type == FTW_D) {
+        (void)writeWatchAdd(path);
+    }
+    return 0;
+}
+
+/* Watch path and every directory below it, without following symbolic links. */
+static int
+writeWatchTree(const char *path)
+{
+    return nftw(path, writeWatchVisit, 16, FTW_PHYS);
+}
+
+/**************************************************
+ * Events
+ **************************************************/
+
+/*
+ * Read everything queued. New directories are watched as they appear;
+ * anything else only counts as activity. Returns whether there was any.
+ */
+static int
+writeWatchDrain(void)
+{
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    char path[PATH_MAX];
+    int active = 0;
+    ssize_t count, offset;
+
+    while ((count = read(writeWatchFD, buffer, sizeof(buffer))) > 0) {
+        for (offset = 0; offset < count; offset += (ssize_t)sizeof(*event) + event->len) {
+            event = (const struct inotify_event *)(buffer + offset);
+            if (event->mask & IN_Q_OVERFLOW) {
+                writeWatchStale = 1;
+            } else if (event->mask & IN_IGNORED) {
+                /* The directory is gone. */
+                if (event->wd >= 0 && event->wd < writeWatchPathCount) {
+                    free(writeWatchPaths[event->wd]);
+                    writeWatchPaths[event->wd] = NULL;
+                }
+                continue;
+            } else if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))
+                       && event->len && event->wd < writeWatchPathCount && writeWatchPaths[event->wd]) {
+                (void)snprintf(path, sizeof(path), "%s/%s", writeWatchPaths[event->wd], event->name);
+                (void)writeWatchTree(path);
+            }
+            active = 1;
+        }
+    }
+    return active;
+}
+
+static void writeWatchReadable(void *context);
+
+static void
+writeWatchTick(void *context)
+{
+    (void)context;
+    if (writeWatchDrain()) {
+        writeWatchQuietTicks = 0;
+        return;
+    }
+    if (++writeWatchQuietTicks < kWriteWatchTicks) {
+        return;
+    }
+    /* Quiet for the whole period: back to waiting for the next event. */
+    (void)reactorSetTimer(writeWatchTimer, 0);
+    if (writeWatchStale) {
+        /* Existing watches keep their descriptors; only missed directories are added. */
+        writeWatchStale = 0;
+        (void)writeWatchTree(writeWatchRoot);
+    }
+    writeWatchCallback(0, writeWatchContext);
+    writeWatchSource = reactorAddDescriptor(writeWatchFD, writeWatchReadable, NULL);
+    if (!writeWatchSource) {
+        exit(1);
+    }
+}
+
+static void
+writeWatchReadable(void *context)
+{
+    (void)context;
+    if (!writeWatchDrain()) {
+        return;
+    }
+    reactorRemove(writeWatchSource);
+    writeWatchSource = NULL;
+    writeWatchQuietTicks = 0;
+    if (reactorSetTimer(writeWatchTimer, writeWatchTickMS)) {
+        exit(1);
+    }
+    writeWatchCallback(1, writeWatchContext);
+}
+
+/*
+ * Watch the tree under path. callback gets 1 when something is written
+ * there and 0 once nothing has been for quiet seconds; nothing is called
+ * until then.
+ */
+int
+writeWatchStart(const char *path, unsigned quiet, WriteWatchCallback callback, void *context)
+{
+    struct stat sb;
+
+    /* dir itself may be a symbolic link, such as to a mount point; nothing below it is followed. */
+    writeWatchRoot = realpath(path, NULL);
+    if (!writeWatchRoot || stat(writeWatchRoot, &sb) < 0) {
+        fprintf(stderr, "caffeinate: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(sb.st_mode)) {
+        fprintf(stderr, "caffeinate: %s: %s\n", path, strerror(ENOTDIR));
+        return -1;
+    }
+    writeWatchCallback = callback;
+    writeWatchContext = context;
+    writeWatchTickMS = (uint64_t)quiet * 1000 / kWriteWatchTicks;
+    if (!writeWatchTickMS) writeWatchTickMS = 1;
+
+    writeWatchFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (writeWatchFD < 0) {
+        fprintf(stderr, "caffeinate: inotify: %s\n", strerror(errno));
+        return -1;
+    }
+    if (writeWatchAdd(writeWatchRoot) < 0 || writeWatchTree(writeWatchRoot) < 0) {
+        fprintf(stderr, "caffeinate: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    writeWatchTimer = reactorAddTimer(0, 1, writeWatchTick, NULL);
+    writeWatchSource = reactorAddDescriptor(writeWatchFD, writeWatchReadable, NULL);
+    if (!writeWatchTimer || !writeWatchSource) {
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+int
+writeWatchStart(const char *path, unsigned quiet, WriteWatchCallback callback, void *context)
+{
+    (void)path;
+    (void)quiet;
+    (void)callback;
+    (void)context;
+    fprintf(stderr, "caffeinate: --while-writing is not supported on this platform\n");
+    return -1;
+}
+
+#endif
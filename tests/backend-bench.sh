@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Startup cost of each backend: wall time per run of "caffeinate --backend
+# name -i true", with tests/fakebus.py standing in for both the session and
+# the system bus and a fake sysfs tree for wakelock. The none backend
+# starts nothing, so its time is caffeinate's own and each other backend's
+# cost is its difference from it.
+#
+#   tests/backend-bench.sh [caffeinate [runs]]
+#
+# Linux only.
+
+caffeinate=${1:-caffeinate}
+runs=${2:-300}
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'kill $bus 2>/dev/null; rm -rf "$work"' EXIT
+
+python3 "$tests/fakebus.py" "$work/bus" "$work/log" &
+bus=$!
+while [ ! -S "$work/bus" ]; do sleep 0.05; done
+mkdir -p "$work/sys/power"
+: > "$work/sys/power/wake_lock"
+: > "$work/sys/power/wake_unlock"
+
+DBUS_SESSION_BUS_ADDRESS=unix:path=$work/bus
+DBUS_SYSTEM_BUS_ADDRESS=unix:path=$work/bus
+CAFFEINATE_SYSFS_ROOT=$work/sys
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+export DBUS_SESSION_BUS_ADDRESS DBUS_SYSTEM_BUS_ADDRESS CAFFEINATE_SYSFS_ROOT
+export CAFFEINATE_STATUS CAFFEINATE_AUDIT
+
+# Wall time of runs invocations of the command given, in microseconds per run.
+bench() {
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$runs" ]; do
+        "$@"
+        i=$((i + 1))
+    done
+    echo $((($(date +%s%N) - start) / runs / 1000))
+}
+
+echo "bare:        $(bench /bin/true) us per run"
+for backend in none wakelock logind screensaver; do
+    printf '%-12s %s us per run\n' "$backend:" \
+        "$(bench "$caffeinate" --backend $backend -i /bin/true)"
+done
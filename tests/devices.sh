@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# caffeinate --devices, against a fake sysfs tree with a SATA disk and a
+# network interface on PCI: runtime PM is set to on for the devices and
+# their parents, ASPM is turned off on the links and the SATA host's link
+# power management is set to max_performance while the utility runs, and
+# the previous values are written back when it exits or caffeinate is sent
+# SIGTERM, or from the journal by the next caffeinate if it was killed.
+#
+#   tests/devices.sh [caffeinate]
+#
+# Linux only. Exits non-zero if any check failed.
+
+caffeinate=${1:-caffeinate}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+sys=$work/sys
+sata=$sys/devices/pci0000:00/0000:00:17.0
+disk=$sata/host0/target0:0:0/0:0:0:0
+nic=$sys/devices/pci0000:00/0000:00:1f.6
+mkdir -p "$sata/link" "$sata/host0/scsi_host/host0" "$disk/power" "$disk/block/sda/sda1" \
+    "$nic/power" "$nic/net/eth0" "$sys/class/block" "$sys/class/net"
+: > "$disk/block/sda/sda1/partition"
+ln -s ../../../0:0:0:0 "$disk/block/sda/device"
+ln -s ../../../0000:00:1f.6 "$nic/net/eth0/device"
+ln -s "$disk/block/sda" "$sys/class/block/sda"
+ln -s "$disk/block/sda/sda1" "$sys/class/block/sda1"
+ln -s "$nic/net/eth0" "$sys/class/net/eth0"
+
+CAFFEINATE_SYSFS_ROOT=$sys
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+CAFFEINATE_JOURNAL=$work/journal
+export CAFFEINATE_SYSFS_ROOT CAFFEINATE_STATUS CAFFEINATE_AUDIT CAFFEINATE_JOURNAL
+
+failed=0
+
+files="$disk/power/control $sata/link/l1_aspm $sata/host0/scsi_host/host0/link_power_management_policy
+    $nic/power/control"
+idle="auto 1 med_power_with_dipm auto"
+pinned="on 0 max_performance on"
+
+check() {
+    found=$(for file in $files; do printf '%s ' "$(cat "$file")"; done)
+    if [ "$found" = "$2 " ]; then
+        echo "ok: $1"
+    else
+        echo "FAILED: $1: expected \"$2\", found \"$found\""
+        failed=1
+    fi
+}
+
+# How caffeinate is left: "exit", "term" or "kill".
+run() {
+    for file in $files; do echo auto > "$file"; done
+    echo 1 > "$sata/link/l1_aspm"
+    echo med_power_with_dipm > "$sata/host0/scsi_host/host0/link_power_management_policy"
+    "$caffeinate" --backend none --devices sda1,eth0 sleep 5 &
+    wrapper=$!
+    sleep 0.5
+    check "pinned while the utility runs" "$pinned"
+    utility=$(pgrep -x -P $wrapper sleep)
+    case $1 in
+    term)   kill -TERM $wrapper ;;
+    kill)   kill -KILL $wrapper; kill $utility ;;
+    *)      kill $utility ;;
+    esac
+    wait $wrapper 2>/dev/null
+    if [ "$1" = kill ]; then
+        check "still pinned after SIGKILL" "$pinned"
+        "$caffeinate" --backend none --devices sda true
+        check "restored by the next caffeinate" "$idle"
+    else
+        check "restored after $1" "$idle"
+    fi
+}
+
+run exit
+run term
+run kill
+
+exit $failed
@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# caffeinate --energy against a fake powercap tree: a package zone with a
+# dram subzone, a core subzone and an MMIO counter for the same package
+# that must not be counted twice. The counters are moved by hand while
+# caffeinate runs. Only the energy used while the assertions are held counts, across
+# a counter wrap too, and with --while-writing only while files are being
+# written.
+#
+#   tests/energy.sh [caffeinate]
+#
+# Linux only. Exits non-zero if any check failed.
+
+caffeinate=${1:-caffeinate}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+powercap=$work/sys/class/powercap
+
+# directory, name, energy_uj, max_energy_range_uj
+zone() {
+    mkdir -p "$powercap/$1"
+    echo "$2" > "$powercap/$1/name"
+    echo "$3" > "$powercap/$1/energy_uj"
+    echo "$4" > "$powercap/$1/max_energy_range_uj"
+}
+
+dram=$powercap/intel-rapl:0:1/energy_uj
+
+CAFFEINATE_SYSFS_ROOT=$work/sys
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+export CAFFEINATE_SYSFS_ROOT CAFFEINATE_STATUS CAFFEINATE_AUDIT
+
+failed=0
+
+# what, expected, report
+check() {
+    case $3 in
+        *"$2"*)
+            echo "ok: $1" ;;
+        *)
+            echo "FAILED: $1: expected \"$2\" in \"$3\""
+            failed=1 ;;
+    esac
+}
+
+# Both package counters read the same energy, as on real parts.
+package() {
+    echo "$1" > "$powercap/intel-rapl:0/energy_uj"
+    echo "$1" > "$powercap/intel-rapl-mmio:0/energy_uj"
+}
+
+reset() {
+    rm -rf "$powercap"
+    zone intel-rapl:0 package-0 1000000 262143328850
+    zone intel-rapl:0:0 core 1000000 262143328850
+    zone intel-rapl:0:1 dram 1000000 65712999613
+    zone intel-rapl-mmio:0 package-0 1000000 262143328850
+}
+
+# Held throughout: package and dram each use 2 J, the package across a wrap.
+reset
+package 262142328850
+report=$("$caffeinate" --backend none --energy sh -c "
+    sleep 0.3
+    echo 1000000 > '$powercap/intel-rapl:0/energy_uj'
+    echo 1000000 > '$powercap/intel-rapl-mmio:0/energy_uj'
+    echo 3000000 > '$dram'
+" 2>&1)
+check "package counted across a wrap" "package-0 2.000 J" "$report"
+check "dram subzone counted" "package-0 dram 2.000 J" "$report"
+check "duplicate package skipped" "; 4.000 J over" "$report"
+
+# --while-writing: 1 J before the first write and 4 J after the quiet
+# period are not counted, the 3 J in between are.
+reset
+mkdir "$work/tree"
+"$caffeinate" --backend none --energy --while-writing "$work/tree" --quiet-period 1 \
+    sleep 4 2> "$work/report" &
+wrapper=$!
+sleep 0.5
+package 2000000
+touch "$work/tree/file"
+sleep 0.3
+package 5000000
+sleep 2
+package 9000000
+wait $wrapper
+report=$(cat "$work/report")
+check "only the time held counts" "package-0 3.000 J" "$report"
+
+exit $failed
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Time from invoking caffeinate to the utility's first instruction, the
+# assertion having been created on the way (Inhibit through the screensaver
+# backend, on tests/fakebus.py). The utility is date, whose output stamps
+# when it started; the median over the runs is printed next to the same
+# for date run bare, the difference being what caffeinate adds.
+#
+#   tests/exec-bench.sh [caffeinate [runs]]
+#
+# Linux only.
+
+caffeinate=${1:-caffeinate}
+runs=${2:-300}
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'kill $bus 2>/dev/null; rm -rf "$work"' EXIT
+
+python3 "$tests/fakebus.py" "$work/bus" "$work/log" &
+bus=$!
+while [ ! -S "$work/bus" ]; do sleep 0.05; done
+
+DBUS_SESSION_BUS_ADDRESS=unix:path=$work/bus
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+export DBUS_SESSION_BUS_ADDRESS CAFFEINATE_STATUS CAFFEINATE_AUDIT
+
+# Median microseconds from invoking the command given to date's stamp.
+bench() {
+    i=0
+    while [ $i -lt "$runs" ]; do
+        start=$(date +%s%N)
+        stamp=$("$@" date +%s%N)
+        echo $(((stamp - start) / 1000))
+        i=$((i + 1))
+    done | sort -n | awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }'
+}
+
+echo "bare:       $(bench) us"
+echo "caffeinate: $(bench "$caffeinate" --backend screensaver -d) us"
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+#
+# A stand-in for the session bus and the org.freedesktop.ScreenSaver
+# service behind it, enough for caffeinate's D-Bus client: the SASL
+# handshake, Hello, Inhibit and UnInhibit. It also answers logind's
+# Inhibit, as a system bus would, with one end of a pipe for the lock.
+# Every call, and every cookie dropped because its connection closed, is
+# logged one per line:
+#
+#   INHIBIT <cookie> <application> <reason>
+#   UNINHIBIT <cookie>
+#   DISCONNECT <cookie>
+#   LOCK <what> <who> <mode>
+#
+#   tests/fakebus.py <socket> <log>
+
+import os
+import socket
+import struct
+import sys
+import threading
+
+path, log = sys.argv[1], open(sys.argv[2], "a", buffering=1)
+lock = threading.Lock()
+serial = [1000]
+cookie = [0]
+
+
+def align(n, a):
+    return (n + a - 1) // a * a
+
+
+def string(body, offset):
+    offset = align(offset, 4)
+    length = struct.unpack_from("<I", body, offset)[0]
+    return body[offset + 4:offset + 4 + length].decode(), offset + 4 + length + 1
+
+
+def parse(message):
+    fields_length = struct.unpack_from("<I", message, 12)[0]
+    offset, end, fields = 16, 16 + fields_length, {}
+    while offset < end:
+        offset = align(offset, 8)
+        code, signature = message[offset], chr(message[offset + 2])
+        offset += 4
+        if signature in "so":
+            fields[code], offset = string(message, offset)
+        elif signature == "u":
+            offset = align(offset, 4)
+            fields[code] = struct.unpack_from("<I", message, offset)[0]
+            offset += 4
+        elif signature == "g":
+            length = message[offset]
+            fields[code] = message[offset + 1:offset + 1 + length].decode()
+            offset += length + 2
+    body, args, offset = message[align(end, 8):], [], 0
+    for kind in fields.get(8, ""):
+        if kind == "s":
+            value, offset = string(body, offset)
+        else:
+            offset = align(offset, 4)
+            value = struct.unpack_from("<I", body, offset)[0]
+            offset += 4
+        args.append(value)
+    return struct.unpack_from("<I", message, 8)[0], fields, args
+
+
+def reply(to, signature="", body=b"", error=None, fds=0):
+    header = bytearray(b"l" + bytes([3 if error else 2, 0, 1]))
+    header += struct.pack("<III", len(body), serial[0], 0)
+    serial[0] += 1
+    fields = [(5, "u", to)]
+    if error:
+        fields.append((4, "s", error))
+    if signature:
+        fields.append((8, "g", signature))
+    if fds:
+        fields.append((9, "u", fds))
+    start = len(header)
+    for code, kind, value in fields:
+        header += b"\0" * (align(len(header), 8) - len(header))
+        header += bytes([code, 1]) + kind.encode() + b"\0"
+        if kind == "u":
+            header += struct.pack("<I", value)
+        elif kind == "g":
+            header += bytes([len(value)]) + value.encode() + b"\0"
+        else:
+            header += struct.pack("<I", len(value)) + value.encode() + b"\0"
+    struct.pack_into("<I", header, 12, len(header) - start)
+    header += b"\0" * (align(len(header), 8) - len(header))
+    return bytes(header) + body
+
+
+def receive(connection, count):
+    data = b""
+    while len(data) < count:
+        chunk = connection.recv(count - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def serve(connection):
+    held = set()
+    try:
+        line = b""
+        while not line.endswith(b"BEGIN\r\n"):
+            line += receive(connection, 1)
+            if line.endswith(b"\r\n") and not line.endswith(b"BEGIN\r\n"):
+                if b"AUTH" in line:
+                    connection.sendall(b"OK 0123456789abcdef0123456789abcdef\r\n")
+                elif b"NEGOTIATE_UNIX_FD" in line:
+                    connection.sendall(b"AGREE_UNIX_FD\r\n")
+                line = b""
+        while True:
+            header = receive(connection, 16)
+            body_length, fields_length = struct.unpack_from("<I", header, 4)[0], struct.unpack_from("<I", header, 12)[0]
+            message = header + receive(connection, align(16 + fields_length, 8) - 16 + body_length)
+            number, fields, args = parse(message)
+            member = fields.get(3)
+            if member == "Hello":
+                name = ":1.%d" % number
+                connection.sendall(reply(number, "s", struct.pack("<I", len(name)) + name.encode() + b"\0"))
+            elif member == "Inhibit" and fields.get(2) == "org.freedesktop.ScreenSaver":
+                with lock:
+                    cookie[0] += 1
+                    value = cookie[0]
+                held.add(value)
+                log.write("INHIBIT %d %s %s\n" % (value, args[0], args[1]))
+                connection.sendall(reply(number, "u", struct.pack("<I", value)))
+            elif member == "Inhibit" and fields.get(2) == "org.freedesktop.login1.Manager":
+                lock_end, held_end = os.pipe()
+                log.write("LOCK %s %s %s\n" % (args[0], args[1], args[3]))
+                socket.send_fds(connection, [reply(number, "h", struct.pack("<I", 0), fds=1)], [lock_end])
+                os.close(lock_end)
+                os.close(held_end)
+            elif member == "UnInhibit":
+                held.discard(args[0])
+                log.write("UNINHIBIT %d\n" % args[0])
+                connection.sendall(reply(number))
+            else:
+                connection.sendall(reply(number, error="org.freedesktop.DBus.Error.UnknownMethod"))
+    except (EOFError, ConnectionResetError, BrokenPipeError):
+        # Like the real service: a cookie goes away with its connection.
+        for value in sorted(held):
+            log.write("DISCONNECT %d\n" % value)
+
+
+try:
+    os.unlink(path)
+except FileNotFoundError:
+    pass
+server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+server.bind(path)
+server.listen(16)
+while True:
+    client, _ = server.accept()
+    threading.Thread(target=serve, args=(client,), daemon=True).start()
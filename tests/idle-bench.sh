@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Idle cost of a caffeinate wrapping a utility that does nothing: resident
+# set size and wakeups (voluntary context switches) over a fixed interval.
+#
+#   tests/idle-bench.sh [caffeinate [seconds]]
+#
+# Linux only; reads /proc. Run it against each build to be compared.
+
+caffeinate=${1:-caffeinate}
+seconds=${2:-60}
+
+"$caffeinate" -i sleep $((seconds + 5)) &
+wrapper=$!
+sleep 1
+
+switches() {
+    awk '/^voluntary_ctxt_switches/ { print $2 }' /proc/$wrapper/status
+}
+
+before=$(switches)
+sleep "$seconds"
+after=$(switches)
+rss=$(awk '/^VmRSS/ { print $2 }' /proc/$wrapper/status)
+
+kill $wrapper 2>/dev/null
+wait $wrapper 2>/dev/null
+
+echo "rss ${rss} kB"
+echo "wakeups $((after - before)) in ${seconds} s"
@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# caffeinate -l with --cpus, against a fake sysfs tree: the request is
+# written to the CPU's pm_qos_resume_latency_us while the utility runs
+# ("n/a" for -l 0, the strictest setting) and the previous value is
+# written back when it exits or caffeinate is sent SIGTERM, or by the next
+# caffeinate -l --cpus if it was killed.
+#
+#   tests/latency.sh [caffeinate]
+#
+# Linux only. Exits non-zero if any check failed.
+
+caffeinate=${1:-caffeinate}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+qos=$work/sys/devices/system/cpu/cpu0/power/pm_qos_resume_latency_us
+mkdir -p "$(dirname "$qos")"
+
+CAFFEINATE_SYSFS_ROOT=$work/sys
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+CAFFEINATE_JOURNAL=$work/journal
+export CAFFEINATE_SYSFS_ROOT CAFFEINATE_STATUS CAFFEINATE_AUDIT CAFFEINATE_JOURNAL
+
+failed=0
+
+check() {
+    if [ "$(cat "$qos")" = "$2" ]; then
+        echo "ok: $1"
+    else
+        echo "FAILED: $1: expected \"$2\", found \"$(cat "$qos")\""
+        failed=1
+    fi
+}
+
+# usec, then how caffeinate is left: "exit" or "term".
+run() {
+    echo 0 > "$qos"
+    "$caffeinate" --backend none -l "$1" --cpus 0 sleep 5 &
+    wrapper=$!
+    sleep 0.5
+    if [ "$1" = 0 ]; then
+        check "-l 0 holds the strictest setting" "n/a"
+    else
+        check "-l $1 is written" "$1"
+    fi
+    if [ "$2" = term ]; then
+        kill -TERM $wrapper
+    else
+        pkill -x -P $wrapper sleep
+    fi
+    wait $wrapper
+    check "restored after $2" "0"
+}
+
+run 0 exit
+run 20 exit
+run 20 term
+
+# A killed caffeinate leaves its journal behind for the next one.
+echo 0 > "$qos"
+"$caffeinate" --backend none -l 20 --cpus 0 sleep 5 &
+wrapper=$!
+sleep 0.5
+utility=$(pgrep -x -P $wrapper sleep)
+kill -KILL $wrapper
+wait $wrapper 2>/dev/null
+kill $utility
+check "still held after SIGKILL" "20"
+"$caffeinate" --backend none -l 50 --cpus 0 true
+check "restored by the next caffeinate" "0"
+
+exit $failed
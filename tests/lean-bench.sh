@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Aggregate memory of many concurrent caffeinate wrappers, as on a host
+# running thousands of wrapped jobs, with and without --lean: how many
+# caffeinate processes stay resident and the sum of their proportional set
+# sizes (Pss, which splits shared pages between the processes sharing them).
+# The backend is none, so no power manager is needed.
+#
+#   tests/lean-bench.sh [caffeinate [wrappers]]
+#
+# Linux only; reads /proc.
+
+caffeinate=${1:-caffeinate}
+wrappers=${2:-1000}
+name=$(basename "$caffeinate" | cut -c1-15)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+export CAFFEINATE_STATUS CAFFEINATE_AUDIT
+
+# Starts the wrappers with the options given, reports, and stops them.
+bench() {
+    pids=
+    i=0
+    while [ $i -lt "$wrappers" ]; do
+        "$caffeinate" --backend none "$@" -i sleep 3600 &
+        pids="$pids $!"
+        i=$((i + 1))
+    done
+    sleep 2
+
+    resident=0
+    pss=0
+    for pid in $pids; do
+        [ "$(cat /proc/$pid/comm 2>/dev/null)" = "$name" ] || continue
+        resident=$((resident + 1))
+        pss=$((pss + $(awk '/^Pss:/ { print $2 }' /proc/$pid/smaps_rollup)))
+    done
+    echo "$resident resident, pss ${pss} kB"
+
+    for pid in $pids; do
+        pkill -P $pid sleep
+        kill $pid 2>/dev/null
+    done
+    wait
+}
+
+echo "plain:  $(bench)"
+echo "--lean: $(bench --lean)"
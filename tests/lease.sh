@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# caffeinate --lease on loopback: a coordinator and two nodes on
+# 127.0.0.1, one in a single job and one in two, renewed in one RENEW.
+# Nothing is asserted before the coordinator is up; both nodes hold their
+# assertions across several renewals; they let go within a TTL of the
+# coordinator stopping, and take them again once it is back.
+#
+#   tests/lease.sh [caffeinate [port]]
+#
+# Linux only. Exits non-zero if any check failed.
+
+caffeinate=${1:-caffeinate}
+port=${2:-47291}
+ttl=2
+work=$(mktemp -d)
+trap 'pkill -x -P "$first,$second" sleep; kill $server $first $second 2>/dev/null; rm -rf "$work"' EXIT
+
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+export CAFFEINATE_STATUS CAFFEINATE_AUDIT
+
+failed=0
+
+# what, pid, expected assertions ("" for not listed)
+check() {
+    found=$("$caffeinate" --status | awk -v pid="$2" '$1 == pid { print $4 }')
+    if [ "$found" = "$3" ]; then
+        echo "ok: $1"
+    else
+        echo "FAILED: $1: expected \"$3\", found \"$found\""
+        failed=1
+    fi
+}
+
+coordinator() {
+    "$caffeinate" --lease-server 127.0.0.1:$port --lease-ttl $ttl &
+    server=$!
+}
+
+"$caffeinate" --backend none -i --lease 127.0.0.1:$port/build sleep 30 &
+first=$!
+"$caffeinate" --backend none -i --lease 127.0.0.1:$port/build,index sleep 30 &
+second=$!
+sleep 0.5
+check "nothing held without a coordinator" $first ""
+
+coordinator
+# The nodes retry about once a second until the first grant.
+sleep 1.5
+check "single job held" $first "-i"
+check "two jobs held" $second "-i"
+
+sleep $((ttl * 2))
+check "single job kept across renewals" $first "-i"
+check "two jobs kept across renewals" $second "-i"
+
+kill $server
+wait $server 2>/dev/null
+sleep $((ttl + 1))
+check "released after the coordinator stopped" $first ""
+check "both released after the coordinator stopped" $second ""
+
+coordinator
+sleep 2
+check "held again after the coordinator restarted" $first "-i"
+check "both held again after the coordinator restarted" $second "-i"
+
+exit $failed
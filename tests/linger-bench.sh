@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Cost of wrapping many short utilities in caffeinate, with and without
+# --linger: backend calls (Inhibit/UnInhibit on tests/fakebus.py, through
+# the screensaver backend) and wall time per run, next to the bare utility.
+#
+#   tests/linger-bench.sh [caffeinate [runs]]
+#
+# Linux only. Takes about runs * 10 ms plus 6 s for the holder to let go.
+
+caffeinate=${1:-caffeinate}
+runs=${2:-200}
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'kill $bus 2>/dev/null; rm -rf "$work"' EXIT
+
+python3 "$tests/fakebus.py" "$work/bus" "$work/log" &
+bus=$!
+while [ ! -S "$work/bus" ]; do sleep 0.05; done
+
+DBUS_SESSION_BUS_ADDRESS=unix:path=$work/bus
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+XDG_RUNTIME_DIR=$work
+export DBUS_SESSION_BUS_ADDRESS CAFFEINATE_STATUS CAFFEINATE_AUDIT XDG_RUNTIME_DIR
+
+# Wall time of runs invocations of the command given, in microseconds per run.
+bench() {
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$runs" ]; do
+        "$@"
+        i=$((i + 1))
+    done
+    echo $((($(date +%s%N) - start) / runs / 1000))
+}
+
+calls() {
+    printf '%s inhibit, %s uninhibit' \
+        "$(grep -c '^INHIBIT' "$work/log")" "$(grep -c '^UNINHIBIT' "$work/log")"
+}
+
+bare=$(bench /bin/true)
+echo "bare:       ${bare} us per run"
+
+: > "$work/log"
+plain=$(bench "$caffeinate" --backend screensaver -d /bin/true)
+echo "plain:      ${plain} us per run, $(calls)"
+
+: > "$work/log"
+lingered=$(bench "$caffeinate" --backend screensaver -d --linger 5 /bin/true)
+sleep 6
+echo "--linger 5: ${lingered} us per run, $(calls)"
@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# caffeinate --perf, against a fake sysfs tree: the CPU's scaling_governor
+# is set to performance while the utility runs, or, where the driver has no
+# such governor, its energy_performance_preference is, and the previous
+# values are written back when it exits or caffeinate is sent SIGTERM, or
+# from the journal by the next caffeinate if it was killed.
+#
+#   tests/perf.sh [caffeinate]
+#
+# Linux only. Exits non-zero if any check failed.
+
+caffeinate=${1:-caffeinate}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cpufreq=$work/sys/devices/system/cpu/cpu0/cpufreq
+mkdir -p "$cpufreq"
+
+CAFFEINATE_SYSFS_ROOT=$work/sys
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+CAFFEINATE_JOURNAL=$work/journal
+export CAFFEINATE_SYSFS_ROOT CAFFEINATE_STATUS CAFFEINATE_AUDIT CAFFEINATE_JOURNAL
+
+failed=0
+
+# Governor, then preference.
+check() {
+    found="$(cat "$cpufreq/scaling_governor") $(cat "$cpufreq/energy_performance_preference")"
+    if [ "$found" = "$2" ]; then
+        echo "ok: $1"
+    else
+        echo "FAILED: $1: expected \"$2\", found \"$found\""
+        failed=1
+    fi
+}
+
+# Available governors, then how caffeinate is left: "exit", "term" or "kill".
+run() {
+    echo "$1" > "$cpufreq/scaling_available_governors"
+    echo powersave > "$cpufreq/scaling_governor"
+    echo balance_power > "$cpufreq/energy_performance_preference"
+    "$caffeinate" --backend none --perf --cpus 0 sleep 5 &
+    wrapper=$!
+    sleep 0.5
+    if [ "$1" = powersave ]; then
+        check "the preference is set without a performance governor" "powersave performance"
+    else
+        check "the governor is set" "performance balance_power"
+    fi
+    utility=$(pgrep -x -P $wrapper sleep)
+    case $2 in
+    term)   kill -TERM $wrapper ;;
+    kill)   kill -KILL $wrapper; kill $utility ;;
+    *)      kill $utility ;;
+    esac
+    wait $wrapper 2>/dev/null
+    if [ "$2" = kill ]; then
+        check "still set after SIGKILL" "performance balance_power"
+        "$caffeinate" --backend none --perf --cpus 0 true
+        check "restored by the next caffeinate" "powersave balance_power"
+    else
+        check "restored after $2" "powersave balance_power"
+    fi
+}
+
+run "performance powersave" exit
+run "performance powersave" term
+run powersave exit
+run powersave term
+run "performance powersave" kill
+
+exit $failed
@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# caffeinate -d in a desktop session, against tests/fakebus.py standing in
+# for the session bus: the screen saver is inhibited while the utility
+# runs, and the same cookie is uninhibited when it exits or caffeinate is
+# sent SIGTERM.
+#
+#   tests/screensaver.sh [caffeinate]
+#
+# Linux only. Exits non-zero if any check failed.
+
+caffeinate=${1:-caffeinate}
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'kill $bus 2>/dev/null; rm -rf "$work"' EXIT
+
+python3 "$tests/fakebus.py" "$work/bus" "$work/log" &
+bus=$!
+while [ ! -S "$work/bus" ]; do sleep 0.05; done
+
+DBUS_SESSION_BUS_ADDRESS=unix:path=$work/bus
+CAFFEINATE_STATUS=$work/status
+CAFFEINATE_AUDIT=$work/audit
+export DBUS_SESSION_BUS_ADDRESS CAFFEINATE_STATUS CAFFEINATE_AUDIT
+
+failed=0
+
+check() {
+    if grep -q "^$2\$" "$work/log"; then
+        echo "ok: $1"
+    else
+        echo "FAILED: $1: no \"$2\" in:"; sed 's/^/    /' "$work/log"
+        failed=1
+    fi
+}
+
+# Held while the utility runs, released once it exits.
+: > "$work/log"
+"$caffeinate" -d sleep 1 &
+wrapper=$!
+sleep 0.5
+check "inhibited while the utility runs" "INHIBIT 1 caffeinate .*"
+wait $wrapper
+check "uninhibited when the utility exits" "UNINHIBIT 1"
+
+# Released on SIGTERM, not just dropped with the connection.
+: > "$work/log"
+"$caffeinate" -d sleep 10 &
+wrapper=$!
+sleep 0.5
+check "inhibited again" "INHIBIT 2 caffeinate .*"
+kill -TERM $wrapper
+wait $wrapper
+check "uninhibited on SIGTERM" "UNINHIBIT 2"
+
+exit $failed